@@ -1,29 +1,226 @@
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <CLI11.h>
 #include <SDL.h>
 #include <SDL_image.h>
+#include <src/Allocations.h>
 #include <src/SdlEngine.h>
+#include <src/SharedPageCache.h>
+#include <src/Series.h>
 #include <src/Application.h>
+#include <src/BookLoader.h>
+#include <src/StartupStats.h>
+#include <src/Journal.h>
+#include <src/SpreadExporter.h>
+#include <src/IntegrityScanner.h>
+#include <src/PageCache.h>
+#include <src/DecodeScheduler.h>
+#include <src/PrefetchPlanner.h>
+#include <src/FontCache.h>
+#include <src/Workspace.h>
+#include <src/Metrics.h>
+#include <src/InputLog.h>
+#include <src/LibraryIndex.h>
+#include <src/ArchiveOptimizer.h>
 
-void application(std::string filename, std::string fontPath) {
-  app::Application application = app::Application(filename, fontPath);
+struct StatsOptions {
+  bool print = false;
+  std::string jsonPath = "";
+  // fail when the page turn p99 is over this many ms, 0 for never
+  double maxP99 = 0;
+};
 
-  // SDL_RenderClear(renderer);
-  // SDL_RenderCopy(renderer, tiles, NULL, NULL);
-  //SDL_RenderPresent(renderer);
+struct SessionOptions {
+  // log the keys of the session to this file
+  std::string recordPath = "";
+  // drive the windows from this recording instead, without showing them
+  std::string replayPath = "";
+  // replay at the recorded pace rather than as fast as possible
+  bool paced = false;
+};
 
-  while (application.isRunning()) {
-    application.processEvents();
+/**
+ * Print or write the performance report, and check the latency budget.
+ * The exit status for the process.
+ */
+int reportStats(StatsOptions options) {
+  app::Metrics& metrics = app::Metrics::global();
+  if (options.print) {
+    std::cout << "stats:" << std::endl;
+    metrics.print(std::cout);
   }
+  if (!options.jsonPath.empty()) {
+    std::ofstream out(options.jsonPath);
+    metrics.writeJson(out);
+    if (!out) {
+      std::cerr << tfm::format("failed to write stats to %s", options.jsonPath) << std::endl;
+      return 1;
+    }
+  }
+  double p99 = metrics.pageTurn.percentile(99);
+  if (options.maxP99 > 0 && p99 > options.maxP99) {
+    std::cerr << tfm::format("page turn p99 %.2f ms is over the limit of %.2f ms", p99, options.maxP99) << std::endl;
+    return 2;
+  }
+  return 0;
+}
+
+void application(
+    std::vector<std::string> filenames,
+    std::string fontPath,
+    bool startupStats,
+    bool verify,
+    size_t memoryBudget,
+    size_t sharedCache,
+    bool series,
+    app::PrefetchOptions prefetch,
+    SessionOptions session,
+    app::StartupStats* stats) {
+  if (filenames.empty()) {
+    throw app::Exception("no file to open, pass one with -f");
+  }
+  app::InputReplay* replay = NULL;
+  if (!session.replayPath.empty()) {
+    replay = new app::InputReplay(session.replayPath);
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+  }
+
+  // pages other reader processes decoded, if asked for; outlives every
+  // image borrowed from it
+  app::SharedPageCache shared(sharedCache * 1024 * 1024);
+  // every window's decoded pages count against one budget
+  app::PageCache cache = app::PageCache(memoryBudget * 1024 * 1024);
+
+  // as a series, one window reads the archives one after the other,
+  // starting in the volume read last
+  app::Series volumes(series ? app::Series::expand(filenames) : filenames, &cache, &shared);
+  size_t volume = 0;
+  if (series) {
+    volume = volumes.resumeVolume();
+    filenames = { volumes.getPath(volume) };
+  }
+
+  // resume where the reader left off, decoding that spread, its neighbours
+  // and a couple of frequently revisited spreads before the window shows.
+  // archive open and decode overlap with sdl and window setup
+  std::deque<app::Journal> journals;
+  std::deque<app::BookLoader> loaders;
+  for (std::string filename : filenames) {
+    journals.emplace_back(filename);
+    if (replay != NULL) {
+      journals.back().detach();
+    }
+    loaders.emplace_back(filename, journals.back().prewarm(2), &cache, &shared, stats);
+  }
+  app::SdlEngine sdl = app::SdlEngine(false);
+  stats->mark("sdl initialized");
+
+  app::FontCache fonts = app::FontCache();
+  app::DecodeScheduler scheduler = app::DecodeScheduler();
+  app::Workspace workspace = app::Workspace();
+  for (size_t i = 0; i < filenames.size(); i++) {
+    app::Application* window = new app::Application(
+        loaders[i], fontPath, &fonts, &scheduler, prefetch, &journals[i], stats);
+    workspace.add(window);
+    if (series) {
+      window->setSeries(&volumes, volume);
+    }
+    if (verify) {
+      window->verify(filenames[i]);
+    }
+  }
+  stats->mark("first pixel");
+  if (startupStats) {
+    stats->print(std::cout);
+  }
+
+  if (replay != NULL) {
+    workspace.replay(*replay, session.paced, std::cout);
+    delete replay;
+  } else {
+    app::InputRecorder* recorder = NULL;
+    if (!session.recordPath.empty()) {
+      recorder = new app::InputRecorder(session.recordPath);
+      workspace.record(recorder);
+    }
+    while (workspace.isRunning()) {
+      workspace.processEvents();
+    }
+    delete recorder;
+  }
+  app::Metrics::global().cacheHits = cache.getHits();
+  app::Metrics::global().cacheMisses = cache.getMisses();
 }
 
 int main(int argc, char** argv) {
+  app::Allocations::installSdl();
+  app::StartupStats stats = app::StartupStats();
   CLI::App app { "reader for comic book zip archives" };
-  std::string filename = "";
+  std::vector<std::string> filenames;
   std::string fontPath = "";
-  app.add_option("-f,--file", filename, "path to the cbz file to open");
+  bool startupStats = false;
+  bool verify = false;
+  size_t memoryBudget = 512;
+  size_t sharedCache = 0;
+  bool series = false;
+  app::PrefetchOptions prefetch;
+  StatsOptions statsOptions;
+  SessionOptions session;
+  app.add_option("-f,--file", filenames, "path to the cbz file to open, repeat to open several side by side");
   app.add_option("-t,--ttf", fontPath, "path to font to use for menus");
+  app.add_flag("--startup-stats", startupStats, "print time to first pixel and its stages");
+  app.add_flag("--series", series, "read the files, or the archives in the directories, given with -f as one series in one window");
+  app.add_flag("--verify", verify, "check every page against its checksum in the background");
+  app.add_option("--memory-budget", memoryBudget, "MiB of decoded pages to keep, shared by all windows");
+  app.add_option("--shared-cache", sharedCache, "MiB of shared memory to keep decoded pages in for other reader processes, 0 for none");
+  app.add_option("--prefetch-budget", prefetch.budget, "pages to decode ahead after each page turn");
+  app.add_flag("--prefetch-stats", prefetch.report, "print prefetch hit rate and wasted decoding on exit");
+  app.add_flag("--stats", statsOptions.print, "print page turn, decode and upload latency percentiles on exit, and heap use per subsystem when CBZREADER_ALLOCATIONS is set");
+  app.add_option("--stats-json", statsOptions.jsonPath, "write the stats to a json file on exit");
+  app.add_option("--record", session.recordPath, "log every key press to a file, to replay later");
+  app.add_option("--replay", session.replayPath, "replay a recorded session without a visible window and print each key's latency");
+  app.add_flag("--replay-paced", session.paced, "replay at the recorded pace instead of as fast as possible");
+  app.add_option("--max-p99", statsOptions.maxP99, "exit with status 2 if the page turn p99 is over this many ms");
+
+  app::ExportOptions exportOptions;
+  bool rightToLeft = false;
+  CLI::App* render = app.add_subcommand("render", "render spreads to image files without a window");
+  render->add_option("-f,--file", exportOptions.path, "path to the cbz file to render")->required();
+  render->add_option("-o,--output", exportOptions.outputDir, "directory to write images to");
+  render->add_option("--first", exportOptions.first, "first page to render");
+  render->add_option("--last", exportOptions.last, "last page to render, default: the whole book");
+  render->add_flag("--rtl", rightToLeft, "lay spreads out right to left");
+  render->add_option("--width", exportOptions.width, "image width");
+  render->add_option("--height", exportOptions.height, "image height");
+  render->add_option("--format", exportOptions.format, "png or jpg");
+  render->add_option("--quality", exportOptions.quality, "jpg quality");
+  render->add_option("-j,--jobs", exportOptions.jobs, "worker threads, default: one per core");
+
+  app::OptimizeOptions optimizeOptions;
+  CLI::App* optimize = app.add_subcommand("optimize", "repack an archive for fast reading: pages in reading order, stored, optionally downscaled");
+  optimize->add_option("-f,--file", optimizeOptions.path, "path to the cbz file to optimize")->required();
+  optimize->add_option("-o,--output", optimizeOptions.outputPath, "where to write the result, default: <name>.optimized.cbz next to it");
+  optimize->add_option("--max-width", optimizeOptions.maxWidth, "scale wider pages down and re-encode them as jpg");
+  optimize->add_option("--max-height", optimizeOptions.maxHeight, "scale taller pages down and re-encode them as jpg");
+  optimize->add_option("--quality", optimizeOptions.quality, "jpg quality of re-encoded pages");
+  optimize->add_option("-j,--jobs", optimizeOptions.jobs, "worker threads, default: one per core");
+
+  app::IndexOptions indexOptions;
+  CLI::App* index = app.add_subcommand("index", "index the ComicInfo.xml of every archive in a library, or refresh the index");
+  index->add_option("-d,--dir", indexOptions.paths, "directory to look for archives in, recursively, or an archive; repeat for several")->required();
+  index->add_option("--index", indexOptions.indexPath, "index file, default: one in the user's pref path");
+  index->add_option("-j,--jobs", indexOptions.jobs, "worker threads, default: one per core");
+
+  std::vector<std::string> query;
+  std::string searchIndexPath;
+  CLI::App* search = app.add_subcommand("search", "find archives in the index, e.g. writer:moore series:swamp tags:horror");
+  search->add_option("query", query, "words to match, \"field:word\" for one field, ending in * for a prefix")->required();
+  search->add_option("--index", searchIndexPath, "index file, default: one in the user's pref path");
 
   try {
     app.parse(argc, argv);
@@ -31,17 +228,113 @@ int main(int argc, char** argv) {
     return app.exit(e);
   }
 
-  try {
-    app::SdlEngine sdl = app::SdlEngine();
+  if (*render) {
+    exportOptions.leftToRight = !rightToLeft;
+    try {
+      app::SpreadExporter exporter = app::SpreadExporter(exportOptions);
+      exporter.run(std::cout);
+      return reportStats(statsOptions);
+    } catch (const std::exception& e) {
+      std::cerr << "render failed: " << std::endl
+          << e.what() << std::endl;
+      return 1;
+    } catch (...) {
+      std::cerr << "render failed" << std::endl;
+      return 1;
+    }
+  }
 
-    // wait for dlls to load
-    SDL_Delay(500);
+  if (*optimize) {
+    try {
+      app::SdlEngine::initImage();
+      app::ArchiveOptimizer optimizer = app::ArchiveOptimizer(optimizeOptions);
+      optimizer.run(std::cout);
+      IMG_Quit();
+      return 0;
+    } catch (const std::exception& e) {
+      std::cerr << "optimize failed: " << std::endl
+          << e.what() << std::endl;
+      return 1;
+    } catch (...) {
+      std::cerr << "optimize failed" << std::endl;
+      return 1;
+    }
+  }
+
+  if (*index) {
+    // the default makes the pref directory, so only look it up when needed
+    if (indexOptions.indexPath.empty()) {
+      indexOptions.indexPath = app::LibraryIndex::defaultPath();
+    }
+    try {
+      app::LibraryIndexer indexer = app::LibraryIndexer(indexOptions);
+      indexer.run(std::cout);
+      return 0;
+    } catch (const std::exception& e) {
+      std::cerr << "index failed: " << std::endl
+          << e.what() << std::endl;
+      return 1;
+    } catch (...) {
+      std::cerr << "index failed" << std::endl;
+      return 1;
+    }
+  }
 
-    application(filename, fontPath);
+  if (*search) {
+    if (searchIndexPath.empty()) {
+      searchIndexPath = app::LibraryIndex::defaultPath();
+    }
+    try {
+      if (!std::filesystem::exists(searchIndexPath)) {
+        std::cerr << tfm::format("no index at %s, build one with the index subcommand", searchIndexPath) << std::endl;
+        return 1;
+      }
+      std::string words;
+      for (std::string word : query) {
+        words += word + " ";
+      }
+      auto start = std::chrono::steady_clock::now();
+      app::LibraryIndex library = app::LibraryIndex(searchIndexPath);
+      std::vector<uint32_t> matches = library.search(words);
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      for (uint32_t match : matches) {
+        app::ComicInfo info = library.getInfo(match);
+        std::cout << tfm::format("%s\t%s #%s %s",
+            library.getPath(match),
+            info.fields[app::ComicInfo::Series],
+            info.fields[app::ComicInfo::Number],
+            info.fields[app::ComicInfo::Title]) << std::endl;
+      }
+      std::cout << tfm::format("%d of %d archives in %.2f ms", matches.size(), library.size(), elapsed.count()) << std::endl;
+      return matches.empty() ? 1 : 0;
+    } catch (const std::exception& e) {
+      std::cerr << "search failed: " << std::endl
+          << e.what() << std::endl;
+      return 1;
+    } catch (...) {
+      std::cerr << "search failed" << std::endl;
+      return 1;
+    }
+  }
+
+  try {
+    application(filenames, fontPath, startupStats, verify, memoryBudget, sharedCache, series, prefetch, session, &stats);
+    // everything the windows and their books owned is gone by now
+    if (app::Allocations::isEnabled()) {
+      app::Allocations::global().checkLeaks(std::cerr);
+    }
   } catch (const std::exception& e) {
     std::cerr << "application exited with error: " << std::endl
         << e.what() << std::endl;
+    if (!session.replayPath.empty()) {
+      return 1;
+    }
+  } catch (...) {
+    std::cerr << "application exited with error" << std::endl;
+    if (!session.replayPath.empty()) {
+      return 1;
+    }
   }
 
-  return 0;
+  return reportStats(statsOptions);
 }
@@ -0,0 +1,265 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <SDL.h>
+#include <tinyformat.h>
+
+namespace app {
+
+  /**
+   * Heap use per subsystem, for finding out where memory goes.
+   *
+   * Off unless CBZREADER_ALLOCATIONS is set in the environment. When it is,
+   * every operator new, and every SDL_malloc once installSdl has run, gets
+   * a small header recording its size and the subsystem tagged on the
+   * allocating thread by an AllocationTag, and frees are charged back to
+   * that subsystem. The choice is made at the first allocation, before
+   * main, so a block is never freed under the other scheme. Off, the cost
+   * is one well predicted branch per new and delete.
+   *
+   * Only the heap is seen: memory the GPU driver or libraries calling
+   * malloc themselves, like zlib and libjpeg-turbo, hold isn't counted.
+   */
+  class Allocations {
+    public:
+      enum Subsystem { Other, Archive, Decode, Texture, Text, Book, SUBSYSTEMS };
+
+    private:
+      struct Header {
+        uint64_t size;
+        uint64_t subsystem;
+      };
+      static_assert(sizeof(Header) % alignof(std::max_align_t) == 0,
+          "the header must keep blocks aligned like malloc's");
+
+      struct Counters {
+        std::atomic<uint64_t> allocations { 0 };
+        std::atomic<uint64_t> frees { 0 };
+        std::atomic<uint64_t> bytes { 0 };
+        std::atomic<uint64_t> live { 0 };
+        std::atomic<uint64_t> peak { 0 };
+      };
+
+      Counters counters[SUBSYSTEMS];
+
+      constexpr Allocations() {
+      }
+
+      static const char* nameOf(int subsystem) {
+        static const char* names[] = { "other", "archive", "decode", "texture", "text", "book" };
+        return names[subsystem];
+      }
+
+      void allocated(uint64_t subsystem, uint64_t size) {
+        Counters& counters = this->counters[subsystem];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.bytes.fetch_add(size, std::memory_order_relaxed);
+        uint64_t live = counters.live.fetch_add(size, std::memory_order_relaxed) + size;
+        uint64_t peak = counters.peak.load(std::memory_order_relaxed);
+        while (live > peak
+            && !counters.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+        }
+      }
+
+      void freed(uint64_t subsystem, uint64_t size) {
+        Counters& counters = this->counters[subsystem];
+        counters.frees.fetch_add(1, std::memory_order_relaxed);
+        counters.live.fetch_sub(size, std::memory_order_relaxed);
+      }
+
+      static Header* headerOf(void* block) {
+        return static_cast<Header*>(block) - 1;
+      }
+
+      static void* sdlCalloc(size_t count, size_t size) {
+        if (size != 0 && count > SIZE_MAX / size) {
+          return NULL;
+        }
+        void* block = allocate(count * size);
+        if (block != NULL) {
+          std::memset(block, 0, count * size);
+        }
+        return block;
+      }
+
+    public:
+      /**
+       * the subsystem the current thread's allocations are charged to
+       */
+      static Subsystem& current() {
+        static thread_local Subsystem subsystem = Other;
+        return subsystem;
+      }
+
+      static bool isEnabled() {
+        // decided once, at the first allocation of the process
+        static int state = 0;
+        if (state == 0) {
+          const char* setting = std::getenv("CBZREADER_ALLOCATIONS");
+          state = setting != NULL && *setting != '\0' && std::strcmp(setting, "0") != 0 ? 2 : 1;
+        }
+        return state == 2;
+      }
+
+      static Allocations& global() {
+        static Allocations allocations;
+        return allocations;
+      }
+
+      /**
+       * malloc, counted; NULL when out of memory
+       */
+      static void* allocate(size_t size) {
+        if (size > SIZE_MAX - sizeof(Header)) {
+          return NULL;
+        }
+        Header* header = static_cast<Header*>(std::malloc(sizeof(Header) + size));
+        if (header == NULL) {
+          return NULL;
+        }
+        header->size = size;
+        header->subsystem = current();
+        global().allocated(header->subsystem, size);
+        return header + 1;
+      }
+
+      static void release(void* block) {
+        if (block == NULL) {
+          return;
+        }
+        Header* header = headerOf(block);
+        global().freed(header->subsystem, header->size);
+        std::free(header);
+      }
+
+      /**
+       * realloc, counted; the block stays with the subsystem that made it
+       */
+      static void* reallocate(void* block, size_t size) {
+        if (block == NULL) {
+          return allocate(size);
+        }
+        if (size > SIZE_MAX - sizeof(Header)) {
+          return NULL;
+        }
+        Header* header = headerOf(block);
+        uint64_t subsystem = header->subsystem;
+        uint64_t previous = header->size;
+        Header* moved = static_cast<Header*>(std::realloc(header, sizeof(Header) + size));
+        if (moved == NULL) {
+          return NULL;
+        }
+        moved->size = size;
+        global().freed(subsystem, previous);
+        global().allocated(subsystem, size);
+        return moved + 1;
+      }
+
+      /**
+       * Count SDL's allocations too, SDL_image's and SDL_ttf's included.
+       * Call before anything else in SDL.
+       */
+      static void installSdl() {
+        if (isEnabled()) {
+          SDL_SetMemoryFunctions(allocate, sdlCalloc, reallocate, release);
+        }
+      }
+
+      void print(std::ostream& out) {
+        out << tfm::format("  %-24s %10s %10s %10s %10s", "allocations", "count", "MiB", "live MiB", "peak MiB") << std::endl;
+        for (int subsystem = 0; subsystem < SUBSYSTEMS; subsystem++) {
+          Counters& counters = this->counters[subsystem];
+          out << tfm::format("  %-24s %10d %10.1f %10.2f %10.2f", nameOf(subsystem),
+              counters.allocations.load(), counters.bytes / 1048576.0,
+              counters.live / 1048576.0, counters.peak / 1048576.0) << std::endl;
+        }
+      }
+
+      void writeJson(std::ostream& out) {
+        out << "{";
+        for (int subsystem = 0; subsystem < SUBSYSTEMS; subsystem++) {
+          Counters& counters = this->counters[subsystem];
+          out << (subsystem == 0 ? "" : ",") << std::endl << tfm::format(
+              "    \"%s\": {\"allocations\": %d, \"frees\": %d, \"bytes\": %d, \"live\": %d, \"peak\": %d}",
+              nameOf(subsystem), counters.allocations.load(), counters.frees.load(),
+              counters.bytes.load(), counters.live.load(), counters.peak.load());
+        }
+        out << std::endl << "  }";
+      }
+
+      /**
+       * Report what the tagged subsystems still hold, for calling once
+       * everything they own should be gone. Untagged allocations are left
+       * out, static objects and the runtime's own keep some until exit.
+       * True if anything was still held.
+       */
+      bool checkLeaks(std::ostream& out) {
+        bool leaked = false;
+        for (int subsystem = Other + 1; subsystem < SUBSYSTEMS; subsystem++) {
+          Counters& counters = this->counters[subsystem];
+          uint64_t blocks = counters.allocations - counters.frees;
+          if (blocks > 0) {
+            out << tfm::format("leak: %s still holds %d bytes in %d allocations",
+                nameOf(subsystem), counters.live.load(), blocks) << std::endl;
+            leaked = true;
+          }
+        }
+        return leaked;
+      }
+  };
+
+  /**
+   * Charges the allocations the current thread makes while it lives to a
+   * subsystem, then goes back to the one before
+   */
+  class AllocationTag {
+    private:
+      Allocations::Subsystem previous;
+
+    public:
+      AllocationTag(Allocations::Subsystem subsystem) {
+        this->previous = Allocations::current();
+        Allocations::current() = subsystem;
+      }
+
+      ~AllocationTag() {
+        Allocations::current() = this->previous;
+      }
+
+      AllocationTag(const AllocationTag&) = delete;
+      AllocationTag& operator=(const AllocationTag&) = delete;
+  };
+
+}
+
+void* operator new(size_t size) {
+  while (true) {
+    void* block = app::Allocations::isEnabled()
+        ? app::Allocations::allocate(size == 0 ? 1 : size)
+        : std::malloc(size == 0 ? 1 : size);
+    if (block != NULL) {
+      return block;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void operator delete(void* block) noexcept {
+  if (app::Allocations::isEnabled()) {
+    app::Allocations::release(block);
+  } else {
+    std::free(block);
+  }
+}
+
+void operator delete(void* block, size_t) noexcept {
+  operator delete(block);
+}
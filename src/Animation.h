@@ -0,0 +1,219 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "Allocations.h"
+#include "FrameDecoder.h"
+#include "Metrics.h"
+#include "Page.h"
+
+namespace app {
+
+  /**
+   * Plays an animated page back.
+   *
+   * A thread composes frames ahead into a ring of FRAMES buffers, and
+   * waits while the ring is full. The window's loop asks advance
+   * whether the next frame is due and, if it is, uploads it into the
+   * next of a ring of TEXTURES streaming textures. The texture on screen
+   * is never the one being written. Memory stays the same however many
+   * frames the image has: the encoded image, one canvas and the two rings.
+   *
+   * Frames whose time has passed before the window got to them are
+   * skipped and counted as dropped. A frame that isn't decoded yet when
+   * it is due is late: the current frame stays up until it arrives.
+   * While paused, nothing is uploaded and the thread stops once the ring
+   * is full.
+   */
+  class Animation {
+    private:
+      static constexpr int FRAMES = 3;
+      static constexpr int TEXTURES = 2;
+
+      struct Frame {
+        std::vector<uint32_t> pixels;
+        // ms the frame shows for
+        int delay = 0;
+      };
+
+      FrameDecoder* decoder;
+      int width;
+      int height;
+      SDL_Texture* textures[TEXTURES] = { NULL, NULL };
+      // the texture showing the current frame, -1 before the first upload
+      int shown = -1;
+      Frame frames[FRAMES];
+      // frames decoded and shown, so far; the ring holds produced - consumed
+      uint64_t produced = 0;
+      uint64_t consumed = 0;
+      bool stopping = false;
+      std::atomic<bool> failed { false };
+      std::mutex lock;
+      std::condition_variable wake;
+      std::thread worker;
+      // when the next frame goes up
+      std::chrono::steady_clock::time_point due;
+      bool paused = false;
+      bool late = false;
+
+      void work() {
+        AllocationTag tag(Allocations::Decode);
+        std::vector<uint32_t> canvas((size_t) this->width * this->height, 0);
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true) {
+          this->wake.wait(guard, [&]() {
+            return this->stopping || this->produced - this->consumed < FRAMES;
+          });
+          if (this->stopping) {
+            return;
+          }
+          guard.unlock();
+          int delay = 0;
+          try {
+            auto start = std::chrono::steady_clock::now();
+            delay = this->decoder->next(canvas.data());
+            Metrics::global().frameDecode.record(std::chrono::steady_clock::now() - start);
+          } catch (ImageOpenException& e) {
+            this->failed = true;
+            return;
+          }
+          // only the consumer moves consumed, and it never reads the slot
+          // past produced
+          Frame& frame = this->frames[this->produced % FRAMES];
+          frame.pixels.assign(canvas.begin(), canvas.end());
+          frame.delay = delay;
+          guard.lock();
+          this->produced++;
+        }
+      }
+
+    public:
+      /**
+       * Takes ownership of the decoder. Throws ImageOpenException if the
+       * renderer can't make the textures.
+       */
+      Animation(SDL_Renderer* renderer, FrameDecoder* decoder) {
+        this->decoder = decoder;
+        this->width = decoder->getWidth();
+        this->height = decoder->getHeight();
+        AllocationTag tag(Allocations::Texture);
+        for (int i = 0; i < TEXTURES; i++) {
+          this->textures[i] = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+              SDL_TEXTUREACCESS_STREAMING, this->width, this->height);
+          if (this->textures[i] == NULL) {
+            for (int j = 0; j < i; j++) {
+              SDL_DestroyTexture(this->textures[j]);
+            }
+            delete decoder;
+            throw ImageOpenException(tfm::format(
+                "Failed to create animation texture, reason: %s",
+                SDL_GetError()));
+          }
+          SDL_SetTextureBlendMode(this->textures[i], SDL_BLENDMODE_BLEND);
+        }
+        this->due = std::chrono::steady_clock::now();
+        this->worker = std::thread(&Animation::work, this);
+      }
+
+      ~Animation() {
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          this->stopping = true;
+        }
+        this->wake.notify_all();
+        this->worker.join();
+        for (SDL_Texture* texture : this->textures) {
+          SDL_DestroyTexture(texture);
+        }
+        delete this->decoder;
+      }
+
+      /**
+       * Stop or restart playback. Playback restarts with the frame after
+       * the one showing, not with the ones missed while paused.
+       */
+      void pause(bool paused) {
+        if (this->paused && !paused) {
+          this->due = std::chrono::steady_clock::now();
+        }
+        this->paused = paused;
+      }
+
+      /**
+       * Upload the frame due by now, if any.
+       * True if the current texture changed.
+       */
+      bool advance(std::chrono::steady_clock::time_point now) {
+        if (this->paused || now < this->due) {
+          return false;
+        }
+        std::unique_lock<std::mutex> guard(this->lock);
+        if (this->produced == this->consumed) {
+          // the first frame can't be late, the page's own image is up
+          if (!this->late && !this->failed && this->shown >= 0) {
+            Metrics::global().framesLate++;
+          }
+          this->late = true;
+          return false;
+        }
+        this->late = false;
+        // a frame that should already have been replaced is skipped,
+        // unless it is the last one decoded
+        while (this->produced - this->consumed > 1
+            && now >= this->due + std::chrono::milliseconds(this->frames[this->consumed % FRAMES].delay)) {
+          this->due += std::chrono::milliseconds(this->frames[this->consumed % FRAMES].delay);
+          this->consumed++;
+          Metrics::global().framesDropped++;
+        }
+        Frame& frame = this->frames[this->consumed % FRAMES];
+        guard.unlock();
+
+        int texture = (this->shown + 1) % TEXTURES;
+        AllocationTag tag(Allocations::Texture);
+        SDL_UpdateTexture(this->textures[texture], NULL, frame.pixels.data(), this->width * 4);
+        this->shown = texture;
+        this->due += std::chrono::milliseconds(frame.delay);
+        // far behind, after a stall: keep time from now instead of racing
+        // through frames to catch up
+        if (this->due + std::chrono::seconds(1) < now) {
+          this->due = now + std::chrono::milliseconds(frame.delay);
+        }
+        Metrics::global().framesShown++;
+
+        guard.lock();
+        this->consumed++;
+        guard.unlock();
+        this->wake.notify_one();
+        return true;
+      }
+
+      /**
+       * ms until the next frame is due, a few to look again if it is late;
+       * -1 when paused or when the decoder gave up
+       */
+      int untilDue(std::chrono::steady_clock::time_point now) {
+        if (this->paused || this->failed) {
+          return -1;
+        }
+        if (this->late) {
+          return 4;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(this->due - now).count();
+        return left < 0 ? 0 : (int) left;
+      }
+
+      /**
+       * the texture of the frame showing, NULL before the first one
+       */
+      SDL_Texture* getTexture() {
+        return this->shown < 0 ? NULL : this->textures[this->shown];
+      }
+  };
+
+}
@@ -1,28 +1,35 @@
 #pragma once
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
 #include <SDL.h>
 #include <neither.h>
 #include "SdlWindow.h"
+#include "Allocations.h"
+#include "Animation.h"
 #include "Book.h"
+#include "BookLoader.h"
 #include "Layout.h"
 #include "Input.h"
 #include "TextBox.h"
+#include "StartupStats.h"
+#include "Journal.h"
+#include "DecodeScheduler.h"
+#include "PrefetchPlanner.h"
+#include "FontCache.h"
+#include "IntegrityScanner.h"
+#include "Scene.h"
+#include "Scaler.h"
+#include "Series.h"
+#include "Metrics.h"
+#include "Key.h"
+#include "InputLog.h"
 
 namespace app {
 
-  enum class Key {
-    Next,
-    Prev,
-    Exit,
-    SwapOdd,
-    SwapDirection,
-    Fullscreen,
-    GoToPage,
-    ToggleStatusBar,
-    Help,
-  };
-
   class Application {
       std::string fontPath;
       bool statusBar = true;
@@ -32,6 +39,52 @@ namespace app {
       int page = 0;
       app::Book* book;
       app::SdlWindow* window;
+      app::Journal* journal;
+      app::DecodeScheduler* scheduler;
+      app::PrefetchPlanner* planner;
+      app::PrefetchOptions prefetchOptions;
+      app::FontCache* fonts;
+      app::IntegrityScanner* scanner = NULL;
+      bool verifying = false;
+      // the series the book is a volume of, NULL for a book on its own
+      app::Series* series = NULL;
+      size_t volume = 0;
+      // the journal of a volume opened after the first, which we own
+      app::Journal* volumeJournal = NULL;
+      app::Scene scene;
+      // the spread on screen, kept so relayout and overlays don't decode again
+      app::Page* leftPage = NULL;
+      app::Page* rightPage = NULL;
+      // playback of the pages on screen that are animated, NULL for still
+      // ones; paused while the window is hidden
+      app::Animation* leftAnimation = NULL;
+      app::Animation* rightAnimation = NULL;
+      bool hidden = false;
+      // waits for a book that is still being copied to grow, and tells
+      // the window with a grownEvent
+      std::thread watcher;
+      std::atomic<bool> watching { false };
+      // a grownEvent is queued and not handled yet
+      std::atomic<bool> growthPending { false };
+      int shownPage = -1;
+      bool shownLeftToRight = true;
+      app::TextBox* statusBox = NULL;
+      app::RenderedText* statusText = NULL;
+      bool helpVisible = false;
+      app::RenderedText* helpNames = NULL;
+      app::RenderedText* helpButtons = NULL;
+      SDL_Rect helpNamesLoc = { 0, 0, 0, 0 };
+      SDL_Rect helpButtonsLoc = { 0, 0, 0, 0 };
+      // pages scaled for a software renderer
+      app::ScaledPages* scaled;
+      // when the input being handled happened, and when the first page turn
+      // not yet on screen did
+      std::chrono::steady_clock::time_point inputAt;
+      std::chrono::steady_clock::time_point turnedAt;
+      bool turnPending = false;
+      // which of the opened books this is, for recordings
+      size_t number = 0;
+      app::InputRecorder* recorder = NULL;
       std::unordered_map<SDL_Keycode, Key> keyMap = {
           { SDLK_ESCAPE, Key::Exit },
           { SDLK_SPACE, Key::Next },
@@ -54,48 +107,254 @@ namespace app {
 
     public:
 
+      /**
+       * One window reading one book. Windows share the decode threads, the
+       * page cache the loader's book was given, and the fonts.
+       */
       Application(
-          std::string path,
-          std::string fontPath) {
+          app::BookLoader& loader,
+          std::string fontPath,
+          app::FontCache* fonts,
+          app::DecodeScheduler* scheduler,
+          app::PrefetchOptions prefetchOptions,
+          app::Journal* journal,
+          app::StartupStats* stats) {
         this->window = new SdlWindow(
             "cbzreader",
             SDL_WINDOWPOS_UNDEFINED,
             SDL_WINDOWPOS_UNDEFINED,
             800,
             600);
+        stats->mark("window created");
 
         for (auto entry : this->keyMap) {
           reversedKeyMap[entry.second] = entry.first;
         }
 
-        this->book = new Book(
-            this->window->getRenderer(),
-            path);
+        try {
+          this->book = loader.get();
+        } catch (...) {
+          delete this->window;
+          throw;
+        }
+        this->book->setRenderer(this->window->getRenderer());
+        this->book->setPlanar(this->window->supportsTextureFormat(SDL_PIXELFORMAT_IYUV));
+        stats->mark("book ready");
+
+        this->journal = journal;
+        if (journal->getPage() >= 0 && (size_t) journal->getPage() < this->book->size()) {
+          this->page = journal->getPage();
+        }
+        this->leftToRight = journal->isLeftToRight();
 
         this->fontPath = fontPath;
+        this->scaled = new ScaledPages(4);
+        this->fonts = fonts;
+        this->scheduler = scheduler;
+        this->prefetchOptions = prefetchOptions;
+        this->planner = new PrefetchPlanner(this->book->size(), prefetchOptions.budget);
+
+        this->startWatching();
 
         this->redraw();
       }
 
       ~Application() {
+        // the watcher, the scanner and the decode threads use the book
+        this->stopWatching();
+        delete this->scanner;
+        this->scheduler->cancel(this->book);
+        if (this->prefetchOptions.report) {
+          std::cout << tfm::format("prefetch: %s", this->book->getPath()) << std::endl;
+          this->planner->report(std::cout);
+        }
+        delete this->planner;
+        delete this->scaled;
+        delete this->leftAnimation;
+        delete this->rightAnimation;
+        delete this->leftPage;
+        delete this->rightPage;
+        this->releaseText();
         delete this->book;
+        delete this->volumeJournal;
         delete this->window;
       }
 
+      app::Book* getBook() {
+        return this->book;
+      }
+
+      /**
+       * The SDL event type a window gets when its book grew, with the
+       * window's id in user.windowID
+       */
+      static Uint32 grownEvent() {
+        static Uint32 type = SDL_RegisterEvents(1);
+        return type;
+      }
+
+      void startWatching() {
+        if (this->book->isGrowing()) {
+          this->watching = true;
+          this->growthPending = false;
+          this->watcher = std::thread(&Application::watch, this->book, this->window->getId(),
+              std::ref(this->watching), std::ref(this->growthPending));
+        }
+      }
+
+      void stopWatching() {
+        this->watching = false;
+        if (this->watcher.joinable()) {
+          this->watcher.join();
+        }
+      }
+
+      /**
+       * Post a grownEvent whenever the book's file is written to, one at a
+       * time and at most every GROWTH_INTERVAL_MS, until it stops growing
+       * or watching is cleared.
+       */
+      static void watch(Book* book, Uint32 windowId, std::atomic<bool>& watching, std::atomic<bool>& pending) {
+        static constexpr int GROWTH_INTERVAL_MS = 250;
+        while (watching && book->isGrowing()) {
+          if (!book->waitForChange(GROWTH_INTERVAL_MS) || pending.exchange(true)) {
+            continue;
+          }
+          SDL_Event event = {};
+          event.type = grownEvent();
+          event.user.windowID = windowId;
+          if (SDL_PushEvent(&event) < 1) {
+            pending = false;
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(GROWTH_INTERVAL_MS));
+        }
+      }
+
+      Uint32 getWindowId() {
+        return this->window->getId();
+      }
+
+      /**
+       * check every page of the book against its checksum in the background
+       */
+      void verify(std::string path) {
+        this->verifying = true;
+        if (this->book->isGrowing()) {
+          std::cerr << tfm::format("%s is still being written, not verifying it", path) << std::endl;
+          return;
+        }
+        if (this->scanner == NULL) {
+          this->scanner = new IntegrityScanner(this->book, path);
+        }
+      }
+
+      /**
+       * Read the book as one volume of a series, going on into the next
+       * volume past its end and back into the one before past its start
+       */
+      void setSeries(app::Series* series, size_t volume) {
+        this->series = series;
+        this->volume = volume;
+        this->scene.mark(Layer::StatusBar);
+        this->lookAhead();
+      }
+
       bool isRunning() {
         return this->running;
       }
 
-      void processEvents() {
-        SDL_Event event;
-        if (!SDL_WaitEvent(&event)) {
-          return;
+      int getPage() {
+        return this->page;
+      }
+
+      size_t getNumber() {
+        return this->number;
+      }
+
+      void setNumber(size_t number) {
+        this->number = number;
+      }
+
+      /**
+       * Log every key this window handles from now on, starting with where
+       * it is
+       */
+      void record(app::InputRecorder* recorder) {
+        this->recorder = recorder;
+        recorder->opened(this->number, this->page, this->leftToRight);
+      }
+
+      /**
+       * Put the window where a recording started
+       */
+      void restore(int page, bool leftToRight) {
+        if (page >= 0 && (size_t) page < this->book->size()) {
+          this->page = page;
         }
+        this->leftToRight = leftToRight;
+        this->pageChanged();
+      }
+
+      /**
+       * Handle a recorded key as if it had just been pressed.
+       * page is where GoToPage goes, ignored for other keys.
+       */
+      void replay(Key key, int page) {
+        this->inputAt = std::chrono::steady_clock::now();
+        this->processKey(key, page);
+      }
 
+      /**
+       * ms until an animated page on screen wants its next frame, -1 if
+       * none does
+       */
+      int nextFrameIn() {
+        int soonest = -1;
+        auto now = std::chrono::steady_clock::now();
+        for (Animation* animation : { this->leftAnimation, this->rightAnimation }) {
+          int due = animation == NULL ? -1 : animation->untilDue(now);
+          if (due >= 0 && (soonest < 0 || due < soonest)) {
+            soonest = due;
+          }
+        }
+        return soonest;
+      }
+
+      /**
+       * Move animated pages on to the frame due by now, marking the frame
+       * dirty if one did
+       */
+      void animate() {
+        auto now = std::chrono::steady_clock::now();
+        for (Animation* animation : { this->leftAnimation, this->rightAnimation }) {
+          if (animation != NULL && animation->advance(now)) {
+            this->scene.mark(Layer::Frames);
+          }
+        }
+      }
+
+      /**
+       * Draw a frame, only if something visible changed since the last one
+       */
+      void redrawIfDirty() {
+        if (this->running && this->scene.isDirty()) {
+          this->redraw();
+        }
+      }
+
+      void processEvent(SDL_Event& event) {
         if (event.type == SDL_QUIT) {
           this->running = false;
 
+        } else if (event.type == SDL_KEYDOWN && this->helpVisible) {
+          // any key dismisses help, one without a binding as Help so a
+          // recording replays the dismissal too
+          this->received(event);
+          auto bound = this->keyMap.find(event.key.keysym.sym);
+          processKey(bound == this->keyMap.end() ? Key::Help : bound->second);
+
         } else if (event.type == SDL_MOUSEBUTTONDOWN) {
+          this->received(event);
           unsigned int buttonCode = event.button.button;
           size_t count = this->mouseMap.count(buttonCode);
           if (count == 0) {
@@ -107,6 +366,7 @@ namespace app {
           // SDL generates fake key presses if a button is held
           // the repeat field lets us know if it isn't the initial press
         } else if (event.type == SDL_KEYDOWN && event.key.repeat == 0) {
+          this->received(event);
           SDL_Keycode keycode = event.key.keysym.sym;
           size_t count = this->keyMap.count(keycode);
           if (count == 0) {
@@ -121,11 +381,86 @@ namespace app {
         } else if (event.type == SDL_WINDOWEVENT) {
           if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
             this->running = false;
+          } else if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+            this->window->resized();
+            this->scene.mark(Layer::Layout);
+          } else if (event.window.event == SDL_WINDOWEVENT_FOCUS_GAINED) {
+            this->scheduler->setFocus(this->book);
+          } else if (event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+            // the contents were lost, the layout is still good
+            this->scene.mark(Layer::Layout);
+          } else if (event.window.event == SDL_WINDOWEVENT_HIDDEN
+              || event.window.event == SDL_WINDOWEVENT_MINIMIZED) {
+            this->setHidden(true);
+          } else if (event.window.event == SDL_WINDOWEVENT_SHOWN
+              || event.window.event == SDL_WINDOWEVENT_RESTORED) {
+            this->setHidden(false);
+          }
+
+        } else if (event.type == grownEvent()) {
+          this->grown();
+        }
+      }
+
+      /**
+       * Take in the pages that landed in a book that is being copied,
+       * staying on the page being read even if the finished archive puts
+       * it somewhere else
+       */
+      void grown() {
+        this->growthPending = false;
+        auto nameOf = [&](int page) {
+          return page >= 0 && (size_t) page < this->book->size() ? this->book->getName(page) : "";
+        };
+        std::string reading = nameOf(this->page);
+        std::string facing = nameOf(this->page + 1);
+        this->scheduler->cancel(this->book);
+        if (this->book->refresh()) {
+          neither::Maybe<size_t> now = reading.empty()
+              ? neither::Maybe<size_t>()
+              : this->book->find(reading);
+          if (now.hasValue && (int) now.unsafeGet() != this->page) {
+            this->page = now.unsafeGet();
+            this->journal->record(this->page, this->leftToRight);
+          }
+          this->planner->resized(this->book->size());
+          // the spread is fetched again if it was showing placeholders past
+          // the old end, or its pages moved
+          if (nameOf(this->page) != reading || nameOf(this->page + 1) != facing) {
+            this->shownPage = -1;
+            this->scene.mark(Layer::Pages);
           }
         }
+        // the page count, or the book having stopped growing
+        this->scene.mark(Layer::StatusBar);
+        this->prefetch();
+      }
+
+      /**
+       * Note when an input event happened, counting the time it waited in
+       * SDL's queue at the millisecond resolution of its timestamp
+       */
+      void received(SDL_Event& event) {
+        Uint32 waited = SDL_GetTicks() - event.common.timestamp;
+        this->inputAt = std::chrono::steady_clock::now()
+            - std::chrono::milliseconds(waited < 1000 ? waited : 0);
       }
 
-      void processKey(Key key) {
+      /**
+       * target is where GoToPage goes, -1 to ask for it on the terminal
+       */
+      void processKey(Key key, int target = -1) {
+        if (this->helpVisible) {
+          // a key or button while help is up only dismisses it
+          this->helpVisible = false;
+          this->scene.mark(Layer::Overlay);
+          if (this->recorder != NULL) {
+            this->recorder->record(this->number, key, this->page);
+          }
+          return;
+        }
+        int from = this->page;
+        size_t fromVolume = this->volume;
         switch (key) {
           case Key::Exit:
             this->running = false;
@@ -144,35 +479,134 @@ namespace app {
             break;
           case Key::SwapDirection:
             this->leftToRight = !this->leftToRight;
+            this->scene.mark(Layer::Pages);
+            this->scene.mark(Layer::StatusBar);
             break;
           case Key::GoToPage:
-            this->goToPage();
+            this->goToPage(target);
             break;
           case Key::ToggleStatusBar:
             this->statusBar = !this->statusBar;
+            this->scene.mark(Layer::StatusBar);
             break;
           case Key::Help:
             this->showHelp();
             break;
         }
-        this->redraw();
+        // going to a page waits on the terminal, that isn't latency
+        bool asked = key == Key::GoToPage && target < 0;
+        bool moved = this->page != from || this->volume != fromVolume;
+        if (moved && !asked && !this->turnPending) {
+          this->turnedAt = this->inputAt;
+          this->turnPending = true;
+        }
+        // pages of two volumes aren't a turn the planner can learn from
+        if (this->volume == fromVolume) {
+          this->planner->navigated(from, this->page, this->leftToRight);
+        }
+        this->journal->record(this->page, this->leftToRight);
+        if (this->recorder != NULL) {
+          this->recorder->record(this->number, key, this->page);
+        }
       }
 
       void swapOddPage() {
         this->page = (this->page % 2) == 0 ? this->page + 1 : this->page - 1;
+        this->pageChanged();
       }
 
+      /**
+       * Turning back from the first spread goes to the previous volume of
+       * a series, or stays put
+       */
       void previousPage() {
+        // the spread before still has a page in it from page 1
+        if (this->page < 1) {
+          if (this->series != NULL && this->volume > 0) {
+            this->openVolume(this->volume - 1, true);
+          }
+          return;
+        }
         this->page -= 2;
+        this->pageChanged();
       }
 
+      /**
+       * Turning on from the last spread goes to the next volume of a
+       * series, or stays put
+       */
       void nextPage() {
+        // a volume still being copied isn't over yet
+        if (this->page + 2 >= (int) this->book->size() && !this->book->isGrowing()) {
+          if (this->series != NULL && this->volume + 1 < this->series->size()) {
+            this->openVolume(this->volume + 1, false);
+          }
+          return;
+        }
         this->page += 2;
+        this->pageChanged();
+      }
+
+      /**
+       * Carry on in another volume of the series, at its first spread or,
+       * going back, its last. The window stays on the book it has if the
+       * volume can't be opened.
+       */
+      void openVolume(size_t volume, bool atEnd) {
+        std::string path = this->series->getPath(volume);
+        Book* book;
+        try {
+          book = this->series->open(volume);
+        } catch (...) {
+          std::cerr << tfm::format("failed to open %s", path) << std::endl;
+          return;
+        }
+        this->stopWatching();
+        delete this->scanner;
+        this->scanner = NULL;
+        this->scheduler->cancel(this->book);
+        this->dropAnimations();
+        delete this->book;
+        this->book = book;
+        this->volume = volume;
+        book->setRenderer(this->window->getRenderer());
+        book->setPlanar(!this->window->isSoftware()
+            && this->window->supportsTextureFormat(SDL_PIXELFORMAT_IYUV));
+        this->scheduler->setFocus(book);
+
+        bool detached = this->journal->isDetached();
+        delete this->volumeJournal;
+        this->volumeJournal = new Journal(path);
+        if (detached) {
+          this->volumeJournal->detach();
+        }
+        this->journal = this->volumeJournal;
+
+        this->page = atEnd ? std::max(0, (int) book->size() - 2) : 0;
+        this->shownPage = -1;
+        this->planner->resized(book->size());
+        if (this->verifying) {
+          this->verify(path);
+        }
+        this->startWatching();
+        this->pageChanged();
       }
 
-      void goToPage() {
-        size_t pageNumber = app::input::tryGetInt()
-            .get(this->page);
+      /**
+       * Start opening the next volume while the reader is near the end of
+       * this one
+       */
+      void lookAhead() {
+        if (this->series != NULL
+            && this->page + (int) Series::LOOKAHEAD_PAGES >= (int) this->book->size()) {
+          this->series->prefetch(this->volume + 1);
+        }
+      }
+
+      void goToPage(int target) {
+        size_t pageNumber = target >= 0
+            ? target
+            : app::input::tryGetInt().get(this->page);
         if (this->page % 2 != pageNumber % 2) {
           // the requested page doesn't match up with expected offset
           // TODO: handle this properly, lower number should be better?
@@ -182,6 +616,12 @@ namespace app {
         int maxPage = std::min(this->book->size(), pageNumber);
         int minPage = std::max(0, maxPage);
         this->page = minPage;
+        this->pageChanged();
+      }
+
+      void pageChanged() {
+        this->scene.mark(Layer::Pages);
+        this->scene.mark(Layer::StatusBar);
       }
 
       void toggleFullscreen() {
@@ -191,62 +631,246 @@ namespace app {
           this->window->fakeFullscreen();
         }
         this->fullscreen = !this->fullscreen;
+        // SDL follows up with a size change, but not if the size didn't change
+        this->scene.mark(Layer::Layout);
+      }
+
+      void setHidden(bool hidden) {
+        this->hidden = hidden;
+        for (Animation* animation : { this->leftAnimation, this->rightAnimation }) {
+          if (animation != NULL) {
+            animation->pause(hidden);
+          }
+        }
+      }
+
+      void showHelp() {
+        this->helpVisible = true;
+        this->scene.mark(Layer::Overlay);
       }
 
+      /**
+       * Rebuild whatever is dirty, composite the frame from the retained
+       * textures and present it once
+       */
       void redraw() {
+        if (this->window->surfaceChanged()) {
+          // text textures belong to the renderer that is about to go
+          this->releaseText();
+          // and so are the animations' textures; the software renderer
+          // doesn't play them
+          this->dropAnimations();
+          this->window->renewRenderer();
+          this->book->setPlanar(false);
+          this->scene.markAll();
+        }
+        Scene before = this->scene;
+
+        if (this->scene.isDirty(Layer::Pages)) {
+          this->fetchPages();
+        }
+        if (this->scene.isDirty(Layer::StatusBar)) {
+          this->renderStatusBar();
+        }
+        if (this->scene.isDirty(Layer::Overlay)) {
+          this->renderHelp();
+        }
+        // cheap, and every layer's position can depend on the others' sizes
+        this->relayout();
+
+        if (this->window->isSoftware()) {
+          this->drawPagesInSoftware();
+        } else {
+          this->window->clear();
+          this->drawPage(this->leftPage, this->leftAnimation, &this->scene.left);
+          this->drawPage(this->rightPage, this->rightAnimation, &this->scene.right);
+        }
+
+        if (this->statusText != NULL) {
+          SDL_SetRenderDrawBlendMode(window->getRenderer(), SDL_BLENDMODE_BLEND);
+          SDL_SetRenderDrawColor(window->getRenderer(), 0, 0, 0, 150);
+          SDL_RenderFillRect(window->getRenderer(), &this->scene.statusBar);
+          this->statusText->renderTo(
+              this->window->getRenderer(),
+              this->scene.statusText.x,
+              this->scene.statusText.y);
+        }
+
+        if (this->helpNames != NULL) {
+          SDL_SetRenderDrawBlendMode(window->getRenderer(), SDL_BLENDMODE_BLEND);
+          SDL_SetRenderDrawColor(window->getRenderer(), 0, 0, 0, 255);
+          SDL_RenderFillRect(window->getRenderer(), &this->scene.overlay);
+          this->helpNames->renderTo(this->window->getRenderer(), this->helpNamesLoc.x, this->helpNamesLoc.y);
+          this->helpButtons->renderTo(this->window->getRenderer(), this->helpButtonsLoc.x, this->helpButtonsLoc.y);
+        }
+        this->window->update(this->scene.damage(before));
+        this->scene.clean();
+        if (this->turnPending) {
+          Metrics::global().pageTurn.record(std::chrono::steady_clock::now() - this->turnedAt);
+          this->turnPending = false;
+        }
+      }
+
+      /**
+       * The frame showing of an animated page, the page's own texture
+       * until there is one
+       */
+      void drawPage(Page* page, Animation* animation, SDL_Rect* at) {
+        SDL_Texture* frame = animation == NULL ? NULL : animation->getTexture();
+        if (frame != NULL) {
+          this->window->draw(frame, NULL, at);
+        } else {
+          this->window->draw(page->getTexture(), page->getSrc(), at);
+        }
+      }
+
+      /**
+       * Scale the pages on the CPU, once per layout, and blit them into the
+       * window surface. The software renderer's own scaling is far slower.
+       */
+      void drawPagesInSoftware() {
+        SDL_Surface* screen = this->window->getSurface();
+        SDL_FillRect(screen, NULL, SDL_MapRGB(screen->format, 0, 0, 0));
+        for (auto side : { std::make_pair(this->leftPage, this->scene.left),
+            std::make_pair(this->rightPage, this->scene.right) }) {
+          SDL_Rect at = side.second;
+          if (at.w <= 0 || at.h <= 0) {
+            continue;
+          }
+          SDL_Surface* page = this->scaled->get(side.first->getPixels(), at.w, at.h);
+          SDL_BlitSurface(page, NULL, screen, &at);
+        }
+      }
+
+      void releaseText() {
+        delete this->statusText;
+        delete this->statusBox;
+        delete this->helpNames;
+        delete this->helpButtons;
+        this->statusText = NULL;
+        this->statusBox = NULL;
+        this->helpNames = NULL;
+        this->helpButtons = NULL;
+      }
+
+      /**
+       * Fetch the pages of the current spread, unless they are already shown.
+       * Swapping direction on the same spread only swaps sides.
+       */
+      void fetchPages() {
+        if (this->shownPage == this->page && this->leftPage != NULL) {
+          if (this->shownLeftToRight != this->leftToRight) {
+            std::swap(this->leftPage, this->rightPage);
+            std::swap(this->leftAnimation, this->rightAnimation);
+            this->shownLeftToRight = this->leftToRight;
+          }
+          return;
+        }
 
         int lIndex = this->leftToRight ? this->page : this->page + 1;
         int rIndex = this->leftToRight ? this->page + 1 : this->page;
 
-        //SDL_SetRenderDrawColor(this->renderer, 0x00, 0x00, 0x00, 0xFF);
         Page* page1 = this->book->getPage(lIndex);
-        Page* page2 = this->book->getPage(rIndex);
-        SDL_Rect* src1 = page1->getSrc();
-        SDL_Rect* src2 = page2->getSrc();
-        SDL_Rect dst = this->window->getCanvas();
-        std::pair<SDL_Rect, SDL_Rect> split = Layout::splitHorizontal(dst);
-        SDL_Rect sizedl = Layout::centerVertically(
-            Layout::alignRightAgainstLeft(
-                Layout::scaleAspect(*src1, split.first),
-                split.second),
-            dst);
-        SDL_Rect sizedr = Layout::centerVertically(
-            Layout::alignLeftAgainstRight(
-                Layout::scaleAspect(*src2, split.second),
-                split.first),
-            dst);
+        Page* page2;
+        try {
+          page2 = this->book->getPage(rIndex);
+        } catch (...) {
+          delete page1;
+          throw;
+        }
+        delete this->leftPage;
+        delete this->rightPage;
+        this->leftPage = page1;
+        this->rightPage = page2;
+        this->dropAnimations();
+        this->leftAnimation = this->animationOf(lIndex);
+        this->rightAnimation = this->animationOf(rIndex);
+        this->shownPage = this->page;
+        this->shownLeftToRight = this->leftToRight;
+        this->planner->shown(this->page);
+        this->prefetch();
+        this->lookAhead();
+      }
 
-        this->window->clear();
-        this->window->draw(page1->getTexture(), src1, &sizedl);
-        this->window->draw(page2->getTexture(), src2, &sizedr);
-        delete page1;
-        delete page2;
-
-        if (this->statusBar) {
-          app::TextBox textBox = app::TextBox(this->window->getRenderer(), this->fontPath, 16);
-          textBox.add(tfm::format(
-            "page: %d/%d,    direction: %s,    first page: %s,    help: %s",
-              this->page, this->book->size(),
-              this->leftToRight ? "->" : "<-",
-              this->page % 2,
-              SDL_GetKeyName(this->reversedKeyMap[Key::Help])));
-          RenderedText text = textBox.render();
-          SDL_Rect src = { 0, 0, text.getW(), text.getH() };
-          SDL_Rect location = Layout::alignToBottom(
-              Layout::centerHorizontal(src, dst),
-              dst);
-          SDL_Rect backbarSrc = { 0, location.y, dst.w, location.h };
+      /**
+       * Playback for a page of the book if it is animated and the renderer
+       * draws textures, NULL otherwise
+       */
+      Animation* animationOf(int page) {
+        if (page < 0 || this->window->isSoftware()) {
+          return NULL;
+        }
+        FrameDecoder* frames = this->book->openFrames(page);
+        if (frames == NULL) {
+          return NULL;
+        }
+        try {
+          Animation* animation = new Animation(this->window->getRenderer(), frames);
+          animation->pause(this->hidden);
+          return animation;
+        } catch (ImageOpenException& e) {
+          return NULL;
+        }
+      }
 
-          SDL_SetRenderDrawBlendMode(window->getRenderer(), SDL_BLENDMODE_BLEND);
-          SDL_SetRenderDrawColor(window->getRenderer(), 0, 0, 0, 150);
-          SDL_RenderFillRect(window->getRenderer(), &backbarSrc);
-          text.renderTo(this->window->getRenderer(), location.x, location.y);
+      void dropAnimations() {
+        delete this->leftAnimation;
+        delete this->rightAnimation;
+        this->leftAnimation = NULL;
+        this->rightAnimation = NULL;
+      }
+
+      /**
+       * decode the spreads the reader is likely to turn to while they look
+       * at this one
+       */
+      void prefetch() {
+        PrefetchPlanner* planner = this->planner;
+        this->scheduler->schedule(
+            this->book,
+            planner->plan(this->page, this->leftToRight),
+            [planner](size_t page, double ms) {
+              planner->decoded(page, ms);
+            });
+      }
+
+      void renderStatusBar() {
+        AllocationTag tag(Allocations::Text);
+        delete this->statusText;
+        this->statusText = NULL;
+        if (!this->statusBar) {
+          return;
+        }
+
+        if (this->statusBox == NULL) {
+          this->statusBox = new app::TextBox(this->window->getRenderer(), this->fonts->get(this->fontPath, 16));
         }
-        this->window->update();
+        this->statusBox->clear();
+        this->statusBox->add(tfm::format(
+          "%spage: %d/%d%s,    direction: %s,    first page: %s,    help: %s",
+            this->series == NULL
+                ? std::string()
+                : tfm::format("volume: %d/%d,    ", this->volume + 1, this->series->size()),
+            this->page, this->book->size(),
+            // more pages are on their way
+            this->book->isGrowing() ? "+" : "",
+            this->leftToRight ? "->" : "<-",
+            this->page % 2,
+            SDL_GetKeyName(this->reversedKeyMap[Key::Help])));
+        this->statusText = this->statusBox->renderNew();
       }
 
-      void showHelp() {
-        app::TextBox names = app::TextBox(this->window->getRenderer(), this->fontPath, 16);
+      void renderHelp() {
+        AllocationTag tag(Allocations::Text);
+        delete this->helpNames;
+        delete this->helpButtons;
+        this->helpNames = NULL;
+        this->helpButtons = NULL;
+        if (!this->helpVisible) {
+          return;
+        }
+
+        app::TextBox names = app::TextBox(this->window->getRenderer(), this->fonts->get(this->fontPath, 16));
         names.addLines( {
             "next page:",
             "previous page:",
@@ -258,7 +882,7 @@ namespace app {
             "exit:",
             "help:",
         });
-        app::TextBox buttons = app::TextBox(this->window->getRenderer(), this->fontPath, 16);
+        app::TextBox buttons = app::TextBox(this->window->getRenderer(), this->fonts->get(this->fontPath, 16));
         buttons.addLines( {
             std::string(SDL_GetKeyName(this->reversedKeyMap[Key::Next])),
             std::string(SDL_GetKeyName(this->reversedKeyMap[Key::Prev])),
@@ -270,46 +894,70 @@ namespace app {
             std::string(SDL_GetKeyName(this->reversedKeyMap[Key::Exit])),
             std::string(SDL_GetKeyName(this->reversedKeyMap[Key::Help])),
         });
-        RenderedText namesText = names.render();
-        RenderedText buttonsText = buttons.render();
-
-        SDL_Rect namesSrc = { 0, 0, namesText.getW(), namesText.getH() };
-        SDL_Rect paddingSrc = { 0, 0, 10, 0 };
-        SDL_Rect buttonsSrc = { 0, 0, buttonsText.getW(), buttonsText.getH() };
-        SDL_Rect panelSrc = Layout::minSpanning(
-            namesSrc,
-            Layout::alignLeftAgainstRight(buttonsSrc, Layout::alignLeftAgainstRight(paddingSrc, namesSrc)));
-
-        SDL_Rect canvas = this->window->getCanvas();
-        SDL_Rect centeredPanel = Layout::centerVertically(
-            Layout::centerHorizontal(panelSrc, canvas),
-            canvas);
-        SDL_Rect namesLoc = Layout::alignToTop(
-            Layout::alignToLeft(namesSrc, centeredPanel),
-            centeredPanel);
-        SDL_Rect paddingLoc = Layout::alignToTop(
-            Layout::alignLeftAgainstRight(paddingSrc, namesLoc),
-            namesLoc);
-        SDL_Rect buttonsLoc = Layout::alignToTop(
-            Layout::alignLeftAgainstRight(buttonsSrc, paddingLoc),
-            paddingLoc);
-
-        int xPad = centeredPanel.w * 0.05;
-        int yPad = centeredPanel.h * 0.05;
-        SDL_Rect backgroundLoc = {
-            centeredPanel.x - xPad,
-            centeredPanel.y - yPad,
-            centeredPanel.w * 1.1,
-            centeredPanel.h * 1.1
-        };
+        this->helpNames = names.renderNew();
+        this->helpButtons = buttons.renderNew();
+      }
 
-        SDL_SetRenderDrawBlendMode(window->getRenderer(), SDL_BLENDMODE_BLEND);
-        SDL_SetRenderDrawColor(window->getRenderer(), 0, 0, 0, 255);
-        SDL_RenderFillRect(window->getRenderer(), &backgroundLoc);
-        namesText.renderTo(this->window->getRenderer(), namesLoc.x, namesLoc.y);
-        buttonsText.renderTo(this->window->getRenderer(), buttonsLoc.x, buttonsLoc.y);
-        this->window->update();
-        app::waitForAnyKey();
+      /**
+       * Place everything on the current canvas from the retained pages and
+       * text. Never decodes or renders text.
+       */
+      void relayout() {
+        SDL_Rect dst = this->window->getCanvas();
+        this->scene.canvas = dst;
+
+        std::pair<SDL_Rect, SDL_Rect> sized = Layout::spread(
+            *this->leftPage->getSrc(),
+            *this->rightPage->getSrc(),
+            dst);
+        this->scene.left = sized.first;
+        this->scene.right = sized.second;
+
+        if (this->statusText != NULL) {
+          SDL_Rect src = { 0, 0, this->statusText->getW(), this->statusText->getH() };
+          SDL_Rect location = Layout::alignToBottom(
+              Layout::centerHorizontal(src, dst),
+              dst);
+          this->scene.statusText = location;
+          this->scene.statusBar = { 0, location.y, dst.w, location.h };
+        } else {
+          this->scene.statusBar = { 0, 0, 0, 0 };
+        }
+
+        if (this->helpNames != NULL) {
+          SDL_Rect namesSrc = { 0, 0, this->helpNames->getW(), this->helpNames->getH() };
+          SDL_Rect paddingSrc = { 0, 0, 10, 0 };
+          SDL_Rect buttonsSrc = { 0, 0, this->helpButtons->getW(), this->helpButtons->getH() };
+          SDL_Rect panelSrc = Layout::minSpanning(
+              namesSrc,
+              Layout::alignLeftAgainstRight(buttonsSrc, Layout::alignLeftAgainstRight(paddingSrc, namesSrc)));
+
+          SDL_Rect centeredPanel = Layout::centerVertically(
+              Layout::centerHorizontal(panelSrc, dst),
+              dst);
+          SDL_Rect namesLoc = Layout::alignToTop(
+              Layout::alignToLeft(namesSrc, centeredPanel),
+              centeredPanel);
+          SDL_Rect paddingLoc = Layout::alignToTop(
+              Layout::alignLeftAgainstRight(paddingSrc, namesLoc),
+              namesLoc);
+          SDL_Rect buttonsLoc = Layout::alignToTop(
+              Layout::alignLeftAgainstRight(buttonsSrc, paddingLoc),
+              paddingLoc);
+
+          int xPad = centeredPanel.w * 0.05;
+          int yPad = centeredPanel.h * 0.05;
+          this->helpNamesLoc = namesLoc;
+          this->helpButtonsLoc = buttonsLoc;
+          this->scene.overlay = {
+              centeredPanel.x - xPad,
+              centeredPanel.y - yPad,
+              centeredPanel.w * 1.1,
+              centeredPanel.h * 1.1
+          };
+        } else {
+          this->scene.overlay = { 0, 0, 0, 0 };
+        }
       }
 
   };
@@ -0,0 +1,125 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace app {
+
+  struct ArchiveEntry {
+    std::string name;
+    // position in the archive's directory
+    uint64_t index;
+    // of the local header, 0 when the backend doesn't know
+    uint64_t offset;
+    uint64_t compressedSize;
+    uint64_t size;
+  };
+
+  /**
+   * Where a book's entries come from
+   */
+  class Archive {
+    public:
+      virtual ~Archive() {
+      }
+
+      /**
+       * every entry name, in archive order
+       */
+      virtual std::vector<std::string> getNames() = 0;
+
+      /**
+       * every entry with what the directory says about it, in archive order
+       */
+      virtual std::vector<ArchiveEntry> getEntries() {
+        std::vector<ArchiveEntry> entries;
+        std::vector<std::string> names = this->getNames();
+        for (size_t i = 0; i < names.size(); i++) {
+          entries.push_back(ArchiveEntry { names[i], i, 0, 0, 0 });
+        }
+        return entries;
+      }
+
+      /**
+       * the uncompressed contents of an entry
+       */
+      virtual std::vector<char> read(const std::string& name) = 0;
+
+      /**
+       * The first length bytes of an entry's contents, or all of them if
+       * it is shorter. Backends that can stop unpacking early read little
+       * more of the archive than that; the rest read the whole entry.
+       */
+      virtual std::vector<char> readPrefix(const std::string& name, size_t length) {
+        std::vector<char> data = this->read(name);
+        data.resize(std::min(data.size(), length));
+        return data;
+      }
+
+      /**
+       * Hand an entry's contents to consume a piece of at most chunkSize
+       * bytes at a time, stopping early if it returns false. Backends that
+       * can unpack as they go read the archive only as fast as consume
+       * takes the pieces; the rest read the whole entry first.
+       */
+      virtual void readChunks(
+          const std::string& name,
+          size_t chunkSize,
+          std::function<bool(const char*, size_t)> consume) {
+        std::vector<char> data = this->read(name);
+        for (size_t at = 0; at < data.size(); at += chunkSize) {
+          if (!consume(data.data() + at, std::min(chunkSize, data.size() - at))) {
+            return;
+          }
+        }
+      }
+
+      /**
+       * the CRC-32 of an entry's contents as recorded in the central directory
+       */
+      virtual uint32_t getCrc(const std::string& name) = 0;
+
+      /**
+       * Tell the archive the order entries will be read in, so backends
+       * where reads are expensive can read ahead.
+       */
+      virtual void setReadingOrder(const std::vector<std::string>&) {
+      }
+
+      /**
+       * Entries that are about to be read, most wanted first, for backends
+       * that can batch reads. May be called from another thread than the
+       * reads.
+       */
+      virtual void willRead(const std::vector<std::string>&) {
+      }
+
+      /**
+       * Whether the file is still being written, so more entries may turn
+       * up on refresh
+       */
+      virtual bool isGrowing() {
+        return false;
+      }
+
+      /**
+       * Block until the file may have grown, or has stopped growing, up
+       * to the timeout in ms. False on timeout, or if it isn't growing. Safe to
+       * call from another thread than the reads.
+       */
+      virtual bool waitForChange(int) {
+        return false;
+      }
+
+      /**
+       * Pick up entries that landed since the last look.
+       * True if getEntries changed.
+       */
+      virtual bool refresh() {
+        return false;
+      }
+  };
+
+}
@@ -0,0 +1,530 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include <turbojpeg.h>
+#include "Book.h"
+#include "Image.h"
+#include "Metrics.h"
+#include "Page.h"
+#include "PageTable.h"
+#include "Scaler.h"
+#include "Zip.h"
+#include "util.h"
+
+namespace app {
+
+  struct OptimizeOptions {
+    std::string path;
+    // default: <name>.optimized.cbz next to the input
+    std::string outputPath = "";
+    // pages wider or taller than this are scaled down to fit and
+    // re-encoded as JPEG, 0 for no limit
+    int maxWidth = 0;
+    int maxHeight = 0;
+    int quality = 85;
+    // 0: one per core
+    int jobs = 0;
+  };
+
+  /**
+   * Rewrites an archive the way the reader wants it:
+   *
+   * - pages first, in natural reading order, so reading front to back
+   *   reads the file front to back;
+   * - images stored rather than deflated: they are compressed already,
+   *   and inflating them costs time on every page turn;
+   * - pages bigger than the limit scaled down and re-encoded as JPEG;
+   * - every page's size in Book::DIMENSIONS_ENTRY.
+   *
+   * Other entries, like ComicInfo.xml, follow the pages, deflated.
+   *
+   * Workers each open the archive and claim pages in order. The calling
+   * thread writes them as they finish, in order, with at most WINDOW
+   * pages finished and waiting so memory stays bounded. The output is
+   * written to a temporary file, read back through Book, checking every
+   * page is there in order and decodes to the recorded size, and only
+   * then renamed into place.
+   */
+  class ArchiveOptimizer {
+    private:
+      static constexpr size_t WINDOW = 64;
+      // pages timed before and after, spread over the book
+      static constexpr size_t SAMPLE = 64;
+
+      struct Result {
+        std::string name;
+        std::vector<char> data;
+        // 0 and 0 if the page couldn't be decoded; it is copied as it is
+        int width = 0;
+        int height = 0;
+        bool reencoded = false;
+        bool done = false;
+      };
+
+      struct Timing {
+        double openMs = 0;
+        Histogram turns;
+      };
+
+      OptimizeOptions options;
+      // entry names of the pages in reading order
+      std::vector<std::string> pages;
+      // every entry name in the source, and the names picked for pages that
+      // get re-encoded, so no two entries clash
+      std::set<std::string> taken;
+      // what each page is stored under if it is re-encoded
+      std::vector<std::string> jpegNames;
+      std::vector<Result> results;
+      std::atomic<size_t> next { 0 };
+      size_t written = 0;
+      std::atomic<size_t> reencoded { 0 };
+      bool failed = false;
+      std::mutex lock;
+      std::condition_variable changed;
+      std::exception_ptr error;
+
+      static uint32_t readBigEndian32(const unsigned char* bytes) {
+        return ((uint32_t) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+      }
+
+      /**
+       * width and height of an encoded page, from its header where the
+       * format makes that easy, by decoding it otherwise
+       */
+      static std::pair<int, int> measure(const std::vector<char>& data) {
+        struct Decompressor {
+          tjhandle handle = tjInitDecompress();
+
+          ~Decompressor() {
+            if (this->handle != NULL) {
+              tjDestroy(this->handle);
+            }
+          }
+        };
+        thread_local Decompressor decompressor;
+
+        const unsigned char* bytes = (const unsigned char*) data.data();
+        Metrics::Format format = Metrics::formatOf(PageTable::imageFormat(data.data(), data.size()));
+        if (format == Metrics::Png && data.size() >= 24) {
+          // IHDR is always the first chunk
+          return std::make_pair(readBigEndian32(bytes + 16), readBigEndian32(bytes + 20));
+        }
+        int width = 0;
+        int height = 0;
+        int subsampling = 0;
+        int colorspace = 0;
+        if (format == Metrics::Jpeg && decompressor.handle != NULL
+            && tjDecompressHeader3(decompressor.handle, bytes, data.size(),
+                &width, &height, &subsampling, &colorspace) == 0) {
+          return std::make_pair(width, height);
+        }
+        SDL_Surface* surface = Page::decode(data.data(), data.size());
+        std::pair<int, int> size = std::make_pair(surface->w, surface->h);
+        SDL_FreeSurface(surface);
+        return size;
+      }
+
+      /**
+       * how much a page has to shrink to fit the limit, 1 if it fits
+       */
+      double fit(int width, int height) {
+        double scale = 1;
+        if (this->options.maxWidth > 0 && width > this->options.maxWidth) {
+          scale = std::min(scale, (double) this->options.maxWidth / width);
+        }
+        if (this->options.maxHeight > 0 && height > this->options.maxHeight) {
+          scale = std::min(scale, (double) this->options.maxHeight / height);
+        }
+        return scale;
+      }
+
+      /**
+       * Encode at the configured quality: greyscale for black and white
+       * pages, 4:2:0 otherwise, the layouts the reader decodes straight
+       * to planes.
+       */
+      std::vector<char> encodeJpeg(Image* image) {
+        struct Compressor {
+          tjhandle handle = tjInitCompress();
+
+          ~Compressor() {
+            if (this->handle != NULL) {
+              tjDestroy(this->handle);
+            }
+          }
+        };
+        thread_local Compressor compressor;
+        if (compressor.handle == NULL) {
+          throw Exception("failed to initialize the jpeg encoder");
+        }
+
+        unsigned char* jpeg = NULL;
+        unsigned long length = 0;
+        int result;
+        if (image->getKind() == Image::Kind::Grey) {
+          result = tjCompress2(compressor.handle, image->plane(0),
+              image->getWidth(), image->pitch(0), image->getHeight(), TJPF_GRAY,
+              &jpeg, &length, TJSAMP_GRAY, this->options.quality, 0);
+        } else {
+          // ARGB8888 from the scaler, which is B, G, R, A in memory on
+          // little endian machines
+          SDL_Surface* surface = image->getSurface();
+          result = tjCompress2(compressor.handle, (const unsigned char*) surface->pixels,
+              surface->w, surface->pitch, surface->h,
+              SDL_BYTEORDER == SDL_LIL_ENDIAN ? TJPF_BGRX : TJPF_XRGB,
+              &jpeg, &length, TJSAMP_420, this->options.quality, 0);
+        }
+        if (result != 0) {
+          tjFree(jpeg);
+          throw Exception(tfm::format(
+              "failed to encode a %dx%d page as jpeg", image->getWidth(), image->getHeight()));
+        }
+        std::vector<char> encoded(jpeg, jpeg + length);
+        tjFree(jpeg);
+        return encoded;
+      }
+
+      /**
+       * Pick the name a re-encoded page is stored under, and take it: .jpg
+       * for its extension, or added to the name, then numbered, until it
+       * clashes with nothing. Pages are named in reading order before any
+       * is processed, so the same archive always comes out the same.
+       */
+      std::string jpegName(const std::string& name) {
+        size_t slash = name.rfind('/');
+        size_t dot = name.rfind('.');
+        std::string stem = dot == std::string::npos || (slash != std::string::npos && dot < slash)
+            ? name
+            : name.substr(0, dot);
+        std::string renamed = stem + ".jpg";
+        if (renamed == name) {
+          return renamed;
+        }
+        if (this->taken.count(renamed) > 0) {
+          renamed = name + ".jpg";
+        }
+        for (int i = 2; this->taken.count(renamed) > 0; i++) {
+          renamed = tfm::format("%s-%d.jpg", name, i);
+        }
+        this->taken.insert(renamed);
+        return renamed;
+      }
+
+      void process(Archive* archive, size_t page, Result& result) {
+        const std::string& name = this->pages[page];
+        result.name = name;
+        result.data = archive->read(name);
+        std::pair<int, int> size;
+        try {
+          size = measure(result.data);
+        } catch (ImageOpenException& e) {
+          // copied as it is, the reader shows a placeholder for it
+          return;
+        }
+        result.width = size.first;
+        result.height = size.second;
+
+        double scale = this->fit(size.first, size.second);
+        if (scale >= 1) {
+          return;
+        }
+        int width = std::max(1, (int) std::lround(size.first * scale));
+        int height = std::max(1, (int) std::lround(size.second * scale));
+        SDL_Surface* decoded = Page::decode(result.data.data(), result.data.size());
+        SDL_Surface* scaled = NULL;
+        try {
+          scaled = Scaler::scale(decoded, width, height);
+        } catch (...) {
+          SDL_FreeSurface(decoded);
+          throw;
+        }
+        SDL_FreeSurface(decoded);
+        Image* image = Image::fromSurface(scaled);
+        try {
+          result.data = this->encodeJpeg(image);
+        } catch (...) {
+          delete image;
+          throw;
+        }
+        delete image;
+        result.name = this->jpegNames[page];
+        result.width = width;
+        result.height = height;
+        result.reencoded = true;
+        this->reencoded++;
+      }
+
+      void work() {
+        Archive* archive = NULL;
+        try {
+          archive = Book::openArchive(this->options.path);
+          while (true) {
+            size_t page = this->next++;
+            if (page >= this->pages.size()) {
+              break;
+            }
+            {
+              std::unique_lock<std::mutex> guard(this->lock);
+              this->changed.wait(guard, [&]() {
+                return this->failed || page < this->written + WINDOW;
+              });
+              if (this->failed) {
+                break;
+              }
+            }
+            Result result;
+            this->process(archive, page, result);
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->results[page] = std::move(result);
+            this->results[page].done = true;
+            this->changed.notify_all();
+          }
+        } catch (...) {
+          this->fail(std::current_exception());
+        }
+        delete archive;
+      }
+
+      void fail(std::exception_ptr error) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (!this->error) {
+          this->error = error;
+        }
+        this->failed = true;
+        this->changed.notify_all();
+      }
+
+      /**
+       * Write the pages as the workers finish them, then everything else.
+       * Returns the names the pages were written under.
+       */
+      std::vector<std::string> write(zip::Writer& writer, Archive* source) {
+        std::vector<std::string> names;
+        std::string dimensions;
+        for (size_t page = 0; page < this->pages.size(); page++) {
+          Result result;
+          {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->changed.wait(guard, [&]() {
+              return this->failed || this->results[page].done;
+            });
+            if (this->failed) {
+              return names;
+            }
+            result = std::move(this->results[page]);
+            this->written = page + 1;
+            this->changed.notify_all();
+          }
+          writer.add(result.name, result.data, false);
+          names.push_back(result.name);
+          if (result.width > 0) {
+            dimensions += tfm::format("%d\t%d\t%s\n", result.width, result.height, result.name);
+          }
+        }
+
+        std::set<std::string> pageNames(this->pages.begin(), this->pages.end());
+        for (std::string name : source->getNames()) {
+          if (pageNames.count(name) == 0 && name != Book::DIMENSIONS_ENTRY) {
+            writer.add(name, source->read(name), true);
+          }
+        }
+        writer.add(Book::DIMENSIONS_ENTRY, dimensions.data(), dimensions.size(), true);
+        writer.finish();
+        return names;
+      }
+
+      /**
+       * Read the output back the way the reader will: every page there
+       * under the name it was written as, in the same order, decoding to
+       * the size recorded for it.
+       */
+      void verify(const std::string& path, const std::vector<std::string>& names, int jobs) {
+        Book book(path);
+        if (book.size() != names.size()) {
+          throw Exception(tfm::format(
+              "optimized archive has %d pages, expected %d", book.size(), names.size()));
+        }
+        for (size_t page = 0; page < names.size(); page++) {
+          if (book.getName(page) != names[page]) {
+            throw Exception(tfm::format(
+                "page %d of the optimized archive is %s, expected %s",
+                page, book.getName(page), names[page]));
+          }
+        }
+
+        std::vector<std::pair<int, int>> recorded;
+        for (size_t page = 0; page < book.size(); page++) {
+          recorded.push_back(book.getDimensions(page));
+        }
+        book.setPlanar(true);
+        std::atomic<size_t> nextPage { 0 };
+        std::mutex errorLock;
+        std::string mismatch = "";
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+          workers.push_back(std::thread([&]() {
+            for (size_t page = nextPage++; page < book.size(); page = nextPage++) {
+              std::pair<int, int> size = std::make_pair(0, 0);
+              try {
+                Image* image = book.decodeImage(page);
+                size = std::make_pair(image->getWidth(), image->getHeight());
+                delete image;
+              } catch (ImageOpenException& e) {
+                // pages that didn't decode before are copied as they were
+              } catch (IOException& e) {
+                size = std::make_pair(-1, -1);
+              } catch (...) {
+                size = std::make_pair(-1, -1);
+              }
+              if (size != recorded[page]) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                mismatch = tfm::format(
+                    "page %s of the optimized archive is %dx%d, expected %dx%d",
+                    names[page], size.first, size.second, recorded[page].first, recorded[page].second);
+              }
+            }
+          }));
+        }
+        for (std::thread& worker : workers) {
+          worker.join();
+        }
+        if (!mismatch.empty()) {
+          throw Exception(mismatch);
+        }
+      }
+
+      /**
+       * How long the archive takes to open and, over up to SAMPLE pages
+       * spread through it, to read and decode a page: a page turn that
+       * misses the cache, less the texture upload.
+       */
+      static void time(const std::string& path, Timing& timing) {
+        auto start = std::chrono::steady_clock::now();
+        Book book(path);
+        timing.openMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        book.setPlanar(true);
+        size_t step = std::max((size_t) 1, book.size() / SAMPLE);
+        for (size_t page = 0; page < book.size(); page += step) {
+          auto started = std::chrono::steady_clock::now();
+          try {
+            delete book.decodeImage(page);
+          } catch (ImageOpenException& e) {
+            continue;
+          } catch (IOException& e) {
+            continue;
+          }
+          timing.turns.record(std::chrono::steady_clock::now() - started);
+        }
+      }
+
+    public:
+      ArchiveOptimizer(OptimizeOptions options) :
+          options(options) {
+        if (this->options.outputPath.empty()) {
+          this->options.outputPath = std::filesystem::path(options.path)
+              .replace_extension(".optimized.cbz").string();
+        }
+      }
+
+      /**
+       * Write the optimized archive and report what changed and how much
+       * faster it reads. Rethrows the first error any worker hit; the
+       * output is left alone unless everything worked.
+       */
+      void run(std::ostream& report) {
+        if (isUrl(this->options.path)) {
+          throw Exception("optimize needs a local archive");
+        }
+        if (this->options.quality < 1 || this->options.quality > 100) {
+          throw Exception(tfm::format("jpeg quality %d is not between 1 and 100", this->options.quality));
+        }
+        std::error_code ignored;
+        uintmax_t sourceBytes = std::filesystem::file_size(this->options.path, ignored);
+        Timing before;
+        time(this->options.path, before);
+
+        auto start = std::chrono::steady_clock::now();
+        Archive* source = Book::openArchive(this->options.path);
+        {
+          Book book(this->options.path);
+          for (size_t page = 0; page < book.size(); page++) {
+            this->pages.push_back(book.getName(page));
+          }
+        }
+        for (std::string name : source->getNames()) {
+          this->taken.insert(name);
+        }
+        for (const std::string& page : this->pages) {
+          this->jpegNames.push_back(this->jpegName(page));
+        }
+        this->results.resize(this->pages.size());
+
+        int jobs = this->options.jobs > 0
+            ? this->options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+          workers.push_back(std::thread(&ArchiveOptimizer::work, this));
+        }
+
+        std::string tmpPath = this->options.outputPath + ".tmp";
+        std::vector<std::string> names;
+        try {
+          zip::Writer writer(tmpPath);
+          names = this->write(writer, source);
+        } catch (...) {
+          this->fail(std::current_exception());
+        }
+        for (std::thread& worker : workers) {
+          worker.join();
+        }
+        delete source;
+        if (this->error) {
+          std::remove(tmpPath.c_str());
+          std::rethrow_exception(this->error);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        Timing after;
+        try {
+          this->verify(tmpPath, names, jobs);
+          time(tmpPath, after);
+        } catch (...) {
+          std::remove(tmpPath.c_str());
+          throw;
+        }
+        if (std::rename(tmpPath.c_str(), this->options.outputPath.c_str()) != 0) {
+          std::remove(tmpPath.c_str());
+          throw IOException(tfm::format("failed to write %s", this->options.outputPath));
+        }
+
+        double mib = 1024 * 1024;
+        report << tfm::format(
+            "optimized %d pages into %s in %.2f s with %d workers, %d re-encoded, %.1f MiB -> %.1f MiB",
+            this->pages.size(), this->options.outputPath, elapsed.count(), jobs, this->reencoded.load(),
+            sourceBytes / mib,
+            std::filesystem::file_size(this->options.outputPath, ignored) / mib) << std::endl;
+        report << tfm::format("open: %.2f ms -> %.2f ms", before.openMs, after.openMs) << std::endl;
+        report << tfm::format(
+            "page read and decode p50: %.2f ms -> %.2f ms, p99: %.2f ms -> %.2f ms",
+            before.turns.percentile(50), after.turns.percentile(50),
+            before.turns.percentile(99), after.turns.percentile(99)) << std::endl;
+      }
+  };
+
+}
@@ -0,0 +1,344 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tinyformat.h>
+#include "Exception.h"
+#include "RangeSource.h"
+
+namespace app {
+
+  /**
+   * On-disk cache of fixed size blocks in front of a remote archive.
+   *
+   * Blocks are files named by block index in their own directory per
+   * archive. Missing blocks next to each other are fetched with one range
+   * request. Reads come from the foreground source; read-ahead uses the
+   * background source so it never queues behind, or in front of, the page
+   * the reader is waiting for. A block being fetched by one side is waited
+   * for rather than fetched twice.
+   *
+   * The tail of the archive is always fetched from the server when opening;
+   * if it differs from the cached copy the archive changed and every cached
+   * block is dropped.
+   */
+  class BlockCache {
+    private:
+      RangeSource* foreground;
+      RangeSource* background;
+      std::string dir;
+      uint64_t blockSize;
+      uint64_t total = 0;
+      std::vector<char> tail;
+      uint64_t tailOffset = 0;
+
+      std::mutex lock;
+      std::condition_variable landed;
+      std::set<uint64_t> present;
+      std::set<uint64_t> inflight;
+
+      std::string blockPath(uint64_t block) {
+        return tfm::format("%s/%d", this->dir, block);
+      }
+
+      void scan() {
+        std::error_code error;
+        for (auto& file : std::filesystem::directory_iterator(this->dir, error)) {
+          std::string name = file.path().filename().string();
+          if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit)) {
+            this->present.insert(std::stoull(name));
+          }
+        }
+      }
+
+      void dropBlocks() {
+        for (uint64_t block : this->present) {
+          std::remove(this->blockPath(block).c_str());
+        }
+        this->present.clear();
+      }
+
+      void writeFile(std::string path, const char* data, size_t length) {
+        std::string tmpPath = path + ".tmp";
+        {
+          std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+          out.write(data, length);
+          if (!out) {
+            throw IOException(tfm::format("failed to write cache file %s", tmpPath));
+          }
+        }
+        std::rename(tmpPath.c_str(), path.c_str());
+      }
+
+      std::vector<char> readFile(std::string path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<char>(
+            std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>());
+      }
+
+      /**
+       * Fetch blocks [first, last] with one request. They must already be
+       * marked in flight by the caller.
+       */
+      void fetchRun(uint64_t first, uint64_t last, RangeSource* source) {
+        try {
+          uint64_t start = first * this->blockSize;
+          uint64_t end = std::min((last + 1) * this->blockSize, this->total);
+          std::vector<char> data = source->read(start, end - start);
+          for (uint64_t block = first; block <= last; block++) {
+            size_t at = (block - first) * this->blockSize;
+            size_t length = std::min<uint64_t>(this->blockSize, data.size() - at);
+            this->writeFile(this->blockPath(block), data.data() + at, length);
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(this->lock);
+          for (uint64_t block = first; block <= last; block++) {
+            this->inflight.erase(block);
+          }
+          this->landed.notify_all();
+          throw;
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        for (uint64_t block = first; block <= last; block++) {
+          this->inflight.erase(block);
+          this->present.insert(block);
+        }
+        this->landed.notify_all();
+      }
+
+      /**
+       * Give up the claim on runs[from..] without fetching them, waking
+       * anyone waiting on their blocks.
+       */
+      void release(const std::vector<std::pair<uint64_t, uint64_t>>& runs, size_t from) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        for (size_t i = from; i < runs.size(); i++) {
+          for (uint64_t block = runs[i].first; block <= runs[i].second; block++) {
+            this->inflight.erase(block);
+          }
+        }
+        this->landed.notify_all();
+      }
+
+      /**
+       * Must hold lock.
+       */
+      bool anyInflight(uint64_t first, uint64_t end) {
+        for (uint64_t block = first; block < end; block++) {
+          if (this->inflight.count(block) > 0) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      /**
+       * Group missing blocks into runs, treating runs separated by no more
+       * than gap blocks as one: fetching a few unneeded blocks is cheaper
+       * than another round trip. Runs are cut at maxRun blocks if maxRun is
+       * not zero. Claims the blocks as in flight.
+       * Must hold lock.
+       */
+      std::vector<std::pair<uint64_t, uint64_t>> claimMissing(
+          const std::set<uint64_t>& wanted,
+          uint64_t gap,
+          uint64_t maxRun) {
+        std::vector<std::pair<uint64_t, uint64_t>> runs;
+        for (uint64_t block : wanted) {
+          if (this->present.count(block) > 0 || this->inflight.count(block) > 0) {
+            continue;
+          }
+          if (!runs.empty()
+              && block - runs.back().second <= gap + 1
+              && (maxRun == 0 || block - runs.back().first < maxRun)
+              && !this->anyInflight(runs.back().second + 1, block)) {
+            runs.back().second = block;
+          } else {
+            runs.push_back(std::make_pair(block, block));
+          }
+        }
+        for (auto run : runs) {
+          for (uint64_t block = run.first; block <= run.second; block++) {
+            // gap blocks may already be present, refetching them is harmless
+            this->inflight.insert(block);
+          }
+        }
+        return runs;
+      }
+
+    public:
+      BlockCache(
+          RangeSource* foreground,
+          RangeSource* background,
+          std::string dir,
+          uint64_t blockSize = 256 * 1024) {
+        this->foreground = foreground;
+        this->background = background;
+        this->dir = dir;
+        this->blockSize = blockSize;
+
+        std::error_code error;
+        std::filesystem::create_directories(dir, error);
+        if (error) {
+          throw IOException(tfm::format(
+              "failed to create block cache %s, reason: %s",
+              dir, error.message()));
+        }
+        this->scan();
+      }
+
+      uint64_t size() {
+        return this->total;
+      }
+
+      /**
+       * Fetch the last length bytes from the server and revalidate the cache
+       * against them. Must be called before anything else.
+       */
+      std::vector<char> readTail(uint64_t length, uint64_t* offset) {
+        this->tail = this->foreground->readTail(length, &this->tailOffset);
+        this->total = this->tailOffset + this->tail.size();
+        *offset = this->tailOffset;
+
+        std::string tailPath = tfm::format("%s/tail-%d", this->dir, this->total);
+        if (this->readFile(tailPath) != this->tail) {
+          std::lock_guard<std::mutex> guard(this->lock);
+          this->dropBlocks();
+          for (auto& file : std::filesystem::directory_iterator(this->dir)) {
+            if (file.path().filename().string().rfind("tail-", 0) == 0) {
+              std::filesystem::remove(file.path());
+            }
+          }
+          this->writeFile(tailPath, this->tail.data(), this->tail.size());
+        }
+        return this->tail;
+      }
+
+      /**
+       * read exactly [offset, offset + length), fetching whatever is missing
+       */
+      std::vector<char> read(uint64_t offset, uint64_t length) {
+        if (length == 0) {
+          return {};
+        }
+        if (offset + length > this->total) {
+          throw IOException(tfm::format(
+              "read past the end of the archive: %d + %d > %d",
+              offset, length, this->total));
+        }
+        if (offset >= this->tailOffset) {
+          auto start = this->tail.begin() + (offset - this->tailOffset);
+          return std::vector<char>(start, start + length);
+        }
+
+        uint64_t first = offset / this->blockSize;
+        uint64_t last = (offset + length - 1) / this->blockSize;
+        std::set<uint64_t> wanted;
+        for (uint64_t block = first; block <= last; block++) {
+          wanted.insert(block);
+        }
+
+        std::vector<std::pair<uint64_t, uint64_t>> runs;
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          runs = this->claimMissing(wanted, 0, 0);
+        }
+        for (size_t i = 0; i < runs.size(); i++) {
+          try {
+            this->fetchRun(runs[i].first, runs[i].second, this->foreground);
+          } catch (...) {
+            // fetchRun released the failed run, the rest were never asked for
+            this->release(runs, i + 1);
+            throw;
+          }
+        }
+        {
+          // anything still missing is being read ahead, wait for it
+          std::unique_lock<std::mutex> guard(this->lock);
+          this->landed.wait(guard, [&]() {
+            for (uint64_t block : wanted) {
+              if (this->inflight.count(block) > 0) {
+                return false;
+              }
+            }
+            return true;
+          });
+          for (uint64_t block : wanted) {
+            if (this->present.count(block) == 0) {
+              throw IOException(tfm::format("failed to read block %d", block));
+            }
+          }
+        }
+
+        std::vector<char> result;
+        result.reserve(length);
+        for (uint64_t block = first; block <= last; block++) {
+          std::vector<char> data = this->readFile(this->blockPath(block));
+          uint64_t blockStart = block * this->blockSize;
+          uint64_t from = std::max(offset, blockStart) - blockStart;
+          uint64_t to = std::min(offset + length, blockStart + data.size()) - blockStart;
+          if (from >= to) {
+            throw IOException(tfm::format("cached block %d is truncated", block));
+          }
+          result.insert(result.end(), data.begin() + from, data.begin() + to);
+        }
+        return result;
+      }
+
+      /**
+       * Fetch the blocks covering ranges on the background source.
+       * cancelled is checked between requests so a stale plan can be
+       * abandoned when the reader jumps elsewhere.
+       * Failures are dropped: the foreground read will retry and report.
+       */
+      void prefetch(
+          const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+          std::function<bool()> cancelled) {
+        std::set<uint64_t> wanted;
+        for (auto range : ranges) {
+          uint64_t end = std::min(range.first + range.second, this->tailOffset);
+          for (uint64_t offset = range.first; offset < end; offset += this->blockSize) {
+            wanted.insert(offset / this->blockSize);
+          }
+          if (range.first < end) {
+            wanted.insert((end - 1) / this->blockSize);
+          }
+        }
+
+        std::vector<std::pair<uint64_t, uint64_t>> runs;
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          // small requests keep cancellation prompt and bound how long a
+          // foreground read can wait on a block being read ahead
+          runs = this->claimMissing(wanted, 1, 8);
+        }
+        for (size_t i = 0; i < runs.size(); i++) {
+          if (cancelled()) {
+            this->release(runs, i);
+            return;
+          }
+          try {
+            this->fetchRun(runs[i].first, runs[i].second, this->background);
+          } catch (IOException& e) {
+            // fetchRun released the failed run, release the rest too
+            this->release(runs, i + 1);
+            return;
+          }
+        }
+      }
+  };
+
+}
@@ -1,9 +1,31 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
-#include <libzippp.h>
+#include <tinyformat.h>
+#include "Allocations.h"
+#include "Archive.h"
+#include "FrameDecoder.h"
+#include "GrowingArchive.h"
+#include "HttpRangeSource.h"
+#include "LocalArchive.h"
+#include "Metrics.h"
 #include "Page.h"
+#include "PageCache.h"
+#include "PageTable.h"
+#include "RemoteArchive.h"
+#include "ScheduledArchive.h"
+#include "SharedPageCache.h"
+#include "util.h"
 
 
 namespace app {
@@ -11,44 +33,570 @@ namespace app {
   class Book {
     private:
       SDL_Renderer* renderer;
-      libzippp::ZipArchive* file;
+      app::Archive* archive;
       std::string path;
-      std::vector<std::string> files;
+      // the image entries, in reading order
+      PageTable table;
       std::vector<Page*> pages;
+      // shared with the other open books, NULL for no caching
+      PageCache* cache = NULL;
+      // identifies this book's pages in the cache
+      uint64_t id;
+      // pages decoded by other processes, NULL for none
+      SharedPageCache* shared = NULL;
+      // identifies the archive to other processes
+      uint64_t identity = 0;
+      // archives can't be read from two threads, decoding can
+      std::mutex readLock;
+      // pages that failed to read or verify, shown as placeholders
+      std::set<size_t> bad;
+      // pages that turned out to be animated GIFs or PNGs when decoded
+      std::set<size_t> animated;
+      // guards bad, animated and the page dimensions in table
+      std::mutex badLock;
+      // decodes running right now, background work backs off while non zero
+      std::atomic<int> decoding { 0 };
+      // decode JPEGs to YUV planes rather than RGB surfaces
+      std::atomic<bool> planar { false };
+
+      uint64_t sharedKeyOf(size_t pageNumber) {
+        return SharedPageCache::keyOf(this->identity, this->table.getName(pageNumber),
+            this->table.getOffset(pageNumber), this->table.getCompressedSize(pageNumber));
+      }
+
+      /**
+       * Whether a page is decoded already, in our cache or the one shared
+       * with other processes
+       */
+      bool isCached(size_t pageNumber) {
+        return (this->cache != NULL && this->cache->contains({ this->id, pageNumber }))
+            || (this->shared != NULL && this->shared->contains(this->sharedKeyOf(pageNumber)));
+      }
 
     public:
-      Book(SDL_Renderer* renderer, std::string path) {
-        this->path = path;
+      /**
+       * Entry an optimized archive keeps its page sizes in, one
+       * "width<TAB>height<TAB>name" line per page, so they are known
+       * before anything is decoded
+       */
+      static constexpr const char* DIMENSIONS_ENTRY = "cbzreader-pages.tsv";
+
+      /**
+       * How long opening an archive that is still being written waits for
+       * its first page, counted from the last write
+       */
+      static constexpr int FIRST_PAGE_WAIT_MS = 10000;
+
+      Book(SDL_Renderer* renderer, std::string path) :
+          Book(path) {
         this->renderer = renderer;
-        this->file = new libzippp::ZipArchive(path);
-        this->file->open(libzippp::ZipArchive::READ_ONLY);
+      }
+
+      /**
+       * Open the archive without a renderer.
+       * setRenderer must be called before getPage.
+       */
+      Book(std::string path) {
+        static std::atomic<uint64_t> nextId { 0 };
+        this->id = nextId++;
+        this->path = path;
+        this->renderer = NULL;
+        AllocationTag tag(Allocations::Book);
+        {
+          AllocationTag reading(Allocations::Archive);
+          this->archive = openArchive(path);
+        }
+        try {
+          this->index();
+          while (this->table.size() == 0 && this->archive->waitForChange(FIRST_PAGE_WAIT_MS)) {
+            if (this->archive->refresh()) {
+              this->table = PageTable();
+              this->index();
+            }
+          }
+        } catch (...) {
+          delete this->archive;
+          throw;
+        }
+        this->archive->setReadingOrder(this->table.getNames());
+      }
+
+      /**
+       * Collect the entries that are images into the page table and sort
+       * them. Entries without an extension have their first few bytes read
+       * to look at; anything else goes by name.
+       */
+      void index() {
+        std::vector<ArchiveEntry> entries = this->archive->getEntries();
+        this->table.reserve(entries.size());
+        bool dimensions = false;
+        for (const ArchiveEntry& entry : entries) {
+          if (entry.name == DIMENSIONS_ENTRY) {
+            dimensions = true;
+            continue;
+          }
+          PageTable::Kind kind = PageTable::classify(entry.name);
+          if (kind == PageTable::Kind::Unknown) {
+            try {
+              std::vector<char> data = this->archive->readPrefix(entry.name, PageTable::MAGIC_SIZE);
+              kind = PageTable::hasImageMagic(data.data(), data.size())
+                  ? PageTable::Kind::Image
+                  : PageTable::Kind::NotImage;
+            } catch (IOException& e) {
+              kind = PageTable::Kind::NotImage;
+            }
+          }
+          if (kind == PageTable::Kind::Image) {
+            this->table.add(entry);
+          }
+        }
+        this->table.sort();
+        if (dimensions) {
+          this->loadDimensions();
+        }
+      }
 
-        std::vector<libzippp::ZipEntry> entries = this->file->getEntries();
-        std::vector<libzippp::ZipEntry>::iterator it;
-        for (it = entries.begin(); it != entries.end(); ++it) {
-          libzippp::ZipEntry entry = *it;
-          this->files.push_back(entry.getName());
+      /**
+       * Fill in page sizes from the DIMENSIONS_ENTRY. Lines that don't
+       * name a page are skipped, and so is the whole entry if it can't be
+       * read.
+       */
+      void loadDimensions() {
+        std::vector<char> data;
+        try {
+          data = this->archive->read(DIMENSIONS_ENTRY);
+        } catch (IOException& e) {
+          return;
+        }
+        std::stringstream lines(std::string(data.begin(), data.end()));
+        std::string line;
+        while (std::getline(lines, line)) {
+          size_t first = line.find('\t');
+          size_t second = first == std::string::npos ? first : line.find('\t', first + 1);
+          if (second == std::string::npos) {
+            continue;
+          }
+          neither::Maybe<int> width = tryParseInt(line.substr(0, first));
+          neither::Maybe<int> height = tryParseInt(line.substr(first + 1, second - first - 1));
+          neither::Maybe<size_t> page = this->table.find(line.substr(second + 1));
+          if (width.hasValue && height.hasValue && page.hasValue) {
+            this->table.setDimensions(page.unsafeGet(), width.unsafeGet(), height.unsafeGet());
+          }
+        }
+      }
+
+      /**
+       * http:// urls are read with range requests through a block cache,
+       * anything else is a local file, read through our own zip code when
+       * it can and libzippp when it can't. A local file without a central
+       * directory yet is taken to be still being written, and read as it
+       * grows.
+       */
+      static app::Archive* openArchive(std::string path) {
+        if (!isUrl(path)) {
+          try {
+            return new ScheduledArchive(path);
+          } catch (IOException& e) {
+          }
+          try {
+            GrowingArchive* growing = new GrowingArchive(path);
+            if (growing->isGrowing()) {
+              return growing;
+            }
+            delete growing;
+          } catch (IOException& e) {
+          }
+          return new LocalArchive(path);
+        }
+        std::string cacheDir = prefPath("blocks");
+        if (cacheDir.empty()) {
+          cacheDir = (std::filesystem::temp_directory_path() / "cbzreader-blocks").string();
         }
-        std::sort(this->files.begin(), this->files.end());
+        return new RemoteArchive(
+            new HttpRangeSource(path),
+            new HttpRangeSource(path),
+            tfm::format("%s/%016x", cacheDir, fnv1a(path)));
       }
 
       ~Book() {
-        this->file->close();
+        if (this->cache != NULL) {
+          this->cache->drop(this->id);
+        }
+        delete this->archive;
+      }
+
+      void setRenderer(SDL_Renderer* renderer) {
+        this->renderer = renderer;
+      }
+
+      /**
+       * Keep decoded pages in a cache, and let preload fill it.
+       * Call before the book is shared with other threads.
+       */
+      void setCache(PageCache* cache) {
+        this->cache = cache;
+      }
+
+      /**
+       * Look pages up in a cache shared with other reader processes before
+       * decoding them, and publish the ones we decode. The archive is
+       * known by its absolute path, size and modification time, so a file
+       * that changes isn't mixed up with its old pages.
+       * Pages in the shared cache stay out of our own: holding them there
+       * would keep other processes from ever evicting them.
+       * Call before the book is shared with other threads.
+       */
+      void setSharedCache(SharedPageCache* shared) {
+        if (shared == NULL || !shared->isEnabled()) {
+          return;
+        }
+        std::string key = this->path;
+        if (!isUrl(this->path)) {
+          std::error_code error;
+          std::string absolute = std::filesystem::absolute(this->path, error).string();
+          uintmax_t size = std::filesystem::file_size(this->path, error);
+          auto modified = std::filesystem::last_write_time(this->path, error);
+          if (error) {
+            return;
+          }
+          key = tfm::format("%s:%d:%d", absolute, size, modified.time_since_epoch().count());
+        }
+        this->identity = fnv1a(key);
+        this->shared = shared;
+      }
+
+      std::string getPath() {
+        return this->path;
       }
 
       size_t size() {
-        return this->files.size();
+        return this->table.size();
+      }
+
+      /**
+       * the page stored under an entry name
+       */
+      neither::Maybe<size_t> find(const std::string& name) {
+        return this->table.find(name);
+      }
+
+      /**
+       * Whether the archive is still being written, so refresh may find
+       * more pages
+       */
+      bool isGrowing() {
+        return this->archive->isGrowing();
       }
 
+      /**
+       * Block until the archive may have grown, up to timeoutMs.
+       * Safe to call from any thread.
+       */
+      bool waitForChange(int timeoutMs) {
+        return this->archive->waitForChange(timeoutMs);
+      }
+
+      /**
+       * Pick up the pages of a growing archive that landed since the last
+       * look, and its final order once the central directory is written.
+       * What is known about pages carries over by entry name; if any page
+       * moved, the book's cached pages are dropped.
+       * Nothing else may use the book meanwhile: cancel its scheduled
+       * decodes first.
+       * True if the pages changed.
+       */
+      bool refresh() {
+        std::lock_guard<std::mutex> reading(this->readLock);
+        AllocationTag tag(Allocations::Book);
+        {
+          AllocationTag growing(Allocations::Archive);
+          if (!this->archive->refresh()) {
+            return false;
+          }
+        }
+        PageTable old = std::move(this->table);
+        this->table = PageTable();
+        this->index();
+        bool moved = false;
+        {
+          std::lock_guard<std::mutex> guard(this->badLock);
+          std::set<size_t> bad;
+          std::set<size_t> animated;
+          for (size_t page = 0; page < old.size(); page++) {
+            neither::Maybe<size_t> now = this->table.find(old.getName(page));
+            if (!now.hasValue || now.unsafeGet() != page) {
+              moved = true;
+            }
+            if (!now.hasValue) {
+              continue;
+            }
+            std::pair<int, int> dimensions = old.getDimensions(page);
+            if (dimensions.first > 0) {
+              this->table.setDimensions(now.unsafeGet(), dimensions.first, dimensions.second);
+            }
+            if (this->bad.count(page) > 0) {
+              bad.insert(now.unsafeGet());
+            }
+            if (this->animated.count(page) > 0) {
+              animated.insert(now.unsafeGet());
+            }
+          }
+          this->bad = bad;
+          this->animated = animated;
+        }
+        if (moved && this->cache != NULL) {
+          this->cache->drop(this->id);
+        }
+        this->archive->setReadingOrder(this->table.getNames());
+        return true;
+      }
+
+      /**
+       * the entry a page is stored under
+       */
+      std::string getName(size_t pageNumber) {
+        return this->table.getName(pageNumber);
+      }
+
+      /**
+       * width and height of a page, 0 and 0 until it has been decoded
+       */
+      std::pair<int, int> getDimensions(size_t pageNumber) {
+        std::lock_guard<std::mutex> guard(this->badLock);
+        return this->table.getDimensions(pageNumber);
+      }
+
+      /**
+       * Keep JPEG pages as YUV planes from now on, for renderers that draw
+       * IYUV textures. Pages decoded before stay as they are.
+       */
+      void setPlanar(bool planar) {
+        this->planar = planar;
+      }
+
+      /**
+       * Read and decode a page without uploading it, planar if setPlanar
+       * asked for it and the page is a 4:2:0 or greyscale JPEG, and only
+       * its luminance if it is black and white.
+       * Does not use the renderer, so it may run on any thread. Reads are
+       * serialised, decodes run in parallel. With a shared cache, a page
+       * another process already decoded is borrowed from it instead.
+       */
+      Image* decodeImage(size_t pageNumber) {
+        this->decoding++;
+        try {
+          std::string name = this->table.getName(pageNumber);
+          uint64_t sharedKey = 0;
+          if (this->shared != NULL) {
+            sharedKey = this->sharedKeyOf(pageNumber);
+            bool animated = false;
+            Image* image = this->shared->get(sharedKey, &animated);
+            if (image != NULL) {
+              Metrics::global().sharedHits++;
+              std::lock_guard<std::mutex> guard(this->badLock);
+              if (animated) {
+                this->animated.insert(pageNumber);
+              }
+              this->table.setDimensions(pageNumber, image->getWidth(), image->getHeight());
+              this->decoding--;
+              return image;
+            }
+          }
+          std::vector<char> data;
+          {
+            std::lock_guard<std::mutex> guard(this->readLock);
+            AllocationTag tag(Allocations::Archive);
+            data = this->archive->read(name);
+          }
+          Metrics::global().bytesRead += data.size();
+          // named like an image, but isn't one
+          const char* format = PageTable::imageFormat(data.data(), data.size());
+          if (format == NULL) {
+            throw ImageOpenException(tfm::format("%s is not an image", name));
+          }
+          bool animated = FrameDecoder::isAnimated(data.data(), data.size());
+          if (animated) {
+            std::lock_guard<std::mutex> guard(this->badLock);
+            this->animated.insert(pageNumber);
+          }
+          auto start = std::chrono::steady_clock::now();
+          AllocationTag tag(Allocations::Decode);
+          Image* image = NULL;
+          if (this->planar && Metrics::formatOf(format) == Metrics::Jpeg) {
+            image = app::Page::decodePlanar(data.data(), data.size());
+          }
+          if (image == NULL) {
+            image = Image::fromSurface(app::Page::decode(data.data(), data.size()));
+          }
+          Metrics::global().decode[Metrics::formatOf(format)].record(std::chrono::steady_clock::now() - start);
+          if (this->shared != NULL) {
+            image = this->shared->put(sharedKey, image, animated);
+          }
+          {
+            std::lock_guard<std::mutex> guard(this->badLock);
+            this->table.setDimensions(pageNumber, image->getWidth(), image->getHeight());
+          }
+          this->decoding--;
+          return image;
+        } catch (...) {
+          this->decoding--;
+          throw;
+        }
+      }
+
+      /**
+       * Read and decode a page to a surface, for drawing without a window.
+       * Safe to call from any thread.
+       */
+      SDL_Surface* decode(size_t pageNumber) {
+        Image* image = this->decodeImage(pageNumber);
+        try {
+          SDL_Surface* surface = image->getKind() == Image::Kind::Surface
+              ? image->release()
+              : image->toSurface();
+          delete image;
+          return surface;
+        } catch (...) {
+          delete image;
+          throw;
+        }
+      }
+
+      bool isDecoding() {
+        return this->decoding > 0;
+      }
+
+      void markBad(size_t pageNumber) {
+        std::lock_guard<std::mutex> guard(this->badLock);
+        this->bad.insert(pageNumber);
+      }
+
+      /**
+       * Flag the page stored under an entry name, if it is one of ours.
+       * Safe to call from any thread.
+       */
+      void markBad(const std::string& name) {
+        neither::Maybe<size_t> page = this->table.find(name);
+        if (page.hasValue) {
+          this->markBad(page.unsafeGet());
+        }
+      }
+
+      bool isBad(size_t pageNumber) {
+        std::lock_guard<std::mutex> guard(this->badLock);
+        return this->bad.count(pageNumber) > 0;
+      }
+
+      /**
+       * Whether a page decoded so far is an animated GIF or PNG; its
+       * decoded image is the first frame
+       */
+      bool isAnimated(size_t pageNumber) {
+        std::lock_guard<std::mutex> guard(this->badLock);
+        return this->animated.count(pageNumber) > 0;
+      }
+
+      /**
+       * A decoder for the frames of an animated page, over its data read
+       * again. NULL for pages that aren't animated, or can't be read now.
+       * Safe to call from any thread.
+       */
+      FrameDecoder* openFrames(size_t pageNumber) {
+        if (!this->isAnimated(pageNumber)) {
+          return NULL;
+        }
+        std::vector<char> data;
+        try {
+          std::lock_guard<std::mutex> guard(this->readLock);
+          AllocationTag tag(Allocations::Archive);
+          data = this->archive->read(this->table.getName(pageNumber));
+        } catch (IOException& e) {
+          return NULL;
+        }
+        Metrics::global().bytesRead += data.size();
+        return FrameDecoder::open(std::move(data));
+      }
+
+      /**
+       * Tell the archive which pages are about to be decoded, so it can
+       * batch their reads. Pages already cached, bad or past the end are
+       * left out.
+       * Safe to call from any thread.
+       */
+      void willRead(const std::vector<size_t>& pages) {
+        std::vector<std::string> names;
+        for (size_t page : pages) {
+          if (page < this->size() && !this->isBad(page)
+              && !this->isCached(page)) {
+            names.push_back(this->table.getName(page));
+          }
+        }
+        if (!names.empty()) {
+          this->archive->willRead(names);
+        }
+      }
+
+      /**
+       * Decode a page into the cache ahead of time so the next getPage for
+       * it only has to upload the texture. Pages past the end are ignored,
+       * and so is everything when there is no cache.
+       * Safe to call from any thread.
+       * True if the page was decoded by this call.
+       */
+      bool preload(size_t pageNumber) {
+        if (this->cache == NULL || pageNumber >= this->size()
+            || this->isBad(pageNumber) || this->isCached(pageNumber)) {
+          return false;
+        }
+        try {
+          Image* image = this->decodeImage(pageNumber);
+          if (image->isShared()) {
+            // published, getPage borrows it again
+            delete image;
+          } else {
+            this->cache->put({ this->id, pageNumber }, image);
+          }
+          return true;
+        } catch (ImageOpenException& e) {
+          this->markBad(pageNumber);
+        } catch (IOException& e) {
+          this->markBad(pageNumber);
+        }
+        return false;
+      }
+
+      /**
+       * A page that can't be read comes back as a placeholder and is
+       * remembered as bad, rather than ending the session. So does one
+       * past the end, say of a book still being written, without being
+       * remembered: it may land later.
+       */
       Page* getPage(size_t pageNumber) {
-        libzippp::ZipEntry entry = this->file->getEntry(this->files.at(pageNumber));
-        int size = entry.getSize();
-        void* binaryData = entry.readAsBinary();
-        // TODO track and init only once
-        // FIXME leak
-        return app::Page::fromMemory(this->renderer, binaryData, size);
+        if (pageNumber >= this->size()) {
+          return app::Page::placeholder(this->renderer);
+        }
+        if (this->cache != NULL) {
+          std::shared_ptr<Image> cached = this->cache->get({ this->id, pageNumber });
+          if (cached) {
+            return new Page(this->renderer, cached);
+          }
+        }
+        if (this->isBad(pageNumber)) {
+          return app::Page::placeholder(this->renderer);
+        }
+        try {
+          Image* image = this->decodeImage(pageNumber);
+          if (this->cache == NULL || image->isShared()) {
+            return new Page(this->renderer, std::shared_ptr<Image>(image));
+          }
+          return new Page(this->renderer, this->cache->put({ this->id, pageNumber }, image));
+        } catch (ImageOpenException& e) {
+          this->markBad(pageNumber);
+        } catch (IOException& e) {
+          this->markBad(pageNumber);
+        }
+        return app::Page::placeholder(this->renderer);
       }
   };
 }
 
-
@@ -0,0 +1,85 @@
+#pragma once
+#include <future>
+#include <string>
+#include <vector>
+#include "Book.h"
+#include "PageCache.h"
+#include "SdlEngine.h"
+#include "SharedPageCache.h"
+#include "StartupStats.h"
+
+namespace app {
+
+  /**
+   * Opens a book and decodes the requested pages on a background thread so the
+   * archive I/O overlaps with SDL video and font initialisation.
+   *
+   * The loader owns image codec initialisation: SDL_image lazily initialises
+   * codecs from IMG_Load_RW, which races with IMG_Init on another thread, so
+   * the engine must be created with image codecs disabled while a loader runs.
+   * Loaders started once the codecs are up pass initCodecs false, and may
+   * pass no stats.
+   */
+  class BookLoader {
+    private:
+      std::future<Book*> pending;
+
+    public:
+      BookLoader(
+          std::string path,
+          std::vector<size_t> preload,
+          PageCache* cache,
+          SharedPageCache* shared,
+          StartupStats* stats,
+          bool initCodecs = true) {
+        this->pending = std::async(std::launch::async, [=]() {
+          auto mark = [stats](std::string name) {
+            if (stats != NULL) {
+              stats->mark(name);
+            }
+          };
+          if (initCodecs) {
+            SdlEngine::initImage();
+            mark("image codecs ready");
+          }
+
+          Book* book = new Book(path);
+          book->setCache(cache);
+          book->setSharedCache(shared);
+          mark("archive opened");
+
+          try {
+            book->willRead(preload);
+            for (size_t pageNumber : preload) {
+              book->preload(pageNumber);
+            }
+          } catch (...) {
+            delete book;
+            throw;
+          }
+          mark("prewarm decoded");
+          return book;
+        });
+      }
+
+      ~BookLoader() {
+        if (this->pending.valid()) {
+          try {
+            delete this->pending.get();
+          } catch (...) {
+            // nobody asked for the book, so nobody cares why it failed
+          }
+        }
+      }
+
+      /**
+       * Wait for the book to finish loading.
+       * Ownership of the book passes to the caller.
+       * Rethrows anything thrown while loading.
+       */
+      Book* get() {
+        return this->pending.get();
+      }
+  };
+
+}
@@ -0,0 +1,269 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <neither.h>
+#include "Archive.h"
+
+namespace app {
+
+  /**
+   * What a ComicInfo.xml (the ComicRack metadata schema) says about a
+   * volume, the fields worth searching by. Missing fields are empty.
+   * Writer, Genre, Tags and Characters are comma separated lists.
+   */
+  struct ComicInfo {
+    enum Field { Series, Title, Number, Volume, Year, Writer, Penciller, Publisher, Genre, Tags, Characters, FIELDS };
+
+    std::string fields[FIELDS];
+
+    static const char* fieldName(int field) {
+      static const char* names[FIELDS] = {
+          "series", "title", "number", "volume", "year", "writer", "penciller",
+          "publisher", "genre", "tags", "characters" };
+      return names[field];
+    }
+
+    /**
+     * the field for a lower case name, nothing if it isn't one
+     */
+    static neither::Maybe<Field> fieldNamed(const std::string& name) {
+      for (int i = 0; i < FIELDS; i++) {
+        if (name == fieldName(i)) {
+          return { (Field) i };
+        }
+      }
+      return {};
+    }
+
+    /**
+     * The entry holding a volume's metadata: ComicInfo.xml in any case,
+     * the one nearest the root if there are several. Empty if there is
+     * none.
+     */
+    static std::string entryIn(const std::vector<std::string>& names) {
+      std::string found = "";
+      for (const std::string& name : names) {
+        size_t slash = name.find_last_of('/');
+        std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+        if (base.size() != 13) {
+          continue;
+        }
+        bool matches = true;
+        for (size_t i = 0; i < base.size() && matches; i++) {
+          matches = std::tolower((unsigned char) base[i]) == "comicinfo.xml"[i];
+        }
+        if (matches && (found.empty() || name.size() < found.size())) {
+          found = name;
+        }
+      }
+      return found;
+    }
+
+    /**
+     * Parse the xml in one pass without building a tree: the text of each
+     * element directly under the root is kept if it names a field.
+     * Comments, processing instructions, doctypes and attributes are
+     * skipped, CDATA and character references are decoded. Malformed
+     * input stops the parse and keeps what was read up to there.
+     */
+    static ComicInfo parse(const char* xml, size_t length) {
+      ComicInfo info;
+      const char* at = xml;
+      const char* end = xml + length;
+      int depth = 0;
+      // the field of the element being read, -1 for none
+      int field = -1;
+      std::string text;
+
+      auto startsWith = [&](const char* prefix) {
+        size_t n = std::strlen(prefix);
+        return (size_t) (end - at) >= n && std::memcmp(at, prefix, n) == 0;
+      };
+      auto skipPast = [&](const char* marker) {
+        const char* found = std::search(at, end, marker, marker + std::strlen(marker));
+        at = found == end ? end : found + std::strlen(marker);
+        return found != end;
+      };
+
+      while (at < end) {
+        if (*at != '<') {
+          const char* next = std::find(at, end, '<');
+          if (field >= 0) {
+            decodeText(at, next, text);
+          }
+          at = next;
+          continue;
+        }
+        if (startsWith("<!--")) {
+          if (!skipPast("-->")) {
+            break;
+          }
+        } else if (startsWith("<![CDATA[")) {
+          at += 9;
+          const char* start = at;
+          if (!skipPast("]]>")) {
+            break;
+          }
+          if (field >= 0) {
+            text.append(start, at - 3);
+          }
+        } else if (startsWith("<?") || startsWith("<!")) {
+          if (!skipPast(">")) {
+            break;
+          }
+        } else if (startsWith("</")) {
+          if (!skipPast(">")) {
+            break;
+          }
+          if (depth == 2 && field >= 0) {
+            info.fields[field] = trim(text);
+          }
+          field = -1;
+          depth--;
+        } else {
+          at++;
+          const char* nameEnd = at;
+          while (nameEnd < end && !std::isspace((unsigned char) *nameEnd)
+              && *nameEnd != '>' && *nameEnd != '/') {
+            nameEnd++;
+          }
+          std::string name(at, nameEnd);
+          at = nameEnd;
+          if (!skipPast(">")) {
+            break;
+          }
+          if (at[-2] == '/') {
+            // <Tags/>
+            continue;
+          }
+          depth++;
+          field = -1;
+          if (depth == 2) {
+            for (char& c : name) {
+              c = std::tolower((unsigned char) c);
+            }
+            neither::Maybe<Field> named = fieldNamed(name);
+            if (named.hasValue) {
+              field = named.unsafeGet();
+              text.clear();
+            }
+          }
+        }
+      }
+      return info;
+    }
+
+    /**
+     * The metadata of an archive, nothing if it has no ComicInfo.xml.
+     * Throws IOException if the entry can't be read.
+     */
+    static neither::Maybe<ComicInfo> read(Archive* archive) {
+      std::string name = entryIn(archive->getNames());
+      if (name.empty()) {
+        return {};
+      }
+      std::vector<char> xml = archive->read(name);
+      return { parse(xml.data(), xml.size()) };
+    }
+
+    /**
+     * Lower case words of a field value for the index: runs of letters
+     * and digits, where any byte of a multi-byte UTF-8 character counts
+     * as a letter.
+     */
+    static std::vector<std::string> words(const std::string& value) {
+      std::vector<std::string> words;
+      std::string word;
+      for (char c : value) {
+        unsigned char u = c;
+        if (std::isalnum(u) || u >= 0x80) {
+          word += std::tolower(u);
+        } else if (!word.empty()) {
+          words.push_back(word);
+          word.clear();
+        }
+      }
+      if (!word.empty()) {
+        words.push_back(word);
+      }
+      return words;
+    }
+
+    private:
+      static std::string trim(const std::string& text) {
+        size_t first = text.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) {
+          return "";
+        }
+        return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+      }
+
+      static void appendUtf8(uint32_t code, std::string& out) {
+        if (code < 0x80) {
+          out += (char) code;
+        } else if (code < 0x800) {
+          out += (char) (0xc0 | (code >> 6));
+          out += (char) (0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+          out += (char) (0xe0 | (code >> 12));
+          out += (char) (0x80 | ((code >> 6) & 0x3f));
+          out += (char) (0x80 | (code & 0x3f));
+        } else if (code < 0x110000) {
+          out += (char) (0xf0 | (code >> 18));
+          out += (char) (0x80 | ((code >> 12) & 0x3f));
+          out += (char) (0x80 | ((code >> 6) & 0x3f));
+          out += (char) (0x80 | (code & 0x3f));
+        }
+      }
+
+      /**
+       * append [from, to) to out with entity and character references
+       * decoded; unknown ones are kept as they are
+       */
+      static void decodeText(const char* from, const char* to, std::string& out) {
+        static const char* entities[][2] = {
+            { "amp", "&" }, { "lt", "<" }, { "gt", ">" }, { "quot", "\"" }, { "apos", "'" } };
+        while (from < to) {
+          const char* amp = std::find(from, to, '&');
+          out.append(from, amp);
+          if (amp == to) {
+            return;
+          }
+          const char* semicolon = std::find(amp, std::min(to, amp + 12), ';');
+          std::string reference(amp + 1, semicolon);
+          from = semicolon == to || *semicolon != ';' ? amp + 1 : semicolon + 1;
+          if (from == amp + 1) {
+            out += '&';
+            continue;
+          }
+          bool decoded = false;
+          if (reference.size() > 1 && reference[0] == '#') {
+            bool hex = reference[1] == 'x' || reference[1] == 'X';
+            char* parsed = NULL;
+            const char* digits = reference.c_str() + (hex ? 2 : 1);
+            unsigned long code = std::strtoul(digits, &parsed, hex ? 16 : 10);
+            if (parsed != digits && *parsed == '\0') {
+              appendUtf8(code, out);
+              decoded = true;
+            }
+          } else {
+            for (auto entity : entities) {
+              if (reference == entity[0]) {
+                out += entity[1];
+                decoded = true;
+              }
+            }
+          }
+          if (!decoded) {
+            out.append(amp, from);
+          }
+        }
+      }
+  };
+
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace app {
+
+  /**
+   * CRC-32 as used by zip, with the same chaining as zlib's crc32:
+   * compute(compute(0, a), b) == compute(0, a + b).
+   *
+   * Uses carry-less multiply folding on x86 with PCLMUL, the CRC32
+   * instructions on ARMv8, and zlib everywhere else. The choice is made once
+   * at runtime so the binary still runs on older CPUs.
+   */
+  class Crc32 {
+    private:
+      typedef uint32_t (*Kernel)(uint32_t crc, const unsigned char* data, size_t length);
+
+#if defined(__x86_64__) || defined(__i386__)
+      // folding constants for the reflected CRC-32 polynomial, from Intel's
+      // "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"
+      alignas(16) static constexpr uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+      alignas(16) static constexpr uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+      alignas(16) static constexpr uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+      alignas(16) static constexpr uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+
+      /**
+       * length must be at least 64 and a multiple of 16.
+       * crc is the inverted running state, not the finished value.
+       */
+      __attribute__((target("pclmul,sse4.1")))
+      static uint32_t fold(uint32_t crc, const unsigned char* data, size_t length) {
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+        x1 = _mm_loadu_si128((const __m128i*) (data + 0x00));
+        x2 = _mm_loadu_si128((const __m128i*) (data + 0x10));
+        x3 = _mm_loadu_si128((const __m128i*) (data + 0x20));
+        x4 = _mm_loadu_si128((const __m128i*) (data + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+        x0 = _mm_load_si128((const __m128i*) k1k2);
+        data += 64;
+        length -= 64;
+
+        // fold four lanes of 16 bytes in parallel
+        while (length >= 64) {
+          x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+          x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+          x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+          x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+          x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+          x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+          x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+          x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+          y5 = _mm_loadu_si128((const __m128i*) (data + 0x00));
+          y6 = _mm_loadu_si128((const __m128i*) (data + 0x10));
+          y7 = _mm_loadu_si128((const __m128i*) (data + 0x20));
+          y8 = _mm_loadu_si128((const __m128i*) (data + 0x30));
+
+          x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+          x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+          x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+          x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+          data += 64;
+          length -= 64;
+        }
+
+        // fold the four lanes into one
+        x0 = _mm_load_si128((const __m128i*) k3k4);
+        for (__m128i next : { x2, x3, x4 }) {
+          x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+          x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+          x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+        }
+
+        while (length >= 16) {
+          x2 = _mm_loadu_si128((const __m128i*) data);
+          x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+          x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+          x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+          data += 16;
+          length -= 16;
+        }
+
+        // 128 bits down to 64
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+
+        x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        // Barrett reduction to 32 bits
+        x0 = _mm_load_si128((const __m128i*) poly);
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        return _mm_extract_epi32(x1, 1);
+      }
+
+      static uint32_t pclmul(uint32_t crc, const unsigned char* data, size_t length) {
+        if (length >= 64) {
+          size_t folded = length & ~(size_t) 15;
+          crc = ~fold(~crc, data, folded);
+          data += folded;
+          length -= folded;
+        }
+        return ::crc32(crc, data, length);
+      }
+#endif
+
+#if defined(__aarch64__)
+      __attribute__((target("+crc")))
+      static uint32_t armv8(uint32_t crc, const unsigned char* data, size_t length) {
+        crc = ~crc;
+        while (length >= 8) {
+          uint64_t word;
+          std::memcpy(&word, data, sizeof(word));
+          crc = __crc32d(crc, word);
+          data += 8;
+          length -= 8;
+        }
+        while (length > 0) {
+          crc = __crc32b(crc, *data);
+          data++;
+          length--;
+        }
+        return ~crc;
+      }
+#endif
+
+      static uint32_t portable(uint32_t crc, const unsigned char* data, size_t length) {
+        // zlib takes a uInt length
+        while (length > 0) {
+          uInt chunk = length > (1u << 30) ? (1u << 30) : (uInt) length;
+          crc = ::crc32(crc, data, chunk);
+          data += chunk;
+          length -= chunk;
+        }
+        return crc;
+      }
+
+      static Kernel select() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+          return pclmul;
+        }
+#endif
+#if defined(__aarch64__)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+          return armv8;
+        }
+#endif
+        return portable;
+      }
+
+    public:
+      static uint32_t compute(uint32_t crc, const void* data, size_t length) {
+        static const Kernel kernel = select();
+        return kernel(crc, static_cast<const unsigned char*>(data), length);
+      }
+
+      /**
+       * name of the kernel in use, for diagnostics
+       */
+      static const char* kernelName() {
+        Kernel kernel = select();
+#if defined(__x86_64__) || defined(__i386__)
+        if (kernel == pclmul) {
+          return "pclmul";
+        }
+#endif
+#if defined(__aarch64__)
+        if (kernel == armv8) {
+          return "armv8 crc";
+        }
+#endif
+        return "zlib";
+      }
+  };
+
+}
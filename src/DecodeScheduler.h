@@ -0,0 +1,173 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Book.h"
+
+namespace app {
+
+  /**
+   * One pool of decode threads shared by every open book.
+   *
+   * Each book has at most one batch of wanted pages queued: scheduling
+   * again replaces whatever of its previous batch hasn't started, so a
+   * reader flipping quickly never builds up a backlog of stale spreads.
+   * Workers take the focused book's pages first and only then serve the
+   * other windows, in the order they asked.
+   *
+   * Decoded pages land in the book's page cache, where the window picks
+   * them up on its next getPage.
+   */
+  class DecodeScheduler {
+    public:
+      // told about each page a job decoded, and how long it took in ms
+      typedef std::function<void(size_t, double)> Listener;
+
+    private:
+      struct Job {
+        Book* book;
+        size_t page;
+        Listener decoded;
+      };
+
+      std::mutex lock;
+      std::condition_variable wake;
+      std::condition_variable finished;
+      std::deque<Job> queue;
+      // book -> jobs being decoded right now
+      std::unordered_map<Book*, int> running;
+      Book* focus = NULL;
+      bool stopping = false;
+      std::vector<std::thread> workers;
+
+      /**
+       * the first job of the focused book, or the oldest job.
+       * Must hold the lock, and the queue must not be empty.
+       */
+      Job next() {
+        auto it = std::find_if(this->queue.begin(), this->queue.end(), [&](const Job& job) {
+          return job.book == this->focus;
+        });
+        if (it == this->queue.end()) {
+          it = this->queue.begin();
+        }
+        Job job = *it;
+        this->queue.erase(it);
+        return job;
+      }
+
+      /**
+       * Drop a book's jobs that haven't started. Must hold the lock.
+       */
+      void unqueue(Book* book) {
+        this->queue.erase(
+            std::remove_if(this->queue.begin(), this->queue.end(), [&](const Job& job) {
+              return job.book == book;
+            }),
+            this->queue.end());
+      }
+
+      void work() {
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true) {
+          this->wake.wait(guard, [&]() {
+            return this->stopping || !this->queue.empty();
+          });
+          if (this->stopping) {
+            return;
+          }
+          Job job = this->next();
+          this->running[job.book]++;
+          guard.unlock();
+
+          try {
+            auto start = std::chrono::steady_clock::now();
+            if (job.book->preload(job.page) && job.decoded) {
+              job.decoded(job.page, std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start).count());
+            }
+          } catch (...) {
+            // prefetch is best effort, the window reports errors when the
+            // page is actually shown
+          }
+
+          guard.lock();
+          if (--this->running[job.book] == 0) {
+            this->running.erase(job.book);
+            this->finished.notify_all();
+          }
+        }
+      }
+
+    public:
+      /**
+       * threads: 0 for one less than the number of cores, leaving one for
+       * the windows
+       */
+      DecodeScheduler(size_t threads = 0) {
+        if (threads == 0) {
+          threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        }
+        for (size_t i = 0; i < threads; i++) {
+          this->workers.push_back(std::thread(&DecodeScheduler::work, this));
+        }
+      }
+
+      ~DecodeScheduler() {
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          this->stopping = true;
+          this->wake.notify_all();
+        }
+        for (std::thread& worker : this->workers) {
+          worker.join();
+        }
+      }
+
+      /**
+       * Replace a book's queued pages with these, most wanted first.
+       * Pages already cached are skipped when their turn comes.
+       * decoded is called on a decode thread; it must stay valid until the
+       * book is cancelled.
+       */
+      void schedule(Book* book, std::vector<size_t> pages, Listener decoded = NULL) {
+        book->willRead(pages);
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->unqueue(book);
+        for (size_t page : pages) {
+          this->queue.push_back(Job { book, page, decoded });
+        }
+        this->wake.notify_all();
+      }
+
+      /**
+       * the book whose pages go first, normally the focused window's
+       */
+      void setFocus(Book* book) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->focus = book;
+      }
+
+      /**
+       * Drop a book's queued pages and wait for the ones being decoded.
+       * The book may be deleted once this returns.
+       */
+      void cancel(Book* book) {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->unqueue(book);
+        if (this->focus == book) {
+          this->focus = NULL;
+        }
+        this->finished.wait(guard, [&]() {
+          return this->running.count(book) == 0;
+        });
+      }
+  };
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <map>
+#include <string>
+#include <utility>
+#include <SDL_ttf.h>
+#include <tinyformat.h>
+#include "Allocations.h"
+#include "TextBox.h"
+
+namespace app {
+
+  /**
+   * Fonts opened once per process and shared by every window.
+   * SDL_ttf caches rendered glyphs per font, so sharing the font shares
+   * the glyph cache as well.
+   * Main thread only, like the rest of SDL_ttf.
+   */
+  class FontCache {
+    private:
+      std::map<std::pair<std::string, size_t>, TTF_Font*> fonts;
+
+    public:
+      ~FontCache() {
+        for (auto entry : this->fonts) {
+          TTF_CloseFont(entry.second);
+        }
+      }
+
+      /**
+       * The font stays owned by the cache
+       */
+      TTF_Font* get(std::string fontPath, size_t point) {
+        auto key = std::make_pair(fontPath, point);
+        auto it = this->fonts.find(key);
+        if (it != this->fonts.end()) {
+          return it->second;
+        }
+        AllocationTag tag(Allocations::Text);
+        TTF_Font* font = TTF_OpenFont(fontPath.c_str(), point);
+        if (font == NULL) {
+          throw TTFException(tfm::format(
+              "Failed to open font file, reason: %s",
+              TTF_GetError()));
+        }
+        this->fonts[key] = font;
+        return font;
+      }
+  };
+
+}
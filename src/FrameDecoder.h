@@ -0,0 +1,746 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <SDL.h>
+#include <zlib.h>
+#include "Page.h"
+#include "PageTable.h"
+
+namespace app {
+
+  /**
+   * Composes the frames of an animated image one at a time onto a canvas
+   * of ARGB8888 pixels the size of the image, keeping only the encoded
+   * image and what disposal needs, never the frames themselves. After the
+   * last frame it starts over from the first.
+   */
+  class FrameDecoder {
+    protected:
+      std::vector<char> data;
+      int width = 0;
+      int height = 0;
+      // the region the last frame drew, for its disposal
+      SDL_Rect last = { 0, 0, 0, 0 };
+      int disposal = 0;
+      // canvas under the last frame, for disposals that restore it
+      std::vector<uint32_t> saved;
+
+      enum Disposal { Keep, Clear, Restore };
+
+      FrameDecoder(std::vector<char> data) {
+        this->data = std::move(data);
+      }
+
+      const uint8_t* bytes(size_t at) {
+        return (const uint8_t*) this->data.data() + at;
+      }
+
+      bool has(size_t at, size_t length) {
+        return at <= this->data.size() && this->data.size() - at >= length;
+      }
+
+      /**
+       * Undo the last frame as its disposal asks, then remember the region
+       * the next one draws and how it goes away
+       */
+      void dispose(uint32_t* canvas, SDL_Rect next, int disposal) {
+        for (int y = 0; y < this->last.h && this->disposal != Keep; y++) {
+          uint32_t* row = canvas + (size_t) (this->last.y + y) * this->width + this->last.x;
+          if (this->disposal == Clear) {
+            std::fill(row, row + this->last.w, 0);
+          } else {
+            std::copy(this->saved.begin() + (size_t) y * this->last.w,
+                this->saved.begin() + (size_t) (y + 1) * this->last.w, row);
+          }
+        }
+        // frames are clipped to the canvas
+        SDL_Rect canvasRect = { 0, 0, this->width, this->height };
+        if (!SDL_IntersectRect(&next, &canvasRect, &this->last)) {
+          this->last = { 0, 0, 0, 0 };
+        }
+        this->disposal = disposal;
+        if (disposal == Restore) {
+          this->saved.resize((size_t) this->last.w * this->last.h);
+          for (int y = 0; y < this->last.h; y++) {
+            const uint32_t* row = canvas + (size_t) (this->last.y + y) * this->width + this->last.x;
+            std::copy(row, row + this->last.w, this->saved.begin() + (size_t) y * this->last.w);
+          }
+        }
+      }
+
+      void restart(uint32_t* canvas) {
+        std::fill(canvas, canvas + (size_t) this->width * this->height, 0);
+        this->last = { 0, 0, 0, 0 };
+        this->disposal = Keep;
+      }
+
+      ImageOpenException corrupt() {
+        return ImageOpenException("animated image is corrupt");
+      }
+
+    public:
+      static constexpr int64_t MAX_PIXELS = 4096 * 4096;
+
+      virtual ~FrameDecoder() {}
+
+      /**
+       * Whether data is a GIF with more than one frame or a PNG with an
+       * animation control chunk, looking no further than it has to
+       */
+      static bool isAnimated(const char* data, size_t length);
+
+      /**
+       * A decoder for an animated GIF or PNG, NULL for anything else.
+       * Takes the encoded image.
+       */
+      static FrameDecoder* open(std::vector<char> data);
+
+      int getWidth() {
+        return this->width;
+      }
+
+      int getHeight() {
+        return this->height;
+      }
+
+      /**
+       * Draw the next frame onto canvas, width * height pixels that hold
+       * the previous one, and return how long it shows for in ms.
+       * Throws ImageOpenException if the data turns out to be corrupt.
+       */
+      virtual int next(uint32_t* canvas) = 0;
+  };
+
+  /**
+   * GIF89a, LZW decoded straight onto the canvas
+   */
+  class GifDecoder : public FrameDecoder {
+    private:
+      // where the first block after the global colour table is
+      size_t first = 0;
+      size_t at = 0;
+      uint32_t globalColours[256];
+      int globalColourCount = 0;
+
+      static uint16_t le16(const uint8_t* p) {
+        return p[0] | (p[1] << 8);
+      }
+
+      static void readColours(const uint8_t* p, int count, uint32_t* colours) {
+        for (int i = 0; i < count; i++) {
+          colours[i] = 0xff000000u | (p[i * 3] << 16) | (p[i * 3 + 1] << 8) | p[i * 3 + 2];
+        }
+      }
+
+      /**
+       * the offset past a run of sub-blocks starting at at
+       */
+      size_t skipBlocks(size_t at) {
+        while (this->has(at, 1) && *this->bytes(at) != 0) {
+          at += 1 + *this->bytes(at);
+        }
+        if (!this->has(at, 1)) {
+          throw this->corrupt();
+        }
+        return at + 1;
+      }
+
+      /**
+       * Decode the LZW image data at at into rect of the canvas, leaving
+       * transparent pixels alone. Returns the offset past the data.
+       */
+      size_t decodeImage(size_t at, uint32_t* canvas, SDL_Rect rect, SDL_Rect clip,
+          const uint32_t* colours, int colourCount, int transparent, bool interlaced) {
+        if (!this->has(at, 1)) {
+          throw this->corrupt();
+        }
+        int minimum = *this->bytes(at++);
+        if (minimum < 2 || minimum > 11) {
+          throw this->corrupt();
+        }
+        int clear = 1 << minimum;
+        int end = clear + 1;
+        int codeSize = minimum + 1;
+        int next = clear + 2;
+        int previous = -1;
+        static thread_local uint16_t prefix[4096];
+        static thread_local uint8_t suffix[4096];
+        static thread_local uint8_t stack[4097];
+        for (int i = 0; i < clear; i++) {
+          prefix[i] = 0xffff;
+          suffix[i] = i;
+        }
+
+        size_t pixels = (size_t) rect.w * rect.h;
+        size_t written = 0;
+        int pass = 0;
+        int row = 0;
+        int column = 0;
+        static const int passStart[4] = { 0, 4, 2, 1 };
+        static const int passStep[4] = { 8, 8, 4, 2 };
+        auto emit = [&](uint8_t index) {
+          if (written >= pixels) {
+            return;
+          }
+          int x = rect.x + column;
+          int y = rect.y + row;
+          if (index != transparent && index < colourCount
+              && x >= clip.x && x < clip.x + clip.w && y >= clip.y && y < clip.y + clip.h) {
+            canvas[(size_t) y * this->width + x] = colours[index];
+          }
+          written++;
+          if (++column == rect.w) {
+            column = 0;
+            if (!interlaced) {
+              row++;
+            } else {
+              row += passStep[pass];
+              while (row >= rect.h && pass < 3) {
+                pass++;
+                row = passStart[pass];
+              }
+            }
+          }
+        };
+
+        uint32_t bits = 0;
+        int bitCount = 0;
+        bool ended = false;
+        while (this->has(at, 1) && *this->bytes(at) != 0) {
+          size_t blockEnd = at + 1 + *this->bytes(at);
+          if (!this->has(at, blockEnd - at)) {
+            throw this->corrupt();
+          }
+          for (at++; at < blockEnd && !ended; at++) {
+            bits |= (uint32_t) *this->bytes(at) << bitCount;
+            bitCount += 8;
+            while (bitCount >= codeSize && !ended) {
+              int code = bits & ((1 << codeSize) - 1);
+              bits >>= codeSize;
+              bitCount -= codeSize;
+              if (code == clear) {
+                codeSize = minimum + 1;
+                next = clear + 2;
+                previous = -1;
+                continue;
+              }
+              if (code == end) {
+                ended = true;
+                break;
+              }
+              if (code > next || (code == next && previous < 0)) {
+                throw this->corrupt();
+              }
+              // unwind the string for code, or for previous plus its
+              // own first byte if code is the one being defined
+              int depth = 0;
+              int walk = code == next ? previous : code;
+              while (walk >= clear) {
+                stack[depth++] = suffix[walk];
+                walk = prefix[walk];
+              }
+              uint8_t head = walk;
+              stack[depth++] = head;
+              for (int i = depth - 1; i >= 0; i--) {
+                emit(stack[i]);
+              }
+              if (code == next) {
+                emit(head);
+              }
+              if (previous >= 0 && next < 4096) {
+                prefix[next] = previous;
+                suffix[next] = head;
+                next++;
+                if (next == (1 << codeSize) && codeSize < 12) {
+                  codeSize++;
+                }
+              }
+              previous = code;
+            }
+          }
+          at = blockEnd;
+        }
+        if (!this->has(at, 1)) {
+          throw this->corrupt();
+        }
+        return at + 1;
+      }
+
+    public:
+      GifDecoder(std::vector<char> data) :
+          FrameDecoder(std::move(data)) {
+        if (!this->has(0, 13)) {
+          throw this->corrupt();
+        }
+        this->width = le16(this->bytes(6));
+        this->height = le16(this->bytes(8));
+        uint8_t packed = *this->bytes(10);
+        this->first = 13;
+        if (packed & 0x80) {
+          this->globalColourCount = 2 << (packed & 7);
+          if (!this->has(13, this->globalColourCount * 3)) {
+            throw this->corrupt();
+          }
+          readColours(this->bytes(13), this->globalColourCount, this->globalColours);
+          this->first += this->globalColourCount * 3;
+        }
+        if (this->width == 0 || this->height == 0) {
+          throw this->corrupt();
+        }
+        this->at = this->first;
+      }
+
+      /**
+       * the number of frames, up to limit; 0 for data that isn't a GIF
+       * or is cut short before the limit
+       */
+      static int countFrames(const char* data, size_t length, int limit) {
+        const uint8_t* p = (const uint8_t*) data;
+        if (length < 13) {
+          return 0;
+        }
+        size_t at = 13 + ((p[10] & 0x80) ? (2 << (p[10] & 7)) * 3 : 0);
+        auto skipBlocks = [&](size_t at) {
+          while (at < length && p[at] != 0) {
+            at += 1 + p[at];
+          }
+          return at + 1;
+        };
+        int frames = 0;
+        while (frames < limit && at < length) {
+          if (p[at] == 0x21) {
+            at = skipBlocks(at + 2);
+          } else if (p[at] == 0x2c && at + 11 <= length) {
+            uint8_t packed = p[at + 9];
+            at = skipBlocks(at + 11 + ((packed & 0x80) ? (2 << (packed & 7)) * 3 : 0));
+            if (at <= length) {
+              frames++;
+            }
+          } else {
+            break;
+          }
+        }
+        return frames;
+      }
+
+      int next(uint32_t* canvas) override {
+        int delay = 100;
+        int transparent = -1;
+        int disposal = Keep;
+        bool restarted = false;
+        while (true) {
+          if (!this->has(this->at, 1) || *this->bytes(this->at) == 0x3b) {
+            if (restarted) {
+              throw this->corrupt();
+            }
+            this->restart(canvas);
+            this->at = this->first;
+            restarted = true;
+            continue;
+          }
+          uint8_t introducer = *this->bytes(this->at);
+          if (introducer == 0x21) {
+            if (!this->has(this->at, 2)) {
+              throw this->corrupt();
+            }
+            uint8_t label = *this->bytes(this->at + 1);
+            if (label == 0xf9 && this->has(this->at, 8)) {
+              uint8_t packed = *this->bytes(this->at + 3);
+              int method = (packed >> 2) & 7;
+              disposal = method == 2 ? Clear : method == 3 ? Restore : Keep;
+              int hundredths = le16(this->bytes(this->at + 4));
+              // like browsers, too short a delay means the default
+              delay = hundredths <= 1 ? 100 : hundredths * 10;
+              transparent = (packed & 1) ? *this->bytes(this->at + 6) : -1;
+            }
+            this->at = this->skipBlocks(this->at + 2);
+          } else if (introducer == 0x2c) {
+            if (!this->has(this->at, 10)) {
+              throw this->corrupt();
+            }
+            const uint8_t* descriptor = this->bytes(this->at);
+            SDL_Rect rect = { le16(descriptor + 1), le16(descriptor + 3), le16(descriptor + 5), le16(descriptor + 7) };
+            uint8_t packed = descriptor[9];
+            this->at += 10;
+            uint32_t localColours[256];
+            const uint32_t* colours = this->globalColours;
+            int colourCount = this->globalColourCount;
+            if (packed & 0x80) {
+              colourCount = 2 << (packed & 7);
+              if (!this->has(this->at, colourCount * 3)) {
+                throw this->corrupt();
+              }
+              readColours(this->bytes(this->at), colourCount, localColours);
+              colours = localColours;
+              this->at += colourCount * 3;
+            }
+            this->dispose(canvas, rect, disposal);
+            this->at = this->decodeImage(this->at, canvas, rect, this->last,
+                colours, colourCount, transparent, (packed & 0x40) != 0);
+            return delay;
+          } else {
+            throw this->corrupt();
+          }
+        }
+      }
+  };
+
+  /**
+   * APNG: the frames are zlib streams in fcTL delimited runs of IDAT or
+   * fdAT chunks, inflated a row at a time. Interlaced ones aren't
+   * animated, only their default image is shown.
+   */
+  class ApngDecoder : public FrameDecoder {
+    private:
+      // where the first fcTL is
+      size_t first = 0;
+      size_t at = 0;
+      int depth = 0;
+      int colourType = 0;
+      int channels = 0;
+      uint32_t palette[256];
+      // the grey or RGB value that is transparent, -1 for none
+      int64_t transparent = -1;
+      z_stream inflater;
+
+      static uint32_t be32(const uint8_t* p) {
+        return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      }
+
+      static uint16_t be16(const uint8_t* p) {
+        return (p[0] << 8) | p[1];
+      }
+
+      /**
+       * the chunk at at: its type, where its data starts and its length;
+       * false past the end
+       */
+      bool chunk(size_t at, uint32_t& type, size_t& start, size_t& length) {
+        if (!this->has(at, 12)) {
+          return false;
+        }
+        length = be32(this->bytes(at));
+        type = be32(this->bytes(at + 4));
+        start = at + 8;
+        if (!this->has(start, length + 4)) {
+          throw this->corrupt();
+        }
+        return true;
+      }
+
+      static constexpr uint32_t tag(const char* name) {
+        return ((uint32_t) (uint8_t) name[0] << 24) | ((uint8_t) name[1] << 16)
+            | ((uint8_t) name[2] << 8) | (uint8_t) name[3];
+      }
+
+      /**
+       * sample i of a row, at the image's bit depth
+       */
+      int sample(const uint8_t* row, size_t i) {
+        switch (this->depth) {
+          case 16:
+            return be16(row + i * 2);
+          case 8:
+            return row[i];
+          default:
+            size_t bit = i * this->depth;
+            return (row[bit / 8] >> (8 - this->depth - bit % 8)) & ((1 << this->depth) - 1);
+        }
+      }
+
+      uint32_t pixel(const uint8_t* row, int x) {
+        int scale = this->depth == 16 ? 8 : 0;
+        auto byte = [&](int value) {
+          // widen low bit depths to 8 bits, narrow 16 bit ones
+          if (this->depth < 8) {
+            return (uint32_t) (value * 255 / ((1 << this->depth) - 1));
+          }
+          return (uint32_t) (value >> scale);
+        };
+        switch (this->colourType) {
+          case 0: {
+            int grey = this->sample(row, x);
+            uint32_t g = byte(grey);
+            return (grey == this->transparent ? 0 : 0xff000000u) | (g << 16) | (g << 8) | g;
+          }
+          case 2: {
+            int r = this->sample(row, x * 3);
+            int g = this->sample(row, x * 3 + 1);
+            int b = this->sample(row, x * 3 + 2);
+            int64_t key = ((int64_t) r << 32) | ((int64_t) g << 16) | b;
+            return (key == this->transparent ? 0 : 0xff000000u) | (byte(r) << 16) | (byte(g) << 8) | byte(b);
+          }
+          case 3:
+            return this->palette[this->sample(row, x) & 0xff];
+          case 4: {
+            uint32_t g = byte(this->sample(row, x * 2));
+            return (byte(this->sample(row, x * 2 + 1)) << 24) | (g << 16) | (g << 8) | g;
+          }
+          default:
+            return (byte(this->sample(row, x * 4 + 3)) << 24) | (byte(this->sample(row, x * 4)) << 16)
+                | (byte(this->sample(row, x * 4 + 1)) << 8) | byte(this->sample(row, x * 4 + 2));
+        }
+      }
+
+      static uint8_t paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a);
+        int pb = std::abs(p - b);
+        int pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+      }
+
+      /**
+       * Undo the row's filter in place, against the row above
+       */
+      void unfilter(uint8_t filter, uint8_t* row, const uint8_t* above, size_t stride) {
+        size_t step = std::max(1, this->channels * this->depth / 8);
+        for (size_t i = 0; i < stride; i++) {
+          int left = i >= step ? row[i - step] : 0;
+          int up = above[i];
+          int corner = i >= step ? above[i - step] : 0;
+          switch (filter) {
+            case 1:
+              row[i] += left;
+              break;
+            case 2:
+              row[i] += up;
+              break;
+            case 3:
+              row[i] += (left + up) / 2;
+              break;
+            case 4:
+              row[i] += paeth(left, up, corner);
+              break;
+          }
+        }
+      }
+
+      static uint32_t over(uint32_t source, uint32_t target) {
+        uint32_t alpha = source >> 24;
+        if (alpha == 255 || (target >> 24) == 0) {
+          return source;
+        }
+        if (alpha == 0) {
+          return target;
+        }
+        // straight alpha over straight alpha
+        uint32_t targetAlpha = (target >> 24) * (255 - alpha) / 255;
+        uint32_t outAlpha = alpha + targetAlpha;
+        uint32_t result = outAlpha << 24;
+        for (int shift = 0; shift < 24; shift += 8) {
+          uint32_t s = (source >> shift) & 0xff;
+          uint32_t t = (target >> shift) & 0xff;
+          result |= ((s * alpha + t * targetAlpha) / outAlpha) << shift;
+        }
+        return result;
+      }
+
+    public:
+      ApngDecoder(std::vector<char> data) :
+          FrameDecoder(std::move(data)) {
+        for (int i = 0; i < 256; i++) {
+          this->palette[i] = 0xff000000u;
+        }
+        size_t at = 8;
+        uint32_t type;
+        size_t start;
+        size_t length;
+        while (this->chunk(at, type, start, length) && type != tag("IEND")) {
+          const uint8_t* p = this->bytes(start);
+          if (type == tag("IHDR") && length >= 13) {
+            this->width = be32(p);
+            this->height = be32(p + 4);
+            this->depth = p[8];
+            this->colourType = p[9];
+            if (p[12] != 0) {
+              throw ImageOpenException("interlaced animated png");
+            }
+          } else if (type == tag("PLTE")) {
+            for (size_t i = 0; i < std::min(length / 3, (size_t) 256); i++) {
+              this->palette[i] = 0xff000000u | (p[i * 3] << 16) | (p[i * 3 + 1] << 8) | p[i * 3 + 2];
+            }
+          } else if (type == tag("tRNS")) {
+            if (this->colourType == 3) {
+              for (size_t i = 0; i < std::min(length, (size_t) 256); i++) {
+                this->palette[i] = (this->palette[i] & 0xffffff) | ((uint32_t) p[i] << 24);
+              }
+            } else if (this->colourType == 0 && length >= 2) {
+              this->transparent = be16(p);
+            } else if (this->colourType == 2 && length >= 6) {
+              this->transparent = ((int64_t) be16(p) << 32) | ((int64_t) be16(p + 2) << 16) | be16(p + 4);
+            }
+          } else if (type == tag("fcTL") && this->first == 0) {
+            this->first = at;
+          }
+          at = start + length + 4;
+        }
+        static const int channelsOf[7] = { 1, 0, 3, 1, 2, 0, 4 };
+        this->channels = this->colourType <= 6 ? channelsOf[this->colourType] : 0;
+        if (this->width <= 0 || this->height <= 0 || this->first == 0 || this->channels == 0
+            || (this->depth != 1 && this->depth != 2 && this->depth != 4 && this->depth != 8 && this->depth != 16)) {
+          throw this->corrupt();
+        }
+        std::memset(&this->inflater, 0, sizeof(this->inflater));
+        if (inflateInit(&this->inflater) != Z_OK) {
+          throw ImageOpenException("can't set up inflate");
+        }
+        this->at = this->first;
+      }
+
+      ~ApngDecoder() {
+        inflateEnd(&this->inflater);
+      }
+
+      /**
+       * whether the chunks before the image data include an acTL asking for
+       * more than one frame
+       */
+      static bool hasAnimation(const char* data, size_t length) {
+        const uint8_t* p = (const uint8_t*) data;
+        size_t at = 8;
+        while (at + 12 <= length) {
+          uint32_t size = be32(p + at);
+          uint32_t type = be32(p + at + 4);
+          if (type == tag("IDAT")) {
+            return false;
+          }
+          if (type == tag("acTL") && size >= 8 && at + 16 <= length) {
+            return be32(p + at + 8) > 1;
+          }
+          if (size > length - at - 12) {
+            return false;
+          }
+          at += 12 + size;
+        }
+        return false;
+      }
+
+      int next(uint32_t* canvas) override {
+        uint32_t type;
+        size_t start;
+        size_t length;
+        // find the next frame control, starting over after the last
+        while (!this->chunk(this->at, type, start, length) || type != tag("fcTL")) {
+          if (!this->chunk(this->at, type, start, length) || type == tag("IEND")) {
+            if (this->at == this->first) {
+              throw this->corrupt();
+            }
+            this->restart(canvas);
+            this->at = this->first;
+            continue;
+          }
+          this->at = start + length + 4;
+        }
+        if (length < 26) {
+          throw this->corrupt();
+        }
+        const uint8_t* control = this->bytes(start);
+        SDL_Rect rect = { (int) be32(control + 12), (int) be32(control + 16),
+            (int) be32(control + 4), (int) be32(control + 8) };
+        int numerator = be16(control + 20);
+        int denominator = be16(control + 22);
+        int delay = std::max(10, numerator * 1000 / (denominator == 0 ? 100 : denominator));
+        if (rect.w <= 0 || rect.h <= 0 || rect.x < 0 || rect.y < 0
+            || rect.x + (int64_t) rect.w > this->width || rect.y + (int64_t) rect.h > this->height) {
+          throw this->corrupt();
+        }
+        int disposal = control[24] == 1 ? Clear : control[24] == 2 ? Restore : Keep;
+        bool blend = control[25] == 1;
+        if (this->at == this->first && disposal == Restore) {
+          disposal = Clear;
+        }
+        this->dispose(canvas, rect, disposal);
+        SDL_Rect clip = this->last;
+        this->at = start + length + 4;
+
+        size_t stride = ((size_t) rect.w * this->channels * this->depth + 7) / 8;
+        std::vector<uint8_t> rows(2 * (stride + 1), 0);
+        uint8_t* row = rows.data();
+        uint8_t* above = rows.data() + stride + 1;
+        int y = 0;
+        inflateReset(&this->inflater);
+        this->inflater.next_out = row;
+        this->inflater.avail_out = stride + 1;
+        bool ended = false;
+        while (this->chunk(this->at, type, start, length)
+            && (type == tag("IDAT") || type == tag("fdAT"))) {
+          this->at = start + length + 4;
+          size_t skip = type == tag("fdAT") ? 4 : 0;
+          if (length < skip || ended) {
+            continue;
+          }
+          this->inflater.next_in = (Bytef*) this->bytes(start + skip);
+          this->inflater.avail_in = length - skip;
+          while (this->inflater.avail_in > 0 && !ended) {
+            int result = inflate(&this->inflater, Z_NO_FLUSH);
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+              throw this->corrupt();
+            }
+            if (this->inflater.avail_out == 0) {
+              if (row[0] > 4) {
+                throw this->corrupt();
+              }
+              this->unfilter(row[0], row + 1, above + 1, stride);
+              int canvasY = rect.y + y;
+              for (int x = 0; x < rect.w && canvasY >= clip.y && canvasY < clip.y + clip.h; x++) {
+                int canvasX = rect.x + x;
+                if (canvasX < clip.x || canvasX >= clip.x + clip.w) {
+                  continue;
+                }
+                uint32_t& target = canvas[(size_t) canvasY * this->width + canvasX];
+                uint32_t source = this->pixel(row + 1, x);
+                target = blend ? over(source, target) : source;
+              }
+              std::swap(row, above);
+              this->inflater.next_out = row;
+              this->inflater.avail_out = stride + 1;
+              ended = ++y == rect.h;
+            }
+            if (result == Z_STREAM_END || (result == Z_BUF_ERROR && this->inflater.avail_in > 0)) {
+              ended = ended || result == Z_STREAM_END;
+              break;
+            }
+          }
+        }
+        return delay;
+      }
+  };
+
+  bool FrameDecoder::isAnimated(const char* data, size_t length) {
+    const char* format = PageTable::imageFormat(data, length);
+    if (format == NULL) {
+      return false;
+    }
+    if (std::strcmp(format, "gif") == 0) {
+      return GifDecoder::countFrames(data, length, 2) > 1;
+    }
+    return std::strcmp(format, "png") == 0 && ApngDecoder::hasAnimation(data, length);
+  }
+
+  FrameDecoder* FrameDecoder::open(std::vector<char> data) {
+    if (!isAnimated(data.data(), data.size())) {
+      return NULL;
+    }
+    FrameDecoder* decoder = NULL;
+    try {
+      if (PageTable::imageFormat(data.data(), data.size())[0] == 'g') {
+        decoder = new GifDecoder(std::move(data));
+      } else {
+        decoder = new ApngDecoder(std::move(data));
+      }
+    } catch (ImageOpenException& e) {
+      return NULL;
+    }
+    // playback keeps a few canvases; past this only the first frame shows
+    if ((int64_t) decoder->getWidth() * decoder->getHeight() > MAX_PIXELS) {
+      delete decoder;
+      return NULL;
+    }
+    return decoder;
+  }
+
+}
@@ -0,0 +1,391 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <tinyformat.h>
+#include "Archive.h"
+#include "Exception.h"
+#include "Zip.h"
+
+namespace app {
+
+  /**
+   * A local archive that is still being written, say by a sync tool
+   * copying it, read before its central directory exists.
+   *
+   * Entries are found by walking the local file headers from the start of
+   * the file, and each one can be read as soon as all of its bytes have
+   * landed. Deflated entries whose sizes are left to a data descriptor are
+   * inflated to the end of their stream to find where they stop, keeping
+   * the inflate state between refreshes so a large entry isn't inflated
+   * again every time it grows. Stored ones with a descriptor can't be
+   * found that way and stop the walk until the central directory turns
+   * up. Once it does, the archive switches to it and stops growing.
+   *
+   * A file that goes SETTLE_MS without a write is taken to be as complete
+   * as it will get, say a truncated download, and stops growing with the
+   * entries found so far. One that had already settled when opened isn't
+   * treated as growing at all.
+   *
+   * waitForChange learns about writes from inotify, or polls the size
+   * where inotify isn't available.
+   */
+  class GrowingArchive: public Archive {
+    private:
+      static constexpr uint32_t DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+      static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+      // long enough for a sync tool to stall between files
+      static constexpr int SETTLE_MS = 30000;
+
+      std::string path;
+      int fd = -1;
+      int notify = -1;
+      std::vector<zip::Entry> entries;
+      std::unordered_map<std::string, size_t> byName;
+      // where the next local header is
+      uint64_t scanned = 0;
+      // the walk reached the central directory, or something it can't get past
+      bool stuck = false;
+      std::atomic<bool> growing { true };
+      // the size waitForChange saw last, when polling
+      std::atomic<uint64_t> watched { 0 };
+      // inflating an entry with a data descriptor to find its end
+      z_stream inflater;
+      bool inflating = false;
+      // the next compressed byte to feed it
+      uint64_t inflatedTo = 0;
+
+      uint64_t size() {
+        struct stat info;
+        if (fstat(this->fd, &info) != 0) {
+          throw IOException(tfm::format("failed to stat %s", this->path));
+        }
+        return info.st_size;
+      }
+
+      /**
+       * whether the file has gone SETTLE_MS without a write
+       */
+      bool settled() {
+        struct stat info;
+        if (fstat(this->fd, &info) != 0) {
+          return false;
+        }
+        auto modified = std::chrono::system_clock::from_time_t(info.st_mtim.tv_sec)
+            + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(info.st_mtim.tv_nsec));
+        return std::chrono::system_clock::now() - modified >= std::chrono::milliseconds(SETTLE_MS);
+      }
+
+      /**
+       * length bytes from offset, fewer if the file ends before
+       */
+      std::vector<char> readAt(uint64_t offset, size_t length) {
+        std::vector<char> data(length);
+        size_t done = 0;
+        while (done < length) {
+          ssize_t result = pread(this->fd, data.data() + done, length - done, offset + done);
+          if (result < 0 && errno == EINTR) {
+            continue;
+          }
+          if (result < 0) {
+            throw IOException(tfm::format("failed to read %s", this->path));
+          }
+          if (result == 0) {
+            break;
+          }
+          done += result;
+        }
+        data.resize(done);
+        return data;
+      }
+
+      /**
+       * Feed the inflater the entry's data from dataAt up to size. True
+       * once its stream ended, with its compressed and uncompressed sizes.
+       */
+      bool inflateToEnd(uint64_t dataAt, uint64_t size, uint64_t& compressed, uint64_t& uncompressed) {
+        if (!this->inflating) {
+          std::memset(&this->inflater, 0, sizeof(this->inflater));
+          // raw deflate, like everything in a zip
+          if (inflateInit2(&this->inflater, -MAX_WBITS) != Z_OK) {
+            throw IOException("failed to initialize inflate");
+          }
+          this->inflating = true;
+          this->inflatedTo = dataAt;
+        }
+        std::vector<char> discard(CHUNK_SIZE);
+        while (this->inflatedTo < size) {
+          std::vector<char> in = this->readAt(this->inflatedTo, std::min((uint64_t) CHUNK_SIZE, size - this->inflatedTo));
+          this->inflater.next_in = reinterpret_cast<Bytef*>(in.data());
+          this->inflater.avail_in = in.size();
+          int result = Z_OK;
+          while (result == Z_OK && (this->inflater.avail_in > 0 || this->inflater.avail_out == 0)) {
+            this->inflater.next_out = reinterpret_cast<Bytef*>(discard.data());
+            this->inflater.avail_out = discard.size();
+            result = inflate(&this->inflater, Z_NO_FLUSH);
+          }
+          this->inflatedTo += in.size() - this->inflater.avail_in;
+          if (result == Z_STREAM_END) {
+            compressed = this->inflatedTo - dataAt;
+            uncompressed = this->inflater.total_out;
+            inflateEnd(&this->inflater);
+            this->inflating = false;
+            return true;
+          }
+          if (result != Z_OK && result != Z_BUF_ERROR) {
+            inflateEnd(&this->inflater);
+            this->inflating = false;
+            this->stuck = true;
+            return false;
+          }
+        }
+        return false;
+      }
+
+      /**
+       * Add the entry whose local header is at scanned if all of it has
+       * landed. False if it hasn't yet, or if the walk can't go on.
+       */
+      bool scanOne(uint64_t size) {
+        if (this->scanned + zip::LOCAL_HEADER_SIZE > size) {
+          return false;
+        }
+        std::vector<char> header = this->readAt(this->scanned, zip::LOCAL_HEADER_SIZE);
+        if (zip::readU32(header, 0) != zip::LOCAL_HEADER_SIGNATURE) {
+          // the central directory, or something we can't make sense of
+          this->stuck = true;
+          return false;
+        }
+        uint16_t flags = zip::readU16(header, 6);
+        zip::Entry entry;
+        entry.method = zip::readU16(header, 8);
+        entry.crc = zip::readU32(header, 14);
+        entry.compressedSize = zip::readU32(header, 18);
+        entry.size = zip::readU32(header, 22);
+        entry.localHeaderOffset = this->scanned;
+        uint16_t nameLength = zip::readU16(header, 26);
+        uint16_t extraLength = zip::readU16(header, 28);
+        uint64_t dataAt = this->scanned + zip::LOCAL_HEADER_SIZE + nameLength + extraLength;
+        if (dataAt > size) {
+          return false;
+        }
+        std::vector<char> variable = this->readAt(this->scanned + zip::LOCAL_HEADER_SIZE, nameLength + extraLength);
+        entry.name = std::string(variable.begin(), variable.begin() + nameLength);
+
+        bool zip64 = false;
+        for (size_t at = nameLength; at + 4 <= variable.size();) {
+          uint16_t id = zip::readU16(variable, at);
+          uint16_t length = zip::readU16(variable, at + 2);
+          if (id == 0x0001 && length >= 16) {
+            zip64 = true;
+            entry.size = zip::readU64(variable, at + 4);
+            entry.compressedSize = zip::readU64(variable, at + 12);
+          }
+          at += 4 + length;
+        }
+
+        uint64_t end = dataAt + entry.compressedSize;
+        if (flags & 0x08) {
+          if (entry.method != zip::METHOD_DEFLATE) {
+            this->stuck = true;
+            return false;
+          }
+          if (!this->inflateToEnd(dataAt, size, entry.compressedSize, entry.size)) {
+            return false;
+          }
+          // crc and both sizes, after a signature most writers add
+          end = dataAt + entry.compressedSize;
+          size_t descriptorSize = zip64 ? 20 : 12;
+          std::vector<char> descriptor = this->readAt(end, 4 + descriptorSize);
+          size_t at = descriptor.size() >= 4 && zip::readU32(descriptor, 0) == DATA_DESCRIPTOR_SIGNATURE ? 4 : 0;
+          if (descriptor.size() < at + descriptorSize) {
+            // the descriptor hasn't landed yet, the entry is inflated
+            // again next time
+            return false;
+          }
+          entry.crc = zip::readU32(descriptor, at);
+          end += at + descriptorSize;
+        } else if (end > size) {
+          return false;
+        }
+        this->byName[entry.name] = this->entries.size();
+        this->entries.push_back(entry);
+        this->scanned = end;
+        return true;
+      }
+
+      /**
+       * Switch to the central directory if the archive has one now.
+       */
+      bool readDirectory(uint64_t size) {
+        try {
+          uint64_t tailOffset = size - std::min((uint64_t) zip::MAX_END_OF_CENTRAL_DIRECTORY_SIZE, size);
+          std::vector<char> tail = this->readAt(tailOffset, size - tailOffset);
+          uint64_t zip64Offset;
+          zip::CentralDirectory directory = zip::readEndOfCentralDirectory(tail, tailOffset, &zip64Offset);
+          if (zip64Offset != 0) {
+            directory = zip::readZip64EndOfCentralDirectory(this->readAt(
+                zip64Offset, zip::ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE));
+          }
+          if (directory.offset + directory.size > size) {
+            return false;
+          }
+          std::vector<zip::Entry> entries = zip::readCentralDirectory(
+              this->readAt(directory.offset, directory.size));
+          if (entries.size() != directory.entries) {
+            return false;
+          }
+          this->entries = entries;
+        } catch (IOException& e) {
+          return false;
+        }
+        this->byName.clear();
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          this->byName[this->entries[i].name] = i;
+        }
+        return true;
+      }
+
+      size_t indexOf(const std::string& name) {
+        auto it = this->byName.find(name);
+        if (it == this->byName.end()) {
+          throw IOException(tfm::format("no entry named %s", name));
+        }
+        return it->second;
+      }
+
+    public:
+      /**
+       * Throws IOException if the file can't be opened or doesn't start
+       * like a zip file. An empty file is fine: its writer has only just
+       * started.
+       */
+      GrowingArchive(std::string path) {
+        this->path = path;
+        this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (this->fd < 0) {
+          throw IOException(tfm::format("failed to open %s", path));
+        }
+        std::vector<char> start = this->readAt(0, 4);
+        if (start.size() == 4 && zip::readU32(start, 0) != zip::LOCAL_HEADER_SIGNATURE) {
+          close(this->fd);
+          throw IOException(tfm::format("%s is not a zip file", path));
+        }
+        this->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (this->notify >= 0 && inotify_add_watch(this->notify, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+          close(this->notify);
+          this->notify = -1;
+        }
+        this->refresh();
+        if (this->growing && this->settled()) {
+          this->growing = false;
+        }
+      }
+
+      ~GrowingArchive() {
+        if (this->inflating) {
+          inflateEnd(&this->inflater);
+        }
+        if (this->notify >= 0) {
+          close(this->notify);
+        }
+        close(this->fd);
+      }
+
+      bool isGrowing() {
+        return this->growing;
+      }
+
+      /**
+       * Also true when the file just settled and stopped growing, so the
+       * caller looks again
+       */
+      bool waitForChange(int timeoutMs) {
+        if (!this->growing) {
+          return false;
+        }
+        if (this->notify >= 0) {
+          pollfd ready = { this->notify, POLLIN, 0 };
+          if (poll(&ready, 1, timeoutMs) > 0) {
+            char events[4096];
+            while (::read(this->notify, events, sizeof(events)) > 0) {
+            }
+            return true;
+          }
+        } else {
+          std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+          uint64_t size = this->size();
+          if (this->watched.exchange(size) != size) {
+            return true;
+          }
+        }
+        if (this->settled()) {
+          this->growing = false;
+          return true;
+        }
+        return false;
+      }
+
+      bool refresh() {
+        if (!this->growing) {
+          return false;
+        }
+        uint64_t size = this->size();
+        size_t before = this->entries.size();
+        while (!this->stuck && this->scanOne(size)) {
+        }
+        if (this->stuck && this->readDirectory(size)) {
+          this->growing = false;
+          return true;
+        }
+        return this->entries.size() > before;
+      }
+
+      std::vector<std::string> getNames() {
+        std::vector<std::string> names;
+        for (auto entry : this->entries) {
+          names.push_back(entry.name);
+        }
+        return names;
+      }
+
+      std::vector<ArchiveEntry> getEntries() {
+        std::vector<ArchiveEntry> entries;
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          const zip::Entry& entry = this->entries[i];
+          entries.push_back(ArchiveEntry {
+              entry.name, i, entry.localHeaderOffset, entry.compressedSize, entry.size });
+        }
+        return entries;
+      }
+
+      uint32_t getCrc(const std::string& name) {
+        return this->entries[this->indexOf(name)].crc;
+      }
+
+      std::vector<char> read(const std::string& name) {
+        const zip::Entry& entry = this->entries[this->indexOf(name)];
+        std::vector<char> header = this->readAt(entry.localHeaderOffset, zip::LOCAL_HEADER_SIZE);
+        uint64_t dataAt = entry.localHeaderOffset + zip::localDataOffset(header);
+        std::vector<char> data = this->readAt(dataAt, entry.compressedSize);
+        if (data.size() != entry.compressedSize) {
+          throw IOException(tfm::format("entry %s runs past the end of %s", name, this->path));
+        }
+        return zip::extract(entry, data.data(), data.size());
+      }
+  };
+
+}
@@ -0,0 +1,304 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <tinyformat.h>
+#include "Exception.h"
+#include "RangeSource.h"
+
+namespace app {
+
+  /**
+   * Reads byte ranges of a file from a plain http:// server with HTTP/1.1
+   * range requests over one kept-alive connection.
+   * Not thread safe; use one source per thread.
+   */
+  class HttpRangeSource: public RangeSource {
+    private:
+      // a server that stops answering fails the read rather than hanging it
+      static const int RECEIVE_TIMEOUT_SECONDS = 30;
+
+      std::string url;
+      std::string host;
+      std::string port;
+      std::string target;
+      int socket = -1;
+      // bytes received past the end of the last response
+      std::string pending;
+      uint64_t total = 0;
+      bool totalKnown = false;
+      size_t requestCount = 0;
+
+      void parseUrl() {
+        const std::string scheme = "http://";
+        if (this->url.rfind(scheme, 0) != 0) {
+          throw IOException(tfm::format("only http:// urls are supported: %s", this->url));
+        }
+        std::string rest = this->url.substr(scheme.size());
+        size_t slash = rest.find('/');
+        std::string authority = rest.substr(0, slash);
+        this->target = slash == std::string::npos ? "/" : rest.substr(slash);
+        size_t colon = authority.rfind(':');
+        if (colon == std::string::npos) {
+          this->host = authority;
+          this->port = "80";
+        } else {
+          this->host = authority.substr(0, colon);
+          this->port = authority.substr(colon + 1);
+        }
+      }
+
+      void connect() {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = NULL;
+        int result = getaddrinfo(this->host.c_str(), this->port.c_str(), &hints, &addresses);
+        if (result != 0) {
+          throw IOException(tfm::format(
+              "failed to resolve %s, reason: %s",
+              this->host, gai_strerror(result)));
+        }
+
+        for (addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+          int fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+          if (fd < 0) {
+            continue;
+          }
+          if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            // requests are small and latency bound
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            timeval timeout = { RECEIVE_TIMEOUT_SECONDS, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            this->socket = fd;
+            break;
+          }
+          ::close(fd);
+        }
+        freeaddrinfo(addresses);
+
+        if (this->socket < 0) {
+          throw IOException(tfm::format(
+              "failed to connect to %s:%s, reason: %s",
+              this->host, this->port, strerror(errno)));
+        }
+      }
+
+      void disconnect() {
+        if (this->socket >= 0) {
+          ::close(this->socket);
+          this->socket = -1;
+        }
+        this->pending.clear();
+      }
+
+      void sendAll(const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+          ssize_t result = ::send(this->socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+          if (result <= 0) {
+            throw IOException(tfm::format("failed to send request, reason: %s", strerror(errno)));
+          }
+          sent += result;
+        }
+      }
+
+      /**
+       * append at least one more chunk to pending
+       */
+      void receive() {
+        char buffer[64 * 1024];
+        ssize_t result = ::recv(this->socket, buffer, sizeof(buffer), 0);
+        if (result < 0) {
+          throw IOException(tfm::format("failed to receive from %s, reason: %s", this->host, strerror(errno)));
+        }
+        if (result == 0) {
+          throw IOException("connection closed by server");
+        }
+        this->pending.append(buffer, result);
+      }
+
+      /**
+       * A header value that must be a whole number
+       */
+      uint64_t parseNumber(const std::string& name, const std::string& value) {
+        char* end = NULL;
+        errno = 0;
+        unsigned long long number = std::strtoull(value.c_str(), &end, 10);
+        while (*end == ' ' || *end == '\t') {
+          end++;
+        }
+        if (value.empty() || !std::isdigit((unsigned char) value[0]) || *end != '\0' || errno != 0) {
+          throw IOException(tfm::format("bad %s from %s: %s", name, this->url, value));
+        }
+        return number;
+      }
+
+      /**
+       * Send one range request and return the body.
+       * range is the part after "bytes=".
+       */
+      std::vector<char> request(std::string range) {
+        if (this->socket < 0) {
+          this->connect();
+        }
+        this->requestCount++;
+        this->sendAll(tfm::format(
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s\r\n"
+            "Range: bytes=%s\r\n"
+            "Accept-Encoding: identity\r\n"
+            "\r\n",
+            this->target, this->host, range));
+
+        size_t headerEnd;
+        while ((headerEnd = this->pending.find("\r\n\r\n")) == std::string::npos) {
+          this->receive();
+        }
+        std::string head = this->pending.substr(0, headerEnd);
+        this->pending.erase(0, headerEnd + 4);
+
+        size_t lineEnd = head.find("\r\n");
+        std::string statusLine = head.substr(0, lineEnd);
+        int status = 0;
+        size_t space = statusLine.find(' ');
+        if (space != std::string::npos) {
+          status = std::atoi(statusLine.c_str() + space + 1);
+        }
+
+        std::map<std::string, std::string> headers;
+        size_t at = lineEnd == std::string::npos ? head.size() : lineEnd + 2;
+        while (at < head.size()) {
+          size_t end = head.find("\r\n", at);
+          if (end == std::string::npos) {
+            end = head.size();
+          }
+          std::string line = head.substr(at, end - at);
+          size_t colon = line.find(':');
+          if (colon != std::string::npos) {
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            size_t valueStart = line.find_first_not_of(' ', colon + 1);
+            headers[name] = valueStart == std::string::npos ? "" : line.substr(valueStart);
+          }
+          at = end + 2;
+        }
+
+        if (headers.count("transfer-encoding") > 0) {
+          this->disconnect();
+          throw IOException("chunked responses are not supported");
+        }
+        uint64_t length = headers.count("content-length") > 0
+            ? this->parseNumber("Content-Length", headers["content-length"])
+            : 0;
+        while (this->pending.size() < length) {
+          this->receive();
+        }
+        std::vector<char> body(this->pending.begin(), this->pending.begin() + length);
+        this->pending.erase(0, length);
+
+        std::string connection = headers["connection"];
+        std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+        if (connection == "close") {
+          this->disconnect();
+        }
+
+        if (status != 206) {
+          throw IOException(tfm::format(
+              "range request for %s failed with status %d",
+              this->url, status));
+        }
+
+        // Content-Range: bytes first-last/total
+        std::string contentRange = headers["content-range"];
+        size_t slash = contentRange.find('/');
+        if (slash != std::string::npos && contentRange[slash + 1] != '*') {
+          this->total = this->parseNumber("Content-Range", contentRange.substr(slash + 1));
+          this->totalKnown = true;
+        }
+        return body;
+      }
+
+      /**
+       * Retry once on a fresh connection, the server may have dropped an idle
+       * kept-alive one.
+       */
+      std::vector<char> requestWithRetry(std::string range) {
+        bool reused = this->socket >= 0;
+        try {
+          return this->request(range);
+        } catch (IOException& e) {
+          // whatever is left on the connection can't be trusted
+          this->disconnect();
+          if (!reused) {
+            throw;
+          }
+        }
+        return this->request(range);
+      }
+
+    public:
+      HttpRangeSource(std::string url) {
+        this->url = url;
+        this->parseUrl();
+      }
+
+      ~HttpRangeSource() {
+        this->disconnect();
+      }
+
+      uint64_t size() {
+        if (!this->totalKnown) {
+          uint64_t offset;
+          this->readTail(1, &offset);
+        }
+        return this->total;
+      }
+
+      std::vector<char> read(uint64_t offset, uint64_t length) {
+        if (length == 0) {
+          return {};
+        }
+        std::vector<char> body = this->requestWithRetry(tfm::format(
+            "%d-%d", offset, offset + length - 1));
+        if (body.size() != length) {
+          throw IOException(tfm::format(
+              "short read from %s: asked for %d bytes at %d, got %d",
+              this->url, length, offset, body.size()));
+        }
+        return body;
+      }
+
+      /**
+       * A suffix range returns the tail and, through Content-Range, the total
+       * size in a single round trip.
+       */
+      std::vector<char> readTail(uint64_t length, uint64_t* offset) {
+        std::vector<char> body = this->requestWithRetry(tfm::format("-%d", length));
+        if (!this->totalKnown) {
+          throw IOException(tfm::format("server did not report the size of %s", this->url));
+        }
+        *offset = this->total - body.size();
+        return body;
+      }
+
+      size_t requests() {
+        return this->requestCount;
+      }
+  };
+
+}
@@ -0,0 +1,358 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "SdlEngine.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace app {
+
+  /**
+   * A decoded page: an SDL surface; 4:2:0 planes laid out like an IYUV
+   * texture, full size Y, then U and V at half the width and height, for
+   * JPEGs decoded straight from their YCbCr; or, for pages that are
+   * black and white, only the Y plane.
+   *
+   * Planar pages take 1.5 bytes a pixel and grey ones 1, against 3 or 4
+   * for a surface, and the renderer does the colour conversion when it
+   * draws them.
+   *
+   * The pixels may also be borrowed from a SharedPageCache, and are
+   * handed back when the image is freed.
+   */
+  class Image {
+    public:
+      enum class Kind { Surface, Planar, Grey };
+
+      // how far apart a pixel's channels, or its chroma from neutral, may
+      // be for it to count as grey: JPEG noise on a black and white scan
+      static constexpr int GREY_TOLERANCE = 6;
+
+    private:
+      Kind kind;
+      SDL_Surface* surface = NULL;
+      std::vector<uint8_t> planes;
+      // planes that live elsewhere, like shared memory, instead of planes
+      uint8_t* external = NULL;
+      // called once pixels that live elsewhere are no longer used
+      std::function<void()> unshare;
+      int width;
+      int height;
+
+      int chromaWidth() const {
+        return (this->width + 1) / 2;
+      }
+
+      int chromaHeight() const {
+        return (this->height + 1) / 2;
+      }
+
+      size_t planeBytes() const {
+        size_t luma = (size_t) this->width * this->height;
+        return this->kind == Kind::Grey
+            ? luma
+            : luma + (size_t) 2 * this->chromaWidth() * this->chromaHeight();
+      }
+
+      /**
+       * where the byte of a channel mask sits in a pixel, -1 if the channel
+       * isn't one whole byte
+       */
+      static int byteOf(Uint32 mask, int bytesPerPixel) {
+        for (int shift = 0; shift < bytesPerPixel * 8; shift += 8) {
+          if (mask == (Uint32) 0xff << shift) {
+            return SDL_BYTEORDER == SDL_LIL_ENDIAN ? shift / 8 : bytesPerPixel - 1 - shift / 8;
+          }
+        }
+        return -1;
+      }
+
+      /**
+       * Whether every pixel's red, green and blue are within the tolerance
+       * of each other. The channels must be adjacent bytes starting at
+       * first; SSE2 compares each byte with its neighbour, 16 at a time.
+       */
+      static bool channelsEqual(SDL_Surface* surface, int first) {
+        int stride = surface->format->BytesPerPixel;
+        size_t bytes = (size_t) surface->w * stride;
+#if defined(__SSE2__)
+        // whole pixels per load, and the lanes comparing r-g and g-b
+        size_t step = stride == 4 ? 16 : 15;
+        uint8_t lanes[16] = { 0 };
+        for (size_t p = 0; p < step; p++) {
+          int channel = p % stride - first;
+          lanes[p] = channel == 0 || channel == 1 ? 0xff : 0;
+        }
+        const __m128i mask = _mm_loadu_si128((const __m128i*) lanes);
+        const __m128i limit = _mm_set1_epi8(GREY_TOLERANCE);
+        const __m128i zero = _mm_setzero_si128();
+#endif
+        for (int y = 0; y < surface->h; y++) {
+          const uint8_t* row = (const uint8_t*) surface->pixels + (size_t) y * surface->pitch;
+          size_t x = 0;
+#if defined(__SSE2__)
+          for (; x + 17 <= bytes; x += step) {
+            __m128i a = _mm_loadu_si128((const __m128i*) (row + x));
+            __m128i b = _mm_loadu_si128((const __m128i*) (row + x + 1));
+            __m128i difference = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            __m128i over = _mm_and_si128(_mm_subs_epu8(difference, limit), mask);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xffff) {
+              return false;
+            }
+          }
+#endif
+          for (; x < bytes; x += stride) {
+            const uint8_t* pixel = row + x + first;
+            if (std::abs(pixel[0] - pixel[1]) > GREY_TOLERANCE
+                || std::abs(pixel[1] - pixel[2]) > GREY_TOLERANCE) {
+              return false;
+            }
+          }
+        }
+        return true;
+      }
+
+      /**
+       * whether every byte is within the tolerance of 128
+       */
+      static bool neutral(const uint8_t* bytes, size_t length) {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i low = _mm_set1_epi8((char) (128 - GREY_TOLERANCE));
+        const __m128i high = _mm_set1_epi8((char) (128 + GREY_TOLERANCE));
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= length; i += 16) {
+          __m128i v = _mm_loadu_si128((const __m128i*) (bytes + i));
+          __m128i out = _mm_or_si128(_mm_subs_epu8(v, high), _mm_subs_epu8(low, v));
+          if (_mm_movemask_epi8(_mm_cmpeq_epi8(out, zero)) != 0xffff) {
+            return false;
+          }
+        }
+#endif
+        for (; i < length; i++) {
+          if (std::abs(bytes[i] - 128) > GREY_TOLERANCE) {
+            return false;
+          }
+        }
+        return true;
+      }
+
+    public:
+      /**
+       * Takes ownership of the surface
+       */
+      Image(SDL_Surface* surface) {
+        this->kind = Kind::Surface;
+        this->surface = surface;
+        this->width = surface->w;
+        this->height = surface->h;
+      }
+
+      /**
+       * Planar or grey, uninitialised
+       */
+      Image(int width, int height, Kind kind) {
+        this->kind = kind;
+        this->width = width;
+        this->height = height;
+        this->planes.resize(this->planeBytes());
+      }
+
+      /**
+       * A surface whose pixels, or planar or grey planes, live elsewhere;
+       * unshare is called when the image is done with them. The surface,
+       * if any, is owned by the image but not its pixels.
+       */
+      Image(SDL_Surface* surface, std::function<void()> unshare) :
+          Image(surface) {
+        this->unshare = unshare;
+      }
+
+      Image(int width, int height, Kind kind, uint8_t* planes, std::function<void()> unshare) {
+        this->kind = kind;
+        this->width = width;
+        this->height = height;
+        this->external = planes;
+        this->unshare = unshare;
+      }
+
+      Image(const Image&) = delete;
+      Image& operator=(const Image&) = delete;
+
+      ~Image() {
+        if (this->surface != NULL) {
+          SDL_FreeSurface(this->surface);
+        }
+        if (this->unshare) {
+          this->unshare();
+        }
+      }
+
+      /**
+       * A decoded surface, kept as only its luminance if it is black and
+       * white. Takes ownership of the surface, and frees it if it isn't
+       * kept.
+       */
+      static Image* fromSurface(SDL_Surface* surface) {
+        SDL_PixelFormat* format = surface->format;
+        int stride = format->BytesPerPixel;
+        if (format->palette != NULL || (stride != 3 && stride != 4)) {
+          return new Image(surface);
+        }
+        int r = byteOf(format->Rmask, stride);
+        int g = byteOf(format->Gmask, stride);
+        int b = byteOf(format->Bmask, stride);
+        int first = std::min(r, std::min(g, b));
+        if (r < 0 || g < 0 || b < 0 || std::max(r, std::max(g, b)) - first != 2
+            || SDL_MUSTLOCK(surface) || !channelsEqual(surface, first)) {
+          return new Image(surface);
+        }
+
+        Image* grey = new Image(surface->w, surface->h, Kind::Grey);
+        for (int y = 0; y < surface->h; y++) {
+          const uint8_t* row = (const uint8_t*) surface->pixels + (size_t) y * surface->pitch + g;
+          uint8_t* out = grey->plane(0) + (size_t) y * grey->pitch(0);
+          for (int x = 0; x < surface->w; x++) {
+            out[x] = row[(size_t) x * stride];
+          }
+        }
+        SDL_FreeSurface(surface);
+        return grey;
+      }
+
+      /**
+       * Drop the chroma planes of a planar image if they carry no colour
+       */
+      void dropNeutralChroma() {
+        if (this->kind != Kind::Planar || this->external != NULL) {
+          return;
+        }
+        size_t luma = (size_t) this->width * this->height;
+        if (neutral(this->planes.data() + luma, this->planes.size() - luma)) {
+          this->kind = Kind::Grey;
+          this->planes.resize(luma);
+          this->planes.shrink_to_fit();
+        }
+      }
+
+      int getWidth() const {
+        return this->width;
+      }
+
+      int getHeight() const {
+        return this->height;
+      }
+
+      Kind getKind() const {
+        return this->kind;
+      }
+
+      /**
+       * NULL unless the kind is Surface
+       */
+      SDL_Surface* getSurface() {
+        return this->surface;
+      }
+
+      /**
+       * Whether the pixels live elsewhere and are only borrowed
+       */
+      bool isShared() const {
+        return (bool) this->unshare;
+      }
+
+      /**
+       * Give up the surface to the caller, leaving the image empty, or a
+       * copy if its pixels are shared.
+       * NULL unless the kind is Surface.
+       */
+      SDL_Surface* release() {
+        if (this->isShared()) {
+          return this->surface == NULL ? NULL : this->toSurface();
+        }
+        SDL_Surface* surface = this->surface;
+        this->surface = NULL;
+        return surface;
+      }
+
+      /**
+       * 0 is Y, 1 is U, 2 is V. Grey images only have Y.
+       */
+      uint8_t* plane(int index) {
+        size_t luma = (size_t) this->width * this->height;
+        size_t chroma = (size_t) this->chromaWidth() * this->chromaHeight();
+        uint8_t* planes = this->external != NULL ? this->external : this->planes.data();
+        return planes + (index == 0 ? 0 : luma + (index - 1) * chroma);
+      }
+
+      int pitch(int index) const {
+        return index == 0 ? this->width : this->chromaWidth();
+      }
+
+      /**
+       * memory held by the pixels
+       */
+      size_t bytes() const {
+        if (this->surface != NULL) {
+          return (size_t) this->surface->pitch * this->surface->h;
+        }
+        return this->external != NULL ? this->planeBytes() : this->planes.size();
+      }
+
+      /**
+       * A new surface with the pixels, for code that can only draw those.
+       * Planar images are converted to ARGB8888, grey ones become 8 bit
+       * with a grey palette, surfaces are copied.
+       */
+      SDL_Surface* toSurface() {
+        if (this->kind == Kind::Surface) {
+          SDL_Surface* copy = SDL_ConvertSurface(this->surface, this->surface->format, 0);
+          if (copy == NULL) {
+            throw SDLException(tfm::format("failed to copy surface, reason: %s", SDL_GetError()));
+          }
+          return copy;
+        }
+
+        bool grey = this->kind == Kind::Grey;
+        SDL_Surface* converted = SDL_CreateRGBSurfaceWithFormat(
+            0, this->width, this->height, grey ? 8 : 32,
+            grey ? SDL_PIXELFORMAT_INDEX8 : SDL_PIXELFORMAT_ARGB8888);
+        if (converted == NULL) {
+          throw SDLException(tfm::format(
+              "failed to create %dx%d surface, reason: %s",
+              this->width, this->height, SDL_GetError()));
+        }
+        if (grey) {
+          SDL_Color ramp[256];
+          for (int i = 0; i < 256; i++) {
+            ramp[i] = { (Uint8) i, (Uint8) i, (Uint8) i, 255 };
+          }
+          SDL_SetPaletteColors(converted->format->palette, ramp, 0, 256);
+          for (int y = 0; y < this->height; y++) {
+            std::memcpy((uint8_t*) converted->pixels + (size_t) y * converted->pitch,
+                this->plane(0) + (size_t) y * this->pitch(0), this->width);
+          }
+          return converted;
+        }
+        // SDL expects the planes of an IYUV buffer packed with the Y pitch
+        // halved, which is how they are laid out here. They are full range
+        // BT.601 like the JPEGs they came from, as Page::uploadPlanar says.
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+        if (SDL_ConvertPixels(this->width, this->height, SDL_PIXELFORMAT_IYUV,
+            this->plane(0), this->pitch(0),
+            SDL_PIXELFORMAT_ARGB8888, converted->pixels, converted->pitch) != 0) {
+          SDL_FreeSurface(converted);
+          throw SDLException(tfm::format("failed to convert yuv page, reason: %s", SDL_GetError()));
+        }
+        return converted;
+      }
+  };
+
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <neither.h>
+#include <tinyformat.h>
+#include "Exception.h"
+#include "Key.h"
+
+namespace app {
+
+  /**
+   * One recorded intent: what a window was asked to do and when.
+   */
+  struct Intent {
+    // since recording started
+    double ms;
+    // which of the opened books, in command line order
+    size_t window;
+    Key key;
+    // where GoToPage went, -1 for every other key
+    int page;
+  };
+
+  /**
+   * Where a window was when recording started, so a replay begins from
+   * the same spread whatever the journal says by then.
+   */
+  struct Opening {
+    int page;
+    bool leftToRight;
+  };
+
+  /**
+   * Writes the intents of a reading session to a text file, one per line,
+   * flushed as they happen so a crash keeps everything up to it:
+   *
+   *   open <window> <page> <leftToRight>
+   *   <ms> <window> <key> [page]
+   */
+  class InputRecorder {
+    private:
+      std::ofstream out;
+      std::chrono::steady_clock::time_point start;
+
+    public:
+      InputRecorder(std::string path) :
+          out(path, std::ios::trunc) {
+        if (!this->out) {
+          throw IOException(tfm::format("failed to open %s for recording", path));
+        }
+        this->start = std::chrono::steady_clock::now();
+        this->out << "# cbzreader input log" << std::endl;
+      }
+
+      void opened(size_t window, int page, bool leftToRight) {
+        this->out << tfm::format("open %d %d %d", window, page, leftToRight ? 1 : 0) << std::endl;
+      }
+
+      void record(size_t window, Key key, int page) {
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - this->start).count();
+        this->out << tfm::format("%.3f %d %s", ms, window, keyName(key));
+        if (key == Key::GoToPage) {
+          this->out << " " << page;
+        }
+        this->out << std::endl;
+      }
+  };
+
+  /**
+   * A recording read back, to drive the windows without a person
+   */
+  class InputReplay {
+    private:
+      std::vector<Intent> intents;
+      std::map<size_t, Opening> openings;
+
+    public:
+      InputReplay(std::string path) {
+        std::ifstream in(path);
+        if (!in) {
+          throw IOException(tfm::format("failed to open recording %s", path));
+        }
+        std::string line;
+        size_t number = 0;
+        while (std::getline(in, line)) {
+          number++;
+          if (line.empty() || line[0] == '#') {
+            continue;
+          }
+          std::stringstream fields(line);
+          std::string first;
+          fields >> first;
+          if (first == "open") {
+            size_t window = 0;
+            Opening opening;
+            int leftToRight = 1;
+            if (!(fields >> window >> opening.page >> leftToRight)) {
+              throw IOException(tfm::format("%s:%d: bad open line", path, number));
+            }
+            opening.leftToRight = leftToRight != 0;
+            this->openings[window] = opening;
+            continue;
+          }
+
+          Intent intent;
+          std::string name;
+          intent.page = -1;
+          std::stringstream time(first);
+          if (!(time >> intent.ms) || !(fields >> intent.window >> name)) {
+            throw IOException(tfm::format("%s:%d: expected <ms> <window> <key>", path, number));
+          }
+          neither::Maybe<Key> key = keyNamed(name);
+          if (!key.hasValue) {
+            throw IOException(tfm::format("%s:%d: unknown key %s", path, number, name));
+          }
+          intent.key = key.unsafeGet();
+          if (intent.key == Key::GoToPage && !(fields >> intent.page)) {
+            throw IOException(tfm::format("%s:%d: go-to-page without a page", path, number));
+          }
+          this->intents.push_back(intent);
+        }
+      }
+
+      const std::vector<Intent>& getIntents() {
+        return this->intents;
+      }
+
+      /**
+       * where a window started out, nothing if the recording doesn't say
+       */
+      neither::Maybe<Opening> getOpening(size_t window) {
+        auto found = this->openings.find(window);
+        if (found == this->openings.end()) {
+          return {};
+        }
+        return { found->second };
+      }
+  };
+
+}
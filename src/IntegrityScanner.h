@@ -0,0 +1,142 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tinyformat.h>
+#include "Allocations.h"
+#include "Archive.h"
+#include "Book.h"
+#include "Crc32.h"
+#include "PageTable.h"
+#include "util.h"
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace app {
+
+  /**
+   * Reads every entry of a book once in the background, checks it against
+   * the CRC-32 in the central directory and flags mismatches in the book so
+   * they render as placeholders instead of failing when reached.
+   *
+   * The scan uses its own archive handle and drops its thread to idle I/O
+   * and lowest CPU priority. Entries are read and checksummed a chunk at a
+   * time, with a short pause after each, and the scan waits whenever the
+   * book is decoding a page for display. Pages are checked in reading
+   * order so the ones the reader gets to first are verified first.
+   *
+   * Remote archives are skipped: verifying them means downloading them.
+   */
+  class IntegrityScanner {
+    private:
+      static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+      // keeps a scan of a cached archive from hogging the disk and a core
+      static constexpr int CHUNK_PAUSE_MS = 2;
+
+      Book* book;
+      std::string path;
+      std::thread worker;
+      std::atomic<bool> stopping { false };
+      std::atomic<size_t> checked { 0 };
+      std::atomic<size_t> failed { 0 };
+
+      static void lowerPriority() {
+#ifdef __linux__
+        // ioprio_set(IOPRIO_WHO_PROCESS, this thread, IOPRIO_CLASS_IDLE)
+        const int whoProcess = 1;
+        const int classIdle = 3;
+        const int classShift = 13;
+        syscall(SYS_ioprio_set, whoProcess, 0, classIdle << classShift);
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+      }
+
+      /**
+       * wait until the book isn't decoding for the screen
+       */
+      void yieldToForeground() {
+        while (!this->stopping && this->book->isDecoding()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      }
+
+      bool verify(Archive* archive, const std::string& name) {
+        AllocationTag tag(Allocations::Archive);
+        uint32_t crc = 0;
+        try {
+          archive->readChunks(name, CHUNK_SIZE, [&](const char* data, size_t length) {
+            crc = Crc32::compute(crc, data, length);
+            std::this_thread::sleep_for(std::chrono::milliseconds(CHUNK_PAUSE_MS));
+            this->yieldToForeground();
+            return !this->stopping;
+          });
+        } catch (IOException& e) {
+          return this->stopping;
+        }
+        return this->stopping || crc == archive->getCrc(name);
+      }
+
+      void run() {
+        lowerPriority();
+        Archive* archive = NULL;
+        try {
+          archive = Book::openArchive(this->path);
+        } catch (IOException& e) {
+          return;
+        }
+
+        // natural order first, so pages are checked in reading order
+        std::vector<std::pair<std::string, std::string>> names;
+        for (std::string name : archive->getNames()) {
+          names.push_back(std::make_pair(PageTable::naturalKey(name), name));
+        }
+        std::sort(names.begin(), names.end());
+        for (auto entry : names) {
+          std::string name = entry.second;
+          if (this->stopping) {
+            break;
+          }
+          this->yieldToForeground();
+          if (!this->verify(archive, name)) {
+            this->book->markBad(name);
+            this->failed++;
+            std::cerr << tfm::format("integrity: %s is corrupt", name) << std::endl;
+          }
+          this->checked++;
+        }
+        delete archive;
+      }
+
+    public:
+      IntegrityScanner(Book* book, std::string path) {
+        this->book = book;
+        this->path = path;
+        if (!isUrl(path)) {
+          this->worker = std::thread(&IntegrityScanner::run, this);
+        }
+      }
+
+      ~IntegrityScanner() {
+        this->stopping = true;
+        if (this->worker.joinable()) {
+          this->worker.join();
+        }
+      }
+
+      size_t getChecked() {
+        return this->checked;
+      }
+
+      size_t getFailed() {
+        return this->failed;
+      }
+  };
+
+}
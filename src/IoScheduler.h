@@ -0,0 +1,458 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tinyformat.h>
+#include "Exception.h"
+#include "Metrics.h"
+// io_uring is opt in: build with -DCBZ_IO_URING and link with -luring
+#if defined(CBZ_IO_URING)
+#include <liburing.h>
+#endif
+
+namespace app {
+
+  /**
+   * Reads byte ranges of one local file, batching the reads it is told
+   * about ahead of time.
+   *
+   * Ranges handed to prefetch are sorted by offset and merged with their
+   * neighbours when the gap between them is small, so pages stored next to
+   * each other cost one request and a disk head sweeps in one direction
+   * instead of seeking back and forth. Built with CBZ_IO_URING, batches go
+   * to io_uring, at most queueDepth at a time, with a thread reaping
+   * completions. Without it, or where the kernel refuses it, one thread
+   * reads them in offset order with pread, asking the kernel with
+   * posix_fadvise to start on the queueDepth batches after the one it is
+   * reading.
+   *
+   * read serves a range from a batch when one covers it, waiting for it if
+   * it is still in flight and moving it to the front if it hasn't been
+   * started, and reads the file directly otherwise. Batches are dropped
+   * once every range they were built for has been read, or, oldest first,
+   * when the buffered bytes go over a limit.
+   */
+  class IoScheduler {
+    public:
+      struct Range {
+        uint64_t offset;
+        uint64_t length;
+      };
+
+    private:
+      // reading this much more is cheaper than a seek on a spinning disk
+      static constexpr uint64_t MERGE_GAP = 256 * 1024;
+      static constexpr uint64_t MAX_BATCH = 2 * 1024 * 1024;
+      static constexpr uint64_t MAX_BUFFERED = 64 * 1024 * 1024;
+
+      struct Batch {
+        uint64_t offset;
+        uint64_t length;
+        // allocated when the read starts, so queued batches cost nothing
+        std::unique_ptr<char[]> data;
+        uint64_t filled = 0;
+        // offsets of the ranges asked for that haven't been read yet
+        std::set<uint64_t> unread;
+        bool started = false;
+        bool done = false;
+        bool failed = false;
+        // handed to posix_fadvise already
+        bool advised = false;
+        size_t age = 0;
+      };
+
+      int fd;
+      uint64_t fileSize;
+      size_t queueDepth;
+      std::mutex lock;
+      std::condition_variable changed;
+      // by offset
+      std::map<uint64_t, std::shared_ptr<Batch>> batches;
+      // not started yet, in the order they should be
+      std::deque<std::shared_ptr<Batch>> queued;
+      size_t inFlight = 0;
+      uint64_t buffered = 0;
+      size_t clock = 0;
+      bool stopping = false;
+      std::thread worker;
+#if defined(CBZ_IO_URING)
+      struct io_uring ring;
+      bool uring = false;
+      // batches the kernel is reading into, kept alive until they complete
+      std::map<Batch*, std::shared_ptr<Batch>> submitted;
+#endif
+
+      /**
+       * the batch holding all of [offset, offset + length), if any
+       */
+      std::shared_ptr<Batch> covering(uint64_t offset, uint64_t length) {
+        auto it = this->batches.upper_bound(offset);
+        if (it == this->batches.begin()) {
+          return NULL;
+        }
+        --it;
+        Batch* batch = it->second.get();
+        if (offset + length <= batch->offset + batch->length) {
+          return it->second;
+        }
+        return NULL;
+      }
+
+      void forget(std::shared_ptr<Batch> batch) {
+        auto it = this->batches.find(batch->offset);
+        if (it != this->batches.end() && it->second == batch) {
+          this->buffered -= batch->length;
+          this->batches.erase(it);
+        }
+      }
+
+      /**
+       * drop the oldest finished batches while over the buffer limit
+       */
+      void trim() {
+        while (this->buffered > MAX_BUFFERED) {
+          std::shared_ptr<Batch> oldest;
+          for (auto entry : this->batches) {
+            if (entry.second->done && (!oldest || entry.second->age < oldest->age)) {
+              oldest = entry.second;
+            }
+          }
+          if (!oldest) {
+            return;
+          }
+          this->forget(oldest);
+        }
+      }
+
+      void readFully(uint64_t offset, char* into, uint64_t length) {
+        uint64_t done = 0;
+        while (done < length) {
+          ssize_t result = pread(this->fd, into + done, length - done, offset + done);
+          if (result < 0 && errno == EINTR) {
+            continue;
+          }
+          if (result <= 0) {
+            throw IOException(tfm::format(
+                "failed to read %d bytes at %d, reason: %s",
+                length, offset, result == 0 ? "end of file" : std::strerror(errno)));
+          }
+          done += result;
+        }
+        Metrics::global().ioRequests++;
+      }
+
+#if defined(CBZ_IO_URING)
+      /**
+       * hand queued batches to the kernel up to the queue depth, lock held
+       */
+      void submitQueued() {
+        bool any = false;
+        while (this->inFlight < this->queueDepth && !this->queued.empty()) {
+          struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+          if (sqe == NULL) {
+            break;
+          }
+          std::shared_ptr<Batch> batch = this->queued.front();
+          this->queued.pop_front();
+          batch->started = true;
+          batch->data.reset(new char[batch->length]);
+          io_uring_prep_read(sqe, this->fd, batch->data.get(), batch->length, batch->offset);
+          io_uring_sqe_set_data(sqe, batch.get());
+          this->submitted[batch.get()] = batch;
+          this->inFlight++;
+          any = true;
+          Metrics::global().ioRequests++;
+        }
+        if (any) {
+          io_uring_submit(&this->ring);
+        }
+      }
+
+      /**
+       * Reap completions until stopped. A completion without a batch is
+       * the destructor's wake up call.
+       */
+      void reap() {
+        bool stopRequested = false;
+        while (!stopRequested || this->inFlight > 0) {
+          struct io_uring_cqe* cqe;
+          int result = io_uring_wait_cqe(&this->ring, &cqe);
+          if (result == -EINTR) {
+            continue;
+          }
+          std::lock_guard<std::mutex> guard(this->lock);
+          if (result < 0) {
+            // the ring is unusable; fail whatever is in flight
+            for (auto entry : this->submitted) {
+              entry.second->failed = true;
+              entry.second->done = true;
+            }
+            this->submitted.clear();
+            this->inFlight = 0;
+            this->changed.notify_all();
+            return;
+          }
+          Batch* batch = (Batch*) io_uring_cqe_get_data(cqe);
+          int read = cqe->res;
+          io_uring_cqe_seen(&this->ring, cqe);
+          if (batch == NULL) {
+            stopRequested = true;
+            continue;
+          }
+
+          std::shared_ptr<Batch> owned = this->submitted[batch];
+          this->submitted.erase(batch);
+          this->inFlight--;
+          if (read > 0) {
+            batch->filled += read;
+          }
+          if (read > 0 && batch->filled < batch->length && !this->stopping) {
+            // short read, queue the rest first
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+            if (sqe != NULL) {
+              io_uring_prep_read(sqe, this->fd, batch->data.get() + batch->filled,
+                  batch->length - batch->filled, batch->offset + batch->filled);
+              io_uring_sqe_set_data(sqe, batch);
+              this->submitted[batch] = owned;
+              this->inFlight++;
+              io_uring_submit(&this->ring);
+              continue;
+            }
+          }
+          batch->failed = batch->filled < batch->length;
+          batch->done = true;
+          if (!this->stopping) {
+            this->submitQueued();
+          }
+          this->changed.notify_all();
+        }
+      }
+#endif
+
+      /**
+       * read queued batches one at a time in order, without io_uring
+       */
+      void work() {
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true) {
+          this->changed.wait(guard, [&]() {
+            return this->stopping || !this->queued.empty();
+          });
+          if (this->stopping) {
+            return;
+          }
+          std::shared_ptr<Batch> batch = this->queued.front();
+          this->queued.pop_front();
+          batch->started = true;
+          // the kernel reads ahead the batches behind this one meanwhile,
+          // keeping up to queueDepth requests in the disk's queue
+          std::vector<std::pair<uint64_t, uint64_t>> ahead;
+          for (size_t i = 0; i < this->queued.size() && i + 1 < this->queueDepth; i++) {
+            Batch* next = this->queued[i].get();
+            if (!next->advised) {
+              next->advised = true;
+              ahead.push_back({ next->offset, next->length });
+            }
+          }
+          guard.unlock();
+
+          for (auto range : ahead) {
+            posix_fadvise(this->fd, range.first, range.second, POSIX_FADV_WILLNEED);
+          }
+          bool failed = false;
+          try {
+            batch->data.reset(new char[batch->length]);
+            this->readFully(batch->offset, batch->data.get(), batch->length);
+          } catch (IOException& e) {
+            failed = true;
+          }
+
+          guard.lock();
+          batch->filled = failed ? 0 : batch->length;
+          batch->failed = failed;
+          batch->done = true;
+          this->changed.notify_all();
+        }
+      }
+
+    public:
+      /**
+       * queueDepth: batches handed to the kernel at once
+       */
+      IoScheduler(std::string path, size_t queueDepth = 8) {
+        this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (this->fd < 0) {
+          throw IOException(tfm::format("failed to open %s, reason: %s", path, std::strerror(errno)));
+        }
+        struct stat info;
+        if (fstat(this->fd, &info) != 0) {
+          close(this->fd);
+          throw IOException(tfm::format("failed to stat %s, reason: %s", path, std::strerror(errno)));
+        }
+        this->fileSize = info.st_size;
+        this->queueDepth = std::max((size_t) 1, queueDepth);
+
+#if defined(CBZ_IO_URING)
+        // fails on old kernels and where seccomp forbids it
+        this->uring = io_uring_queue_init(this->queueDepth + 1, &this->ring, 0) == 0;
+        if (this->uring) {
+          this->worker = std::thread(&IoScheduler::reap, this);
+          return;
+        }
+#endif
+        this->worker = std::thread(&IoScheduler::work, this);
+      }
+
+      ~IoScheduler() {
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          this->stopping = true;
+          this->queued.clear();
+          this->changed.notify_all();
+#if defined(CBZ_IO_URING)
+          if (this->uring) {
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&this->ring);
+            if (sqe != NULL) {
+              io_uring_prep_nop(sqe);
+              io_uring_sqe_set_data(sqe, NULL);
+              io_uring_submit(&this->ring);
+            }
+          }
+#endif
+        }
+        this->worker.join();
+#if defined(CBZ_IO_URING)
+        if (this->uring) {
+          io_uring_queue_exit(&this->ring);
+        }
+#endif
+        close(this->fd);
+      }
+
+      uint64_t size() {
+        return this->fileSize;
+      }
+
+      /**
+       * Start reading ranges that will be asked for soon. Ranges already
+       * covered by a batch are not read again.
+       */
+      void prefetch(std::vector<Range> ranges) {
+        std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) {
+          return a.offset < b.offset;
+        });
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        std::vector<std::shared_ptr<Batch>> added;
+        for (const Range& range : ranges) {
+          if (range.length == 0 || range.offset + range.length > this->fileSize) {
+            continue;
+          }
+          std::shared_ptr<Batch> existing = this->covering(range.offset, range.length);
+          if (existing) {
+            existing->unread.insert(range.offset);
+            existing->age = ++this->clock;
+            continue;
+          }
+          if (!added.empty()) {
+            Batch* last = added.back().get();
+            uint64_t end = last->offset + last->length;
+            uint64_t merged = range.offset + range.length - last->offset;
+            if (range.offset <= end + MERGE_GAP && merged <= MAX_BATCH) {
+              last->length = std::max(end, range.offset + range.length) - last->offset;
+              last->unread.insert(range.offset);
+              continue;
+            }
+          }
+          std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+          batch->offset = range.offset;
+          batch->length = range.length;
+          batch->unread.insert(range.offset);
+          added.push_back(batch);
+        }
+
+        for (std::shared_ptr<Batch> batch : added) {
+          // a batch at the same offset is in use, leave these to read
+          if (this->batches.count(batch->offset) > 0) {
+            continue;
+          }
+          batch->age = ++this->clock;
+          this->batches[batch->offset] = batch;
+          this->buffered += batch->length;
+          this->queued.push_back(batch);
+        }
+        this->trim();
+#if defined(CBZ_IO_URING)
+        if (this->uring) {
+          this->submitQueued();
+        }
+#endif
+        this->changed.notify_all();
+      }
+
+      /**
+       * exactly [offset, offset + length), throws IOException past the end
+       * of the file or when the read fails
+       */
+      std::vector<char> read(uint64_t offset, uint64_t length) {
+        {
+          std::unique_lock<std::mutex> guard(this->lock);
+          std::shared_ptr<Batch> batch = this->covering(offset, length);
+          if (batch) {
+            if (!batch->started) {
+              // wanted now, ahead of everything else queued
+              auto it = std::find(this->queued.begin(), this->queued.end(), batch);
+              if (it != this->queued.end()) {
+                this->queued.erase(it);
+                this->queued.push_front(batch);
+              }
+#if defined(CBZ_IO_URING)
+              if (this->uring) {
+                this->submitQueued();
+              }
+#endif
+              this->changed.notify_all();
+            }
+            this->changed.wait(guard, [&]() {
+              return batch->done || this->stopping;
+            });
+            if (batch->done && !batch->failed) {
+              const char* start = batch->data.get() + (offset - batch->offset);
+              std::vector<char> data(start, start + length);
+              batch->unread.erase(offset);
+              if (batch->unread.empty()) {
+                this->forget(batch);
+              }
+              return data;
+            }
+            if (batch->failed) {
+              // read again below, and directly next time too
+              this->forget(batch);
+            }
+          }
+        }
+
+        if (offset + length > this->fileSize) {
+          throw IOException(tfm::format("read of %d bytes at %d is past the end of the file", length, offset));
+        }
+        std::vector<char> data(length);
+        this->readFully(offset, data.data(), length);
+        return data;
+      }
+  };
+
+}
@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "util.h"
+
+namespace app {
+
+  /**
+   * Remembers where the reader was in each archive, and which spreads they
+   * looked at, across launches.
+   *
+   * One small text file per archive lives under the SDL pref path, keyed by
+   * the archive's absolute path and size. Saves write a temporary file and
+   * rename it over the old one, so a crash mid-write never loses the
+   * previous position. There is no fsync: losing the last page turn on
+   * power loss is fine, paying for a disk flush on every page turn is not.
+   */
+  class Journal {
+    private:
+      std::string journalPath;
+      int page = 0;
+      bool leftToRight = true;
+      // spread start page -> number of times it was turned to
+      std::map<int, int> views;
+
+      static std::string locate(std::string archivePath) {
+        std::string dir = prefPath("journal");
+        if (dir.empty()) {
+          return "";
+        }
+
+        std::string key = archivePath;
+        if (!isUrl(archivePath)) {
+          std::error_code error;
+          std::string absolute = std::filesystem::absolute(archivePath, error).string();
+          uintmax_t size = std::filesystem::file_size(archivePath, error);
+          key = tfm::format("%s:%d", absolute, error ? 0 : size);
+        }
+        return tfm::format("%s/%016x.txt", dir, fnv1a(key));
+      }
+
+      void load() {
+        std::ifstream in(this->journalPath);
+        std::string line;
+        while (std::getline(in, line)) {
+          std::stringstream fields(line);
+          std::string name;
+          fields >> name;
+          if (name == "page") {
+            fields >> this->page;
+          } else if (name == "leftToRight") {
+            fields >> this->leftToRight;
+          } else if (name == "view") {
+            int spread = 0;
+            int count = 0;
+            if (fields >> spread >> count) {
+              this->views[spread] = count;
+            }
+          }
+        }
+      }
+
+    public:
+      /**
+       * An unreadable or missing journal just means starting from the front.
+       */
+      Journal(std::string archivePath) {
+        this->journalPath = locate(archivePath);
+        if (!this->journalPath.empty()) {
+          this->load();
+        }
+      }
+
+      /**
+       * when the journal of an archive was last saved, the earliest time
+       * there is if it never was
+       */
+      static std::filesystem::file_time_type savedAt(std::string archivePath) {
+        std::string journalPath = locate(archivePath);
+        std::error_code error;
+        auto saved = std::filesystem::last_write_time(journalPath, error);
+        return journalPath.empty() || error ? std::filesystem::file_time_type::min() : saved;
+      }
+
+      int getPage() {
+        return this->page;
+      }
+
+      bool isLeftToRight() {
+        return this->leftToRight;
+      }
+
+      /**
+       * Record the current position, counting a view if the spread changed.
+       * Only touches the disk when something changed.
+       */
+      void record(int page, bool leftToRight) {
+        if (page == this->page && leftToRight == this->leftToRight) {
+          return;
+        }
+        if (page != this->page) {
+          this->views[page] += 1;
+        }
+        this->page = page;
+        this->leftToRight = leftToRight;
+        this->save();
+      }
+
+      /**
+       * Stop saving, so a replayed session leaves the reader's real
+       * position alone
+       */
+      void detach() {
+        this->journalPath = "";
+      }
+
+      bool isDetached() {
+        return this->journalPath.empty();
+      }
+
+      void save() {
+        if (this->journalPath.empty()) {
+          return;
+        }
+        std::string tmpPath = this->journalPath + ".tmp";
+        {
+          std::ofstream out(tmpPath, std::ios::trunc);
+          out << "page " << this->page << "\n";
+          out << "leftToRight " << this->leftToRight << "\n";
+          for (auto entry : this->views) {
+            out << "view " << entry.first << " " << entry.second << "\n";
+          }
+          if (!out) {
+            return;
+          }
+        }
+        std::rename(tmpPath.c_str(), this->journalPath.c_str());
+      }
+
+      /**
+       * Pages worth decoding before the window is shown: the spread that will
+       * be displayed, its neighbours, then up to hotSpreads of the most
+       * revisited other spreads.
+       */
+      std::vector<size_t> prewarm(size_t hotSpreads) {
+        std::vector<int> spreads = { this->page, this->page + 2, this->page - 2 };
+
+        std::vector<std::pair<int, int>> ranked(this->views.begin(), this->views.end());
+        std::stable_sort(ranked.begin(), ranked.end(),
+            [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+              return a.second > b.second;
+            });
+        for (auto entry : ranked) {
+          if (hotSpreads == 0) {
+            break;
+          }
+          if (std::find(spreads.begin(), spreads.end(), entry.first) == spreads.end()) {
+            spreads.push_back(entry.first);
+            hotSpreads--;
+          }
+        }
+
+        std::vector<size_t> pages;
+        for (int spread : spreads) {
+          if (spread >= 0) {
+            pages.push_back(spread);
+            pages.push_back(spread + 1);
+          }
+        }
+        return pages;
+      }
+  };
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <neither.h>
+
+namespace app {
+
+  /**
+   * What a key press or mouse click asks the reader to do
+   */
+  enum class Key {
+    Next,
+    Prev,
+    Exit,
+    SwapOdd,
+    SwapDirection,
+    Fullscreen,
+    GoToPage,
+    ToggleStatusBar,
+    Help,
+  };
+
+  const Key allKeys[] = {
+      Key::Next, Key::Prev, Key::Exit, Key::SwapOdd, Key::SwapDirection,
+      Key::Fullscreen, Key::GoToPage, Key::ToggleStatusBar, Key::Help,
+  };
+
+  /**
+   * a stable name for files that outlive a build
+   */
+  std::string keyName(Key key) {
+    switch (key) {
+      case Key::Next:
+        return "next";
+      case Key::Prev:
+        return "prev";
+      case Key::Exit:
+        return "exit";
+      case Key::SwapOdd:
+        return "swap-odd";
+      case Key::SwapDirection:
+        return "swap-direction";
+      case Key::Fullscreen:
+        return "fullscreen";
+      case Key::GoToPage:
+        return "go-to-page";
+      case Key::ToggleStatusBar:
+        return "toggle-status-bar";
+      case Key::Help:
+        return "help";
+    }
+    return "";
+  }
+
+  neither::Maybe<Key> keyNamed(const std::string& name) {
+    for (Key key : allKeys) {
+      if (keyName(key) == name) {
+        return { key };
+      }
+    }
+    return {};
+  }
+
+}
@@ -187,6 +187,30 @@ namespace app {
         return {src.x + delta, src.y, src.w, src.h};
       }
 
+      /**
+       * Lay out a two page spread in space: each page scaled to fit its half,
+       * the pages meeting in the middle, both centered vertically
+       * first: left page
+       * second: right page
+       */
+      static std::pair<SDL_Rect, SDL_Rect> spread(
+          const SDL_Rect& left,
+          const SDL_Rect& right,
+          const SDL_Rect& space) {
+        std::pair<SDL_Rect, SDL_Rect> split = splitHorizontal(space);
+        SDL_Rect sizedl = centerVertically(
+            alignRightAgainstLeft(
+                scaleAspect(left, split.first),
+                split.second),
+            space);
+        SDL_Rect sizedr = centerVertically(
+            alignLeftAgainstRight(
+                scaleAspect(right, split.second),
+                split.first),
+            space);
+        return std::make_pair(sizedl, sizedr);
+      }
+
       /**
        * Center src vertically within dst
        */
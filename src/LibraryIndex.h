@@ -0,0 +1,542 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <neither.h>
+#include <tinyformat.h>
+#include "Book.h"
+#include "ComicInfo.h"
+#include "Exception.h"
+#include "WorkQueue.h"
+#include "util.h"
+
+namespace app {
+
+  /**
+   * The ComicInfo.xml metadata of a library of archives, searchable by
+   * word, in one file that is mmapped rather than read:
+   *
+   *   header
+   *   documents   one per archive, sorted by path
+   *   terms       "field:word", sorted, each naming a run of postings
+   *   postings    document numbers, ascending within a term
+   *   strings     paths, field values and term keys, not terminated
+   *
+   * A query only touches the header, a binary search of the terms and
+   * the postings and documents it returns. Archives without metadata are
+   * kept too, with empty fields, so a refresh knows they were looked at.
+   */
+  class LibraryIndex {
+    public:
+      struct StringRef {
+        uint32_t offset;
+        uint32_t length;
+      };
+
+      struct Document {
+        // of the archive when it was read
+        int64_t mtime;
+        uint64_t size;
+        StringRef path;
+        StringRef fields[ComicInfo::FIELDS];
+      };
+
+      struct Term {
+        StringRef key;
+        uint32_t first;
+        uint32_t count;
+      };
+
+      struct Header {
+        char magic[8];
+        // also tells a file written on a machine of the other byte order
+        uint32_t version;
+        uint32_t documents;
+        uint32_t terms;
+        uint32_t postings;
+        uint64_t strings;
+      };
+
+      static constexpr uint32_t VERSION = 1;
+
+    private:
+      int fd = -1;
+      const char* mapped = NULL;
+      size_t mappedSize = 0;
+      const Header* header;
+      const Document* documents;
+      const Term* terms;
+      const uint32_t* postings;
+      const char* strings;
+
+      std::string_view string(StringRef ref) const {
+        return std::string_view(this->strings + ref.offset, ref.length);
+      }
+
+      /**
+       * documents with a word in a field, or with a word starting with the
+       * prefix if it ends in *
+       */
+      std::vector<uint32_t> postingsOf(ComicInfo::Field field, const std::string& word) const {
+        bool prefix = !word.empty() && word.back() == '*';
+        std::string key = std::string(ComicInfo::fieldName(field)) + ":"
+            + (prefix ? word.substr(0, word.size() - 1) : word);
+        const Term* end = this->terms + this->header->terms;
+        const Term* it = std::lower_bound(this->terms, end, key,
+            [&](const Term& term, const std::string& key) {
+              return this->string(term.key) < key;
+            });
+
+        std::vector<uint32_t> found;
+        for (; it != end; ++it) {
+          std::string_view termKey = this->string(it->key);
+          if (prefix ? termKey.compare(0, key.size(), key) != 0 : termKey != key) {
+            break;
+          }
+          found.insert(found.end(), this->postings + it->first, this->postings + it->first + it->count);
+          if (!prefix) {
+            break;
+          }
+        }
+        if (prefix) {
+          std::sort(found.begin(), found.end());
+          found.erase(std::unique(found.begin(), found.end()), found.end());
+        }
+        return found;
+      }
+
+      static std::vector<uint32_t> intersect(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+        std::vector<uint32_t> both;
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both));
+        return both;
+      }
+
+      static std::vector<uint32_t> unite(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+        std::vector<uint32_t> either;
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(either));
+        return either;
+      }
+
+    public:
+      /**
+       * Throws IOException if the file is missing or isn't an index this
+       * build can read.
+       */
+      LibraryIndex(std::string path) {
+        this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (this->fd < 0) {
+          throw IOException(tfm::format("failed to open index %s, reason: %s", path, std::strerror(errno)));
+        }
+        struct stat info;
+        if (fstat(this->fd, &info) != 0 || (size_t) info.st_size < sizeof(Header)) {
+          close(this->fd);
+          throw IOException(tfm::format("%s is not a library index", path));
+        }
+        this->mappedSize = info.st_size;
+        void* mapped = mmap(NULL, this->mappedSize, PROT_READ, MAP_SHARED, this->fd, 0);
+        if (mapped == MAP_FAILED) {
+          close(this->fd);
+          throw IOException(tfm::format("failed to map index %s, reason: %s", path, std::strerror(errno)));
+        }
+        this->mapped = (const char*) mapped;
+
+        this->header = (const Header*) this->mapped;
+        uint64_t expected = sizeof(Header)
+            + (uint64_t) this->header->documents * sizeof(Document)
+            + (uint64_t) this->header->terms * sizeof(Term)
+            + (uint64_t) this->header->postings * sizeof(uint32_t)
+            + this->header->strings;
+        if (std::memcmp(this->header->magic, "CBZINDEX", 8) != 0
+            || this->header->version != VERSION
+            || expected != this->mappedSize) {
+          munmap((void*) this->mapped, this->mappedSize);
+          close(this->fd);
+          throw IOException(tfm::format("%s is not a library index this version can read", path));
+        }
+        this->documents = (const Document*) (this->mapped + sizeof(Header));
+        this->terms = (const Term*) (this->documents + this->header->documents);
+        this->postings = (const uint32_t*) (this->terms + this->header->terms);
+        this->strings = (const char*) (this->postings + this->header->postings);
+      }
+
+      LibraryIndex(const LibraryIndex&) = delete;
+      LibraryIndex& operator=(const LibraryIndex&) = delete;
+
+      ~LibraryIndex() {
+        munmap((void*) this->mapped, this->mappedSize);
+        close(this->fd);
+      }
+
+      /**
+       * where the library's index lives unless told otherwise, empty if
+       * there is nowhere to write
+       */
+      static std::string defaultPath() {
+        std::string dir = prefPath("index");
+        return dir.empty() ? "" : dir + "/library.idx";
+      }
+
+      size_t size() const {
+        return this->header->documents;
+      }
+
+      const Document& getDocument(uint32_t document) const {
+        return this->documents[document];
+      }
+
+      std::string getPath(uint32_t document) const {
+        return std::string(this->string(this->documents[document].path));
+      }
+
+      std::string getField(uint32_t document, ComicInfo::Field field) const {
+        return std::string(this->string(this->documents[document].fields[field]));
+      }
+
+      ComicInfo getInfo(uint32_t document) const {
+        ComicInfo info;
+        for (int i = 0; i < ComicInfo::FIELDS; i++) {
+          info.fields[i] = this->getField(document, (ComicInfo::Field) i);
+        }
+        return info;
+      }
+
+      /**
+       * The document of an archive, by the absolute path it was indexed
+       * under
+       */
+      neither::Maybe<uint32_t> find(const std::string& path) const {
+        const Document* end = this->documents + this->header->documents;
+        const Document* it = std::lower_bound(this->documents, end, path,
+            [&](const Document& document, const std::string& path) {
+              return this->string(document.path) < path;
+            });
+        if (it == end || this->string(it->path) != path) {
+          return {};
+        }
+        return { (uint32_t) (it - this->documents) };
+      }
+
+      /**
+       * Documents matching every word of the query, in path order. A word
+       * is "field:word" to look in one field or just "word" for any, and
+       * ends in * to match as a prefix; "writer:alan*" or "batman".
+       * Field values are split into words the way they were indexed, so
+       * "series:swamp-thing" needs both words in the series.
+       */
+      std::vector<uint32_t> search(const std::string& query) const {
+        std::vector<uint32_t> matches;
+        bool first = true;
+        for (std::string word : splitSpaceSeparated(query)) {
+          std::vector<ComicInfo::Field> fields;
+          size_t colon = word.find(':');
+          if (colon != std::string::npos) {
+            std::string name = word.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            neither::Maybe<ComicInfo::Field> field = ComicInfo::fieldNamed(name);
+            if (!field.hasValue) {
+              throw Exception(tfm::format("unknown field %s", name));
+            }
+            fields.push_back(field.unsafeGet());
+            word = word.substr(colon + 1);
+          } else {
+            for (int i = 0; i < ComicInfo::FIELDS; i++) {
+              fields.push_back((ComicInfo::Field) i);
+            }
+          }
+
+          std::vector<std::string> parts = ComicInfo::words(word);
+          if (!parts.empty() && word.back() == '*') {
+            parts.back() += "*";
+          }
+          for (const std::string& part : parts) {
+            std::vector<uint32_t> found;
+            for (ComicInfo::Field field : fields) {
+              found = unite(found, this->postingsOf(field, part));
+            }
+            matches = first ? found : intersect(matches, found);
+            first = false;
+          }
+        }
+        return matches;
+      }
+  };
+
+  struct IndexOptions {
+    // directories to look for archives in, recursively, or archives
+    std::vector<std::string> paths;
+    std::string indexPath;
+    // 0: one per core
+    int jobs = 0;
+  };
+
+  /**
+   * Builds or refreshes a LibraryIndex.
+   *
+   * Archives whose size and modification time match what the old index
+   * recorded keep their entry; the rest have just their ComicInfo.xml
+   * read, by a pool of workers, each opening the archive with the same
+   * code as the reader so only the central directory and that one entry
+   * come off the disk. The new index is written to a temporary file and
+   * renamed over the old one, so searches never see half of it.
+   */
+  class LibraryIndexer {
+    private:
+      using StringRef = LibraryIndex::StringRef;
+      using Document = LibraryIndex::Document;
+      using Term = LibraryIndex::Term;
+      using Header = LibraryIndex::Header;
+
+      struct Candidate {
+        std::string path;
+        // 0 for archives that couldn't be read, so the next refresh tries
+        // them again
+        int64_t mtime;
+        uint64_t size;
+        ComicInfo info;
+      };
+
+      IndexOptions options;
+      std::atomic<size_t> withoutInfo { 0 };
+      std::atomic<size_t> unreadable { 0 };
+
+      static bool isArchive(const std::filesystem::path& path) {
+        std::string extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension == ".cbz" || extension == ".zip";
+      }
+
+      static void add(const std::filesystem::path& path, std::vector<Candidate>& found) {
+        std::error_code error;
+        std::filesystem::file_time_type mtime = std::filesystem::last_write_time(path, error);
+        uintmax_t size = std::filesystem::file_size(path, error);
+        if (error) {
+          return;
+        }
+        std::string absolute = std::filesystem::absolute(path, error).lexically_normal().string();
+        found.push_back(Candidate {
+            error ? path.string() : absolute,
+            (int64_t) mtime.time_since_epoch().count(),
+            (uint64_t) size,
+            ComicInfo() });
+      }
+
+      std::vector<Candidate> scan() {
+        std::vector<Candidate> found;
+        for (std::string root : this->options.paths) {
+          std::error_code error;
+          if (std::filesystem::is_regular_file(root, error)) {
+            add(root, found);
+            continue;
+          }
+          auto it = std::filesystem::recursive_directory_iterator(
+              root, std::filesystem::directory_options::skip_permission_denied, error);
+          if (error) {
+            throw IOException(tfm::format("failed to list %s, reason: %s", root, error.message()));
+          }
+          for (; it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+            if (error) {
+              break;
+            }
+            if (it->is_regular_file(error) && isArchive(it->path())) {
+              add(it->path(), found);
+            }
+          }
+        }
+        std::sort(found.begin(), found.end(), [](const Candidate& a, const Candidate& b) {
+          return a.path < b.path;
+        });
+        found.erase(std::unique(found.begin(), found.end(), [](const Candidate& a, const Candidate& b) {
+          return a.path == b.path;
+        }), found.end());
+        return found;
+      }
+
+      void work(WorkQueue<Candidate*>* queue) {
+        while (true) {
+          neither::Maybe<Candidate*> next = queue->pop();
+          if (!next.hasValue) {
+            break;
+          }
+          Candidate* candidate = next.unsafeGet();
+          Archive* archive = NULL;
+          try {
+            archive = Book::openArchive(candidate->path);
+            neither::Maybe<ComicInfo> info = ComicInfo::read(archive);
+            if (info.hasValue) {
+              candidate->info = info.unsafeGet();
+            } else {
+              this->withoutInfo++;
+            }
+          } catch (IOException& e) {
+            this->unreadable++;
+            candidate->mtime = 0;
+          } catch (std::exception& e) {
+            this->unreadable++;
+            candidate->mtime = 0;
+          }
+          delete archive;
+        }
+      }
+
+      static StringRef intern(const std::string& value, std::string& strings) {
+        StringRef ref = { (uint32_t) strings.size(), (uint32_t) value.size() };
+        strings += value;
+        return ref;
+      }
+
+      void write(const std::vector<Candidate>& candidates) {
+        std::string strings;
+        std::vector<Document> documents;
+        std::unordered_map<std::string, std::vector<uint32_t>> postings;
+        for (uint32_t i = 0; i < candidates.size(); i++) {
+          const Candidate& candidate = candidates[i];
+          Document document;
+          document.mtime = candidate.mtime;
+          document.size = candidate.size;
+          document.path = intern(candidate.path, strings);
+          for (int field = 0; field < ComicInfo::FIELDS; field++) {
+            const std::string& value = candidate.info.fields[field];
+            document.fields[field] = intern(value, strings);
+            std::string prefix = std::string(ComicInfo::fieldName(field)) + ":";
+            for (const std::string& word : ComicInfo::words(value)) {
+              std::vector<uint32_t>& list = postings[prefix + word];
+              if (list.empty() || list.back() != i) {
+                list.push_back(i);
+              }
+            }
+          }
+          documents.push_back(document);
+        }
+
+        std::vector<std::string> keys;
+        for (auto entry : postings) {
+          keys.push_back(entry.first);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<Term> terms;
+        std::vector<uint32_t> flat;
+        for (const std::string& key : keys) {
+          const std::vector<uint32_t>& list = postings[key];
+          terms.push_back(Term { intern(key, strings), (uint32_t) flat.size(), (uint32_t) list.size() });
+          flat.insert(flat.end(), list.begin(), list.end());
+        }
+
+        Header header;
+        std::memcpy(header.magic, "CBZINDEX", 8);
+        header.version = LibraryIndex::VERSION;
+        header.documents = documents.size();
+        header.terms = terms.size();
+        header.postings = flat.size();
+        header.strings = strings.size();
+
+        std::string tmpPath = this->options.indexPath + ".tmp";
+        {
+          std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+          out.write((const char*) &header, sizeof(header));
+          out.write((const char*) documents.data(), documents.size() * sizeof(Document));
+          out.write((const char*) terms.data(), terms.size() * sizeof(Term));
+          out.write((const char*) flat.data(), flat.size() * sizeof(uint32_t));
+          out.write(strings.data(), strings.size());
+          if (!out) {
+            std::remove(tmpPath.c_str());
+            throw IOException(tfm::format("failed to write index %s", tmpPath));
+          }
+        }
+        if (std::rename(tmpPath.c_str(), this->options.indexPath.c_str()) != 0) {
+          throw IOException(tfm::format(
+              "failed to replace index %s, reason: %s",
+              this->options.indexPath, std::strerror(errno)));
+        }
+      }
+
+    public:
+      LibraryIndexer(IndexOptions options) :
+          options(options) {
+      }
+
+      /**
+       * Bring the index up to date with the archives under the paths and
+       * report what was done and how fast
+       */
+      void run(std::ostream& report) {
+        if (this->options.indexPath.empty()) {
+          throw Exception("nowhere to keep the index, pass one with --index");
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<Candidate> candidates = this->scan();
+        auto scanned = std::chrono::steady_clock::now();
+
+        // reuse what the old index knows about archives that haven't changed
+        std::vector<Candidate*> stale;
+        LibraryIndex* old = NULL;
+        try {
+          old = new LibraryIndex(this->options.indexPath);
+        } catch (IOException& e) {
+          // missing or from another version: read everything
+        }
+        for (Candidate& candidate : candidates) {
+          neither::Maybe<uint32_t> known = old == NULL
+              ? neither::Maybe<uint32_t>()
+              : old->find(candidate.path);
+          if (known.hasValue) {
+            const Document& document = old->getDocument(known.unsafeGet());
+            if (document.mtime == candidate.mtime && document.size == candidate.size) {
+              candidate.info = old->getInfo(known.unsafeGet());
+              continue;
+            }
+          }
+          stale.push_back(&candidate);
+        }
+        delete old;
+
+        int jobs = this->options.jobs > 0
+            ? this->options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+        WorkQueue<Candidate*> queue = WorkQueue<Candidate*>(jobs * 4);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+          workers.push_back(std::thread(&LibraryIndexer::work, this, &queue));
+        }
+        for (Candidate* candidate : stale) {
+          queue.push(candidate);
+        }
+        queue.close();
+        for (std::thread& worker : workers) {
+          worker.join();
+        }
+        auto read = std::chrono::steady_clock::now();
+
+        this->write(candidates);
+        auto written = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double> reading = read - scanned;
+        report << tfm::format(
+            "indexed %d archives, %d unchanged: read %d in %.2f s with %d workers, %.0f archives/s "
+            "(%d without ComicInfo.xml, %d unreadable); scan %.2f s, write %.2f s",
+            candidates.size(), candidates.size() - stale.size(), stale.size(), reading.count(), jobs,
+            stale.empty() ? 0.0 : stale.size() / reading.count(),
+            this->withoutInfo.load(), this->unreadable.load(),
+            std::chrono::duration<double>(scanned - start).count(),
+            std::chrono::duration<double>(written - read).count()) << std::endl;
+      }
+  };
+
+}
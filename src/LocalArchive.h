@@ -0,0 +1,135 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <libzippp.h>
+#include <tinyformat.h>
+#include "Archive.h"
+#include "Exception.h"
+
+namespace app {
+
+  /**
+   * An archive on the local file system, read through libzippp
+   */
+  class LocalArchive: public Archive {
+    private:
+      /**
+       * Passes what libzippp writes on to a consumer. Refusing a write
+       * fails the stream, which stops libzippp reading.
+       */
+      class ChunkBuffer: public std::streambuf {
+        private:
+          std::function<bool(const char*, size_t)> consume;
+
+        protected:
+          std::streamsize xsputn(const char* data, std::streamsize length) {
+            return this->consume(data, length) ? length : 0;
+          }
+
+          int overflow(int c) {
+            char byte = (char) c;
+            return c == traits_type::eof() || this->consume(&byte, 1) ? c : traits_type::eof();
+          }
+
+        public:
+          ChunkBuffer(std::function<bool(const char*, size_t)> consume) {
+            this->consume = consume;
+          }
+      };
+
+      libzippp::ZipArchive* file;
+
+    public:
+      LocalArchive(std::string path) {
+        this->file = new libzippp::ZipArchive(path);
+        this->file->open(libzippp::ZipArchive::READ_ONLY);
+      }
+
+      ~LocalArchive() {
+        this->file->close();
+        delete this->file;
+      }
+
+      std::vector<std::string> getNames() {
+        std::vector<std::string> names;
+        std::vector<libzippp::ZipEntry> entries = this->file->getEntries();
+        std::vector<libzippp::ZipEntry>::iterator it;
+        for (it = entries.begin(); it != entries.end(); ++it) {
+          libzippp::ZipEntry entry = *it;
+          names.push_back(entry.getName());
+        }
+        return names;
+      }
+
+      std::vector<ArchiveEntry> getEntries() {
+        std::vector<ArchiveEntry> entries;
+        for (libzippp::ZipEntry entry : this->file->getEntries()) {
+          // libzippp doesn't expose local header offsets
+          entries.push_back(ArchiveEntry {
+              entry.getName(),
+              entry.getIndex(),
+              0,
+              entry.getCompressedSize(),
+              entry.getSize() });
+        }
+        return entries;
+      }
+
+      uint32_t getCrc(const std::string& name) {
+        return (uint32_t) this->file->getEntry(name).getCRC();
+      }
+
+      std::vector<char> read(const std::string& name) {
+        libzippp::ZipEntry entry = this->file->getEntry(name);
+        int size = entry.getSize();
+        if (size == 0) {
+          return {};
+        }
+        char* binaryData = static_cast<char*>(entry.readAsBinary());
+        if (binaryData == NULL) {
+          throw IOException(tfm::format("failed to read %s", name));
+        }
+        std::vector<char> data(binaryData, binaryData + size);
+        delete[] binaryData;
+        return data;
+      }
+
+      std::vector<char> readPrefix(const std::string& name, size_t length) {
+        libzippp::ZipEntry entry = this->file->getEntry(name);
+        libzippp::libzippp_uint64 size = std::min<libzippp::libzippp_uint64>(entry.getSize(), length);
+        if (size == 0) {
+          return {};
+        }
+        char* binaryData = static_cast<char*>(
+            this->file->readEntry(entry, false, libzippp::ZipArchive::CURRENT, size));
+        if (binaryData == NULL) {
+          throw IOException(tfm::format("failed to read %s", name));
+        }
+        std::vector<char> data(binaryData, binaryData + size);
+        delete[] binaryData;
+        return data;
+      }
+
+      void readChunks(
+          const std::string& name,
+          size_t chunkSize,
+          std::function<bool(const char*, size_t)> consume) {
+        libzippp::ZipEntry entry = this->file->getEntry(name);
+        bool stopped = false;
+        ChunkBuffer buffer([&](const char* data, size_t length) {
+          stopped = !consume(data, length);
+          return !stopped;
+        });
+        std::ostream out(&buffer);
+        int result = this->file->readEntry(entry, out, libzippp::ZipArchive::CURRENT, chunkSize);
+        if (result != 0 && !stopped) {
+          throw IOException(tfm::format("failed to read %s", name));
+        }
+      }
+  };
+
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <tinyformat.h>
+#include "Allocations.h"
+
+namespace app {
+
+  /**
+   * Durations in microseconds, counted in log-linear buckets the way HDR
+   * histograms do: 32 buckets per power of two, so any value is reported
+   * within about 3% using a fixed 9 KiB of counters.
+   * Recording is a few atomic adds, safe from any thread.
+   */
+  class Histogram {
+    private:
+      static constexpr int SUB_BITS = 5;
+      static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+      // up to 2^40 us, about 12 days
+      static constexpr int BLOCKS = 40 - SUB_BITS + 1;
+      static constexpr int BUCKETS = BLOCKS * SUB_BUCKETS;
+
+      std::atomic<uint64_t> counts[BUCKETS];
+      std::atomic<uint64_t> count { 0 };
+      std::atomic<uint64_t> sum { 0 };
+      std::atomic<uint64_t> max { 0 };
+
+      static int bucketOf(uint64_t value) {
+        if (value < (uint64_t) SUB_BUCKETS) {
+          return value;
+        }
+        int magnitude = 63 - __builtin_clzll(value);
+        int block = magnitude - SUB_BITS + 1;
+        if (block >= BLOCKS) {
+          return BUCKETS - 1;
+        }
+        int mantissa = value >> (magnitude - SUB_BITS);
+        return block * SUB_BUCKETS + (mantissa - SUB_BUCKETS);
+      }
+
+      /**
+       * the middle of the values counted in a bucket
+       */
+      static double valueOf(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+          return bucket;
+        }
+        int block = bucket / SUB_BUCKETS;
+        uint64_t mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+        uint64_t low = mantissa << (block - 1);
+        uint64_t width = 1ull << (block - 1);
+        return low + (width - 1) / 2.0;
+      }
+
+    public:
+      Histogram() {
+        for (std::atomic<uint64_t>& bucket : this->counts) {
+          bucket = 0;
+        }
+      }
+
+      void record(uint64_t micros) {
+        this->counts[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        this->count.fetch_add(1, std::memory_order_relaxed);
+        this->sum.fetch_add(micros, std::memory_order_relaxed);
+        uint64_t seen = this->max.load(std::memory_order_relaxed);
+        while (micros > seen
+            && !this->max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+        }
+      }
+
+      void record(std::chrono::steady_clock::duration elapsed) {
+        this->record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+      }
+
+      uint64_t getCount() {
+        return this->count;
+      }
+
+      /**
+       * value at percentile p (0..100) in ms, 0 when empty
+       */
+      double percentile(double p) {
+        uint64_t total = this->count;
+        if (total == 0) {
+          return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t) (p / 100 * total + 0.5));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++) {
+          seen += this->counts[bucket];
+          if (seen >= rank) {
+            return std::min(valueOf(bucket), (double) this->max) / 1000;
+          }
+        }
+        return this->max / 1000.0;
+      }
+
+      double mean() {
+        uint64_t total = this->count;
+        return total == 0 ? 0 : this->sum / 1000.0 / total;
+      }
+
+      double maximum() {
+        return this->max / 1000.0;
+      }
+  };
+
+  /**
+   * Aggregate performance counters for the whole process, always on.
+   * Everything is recorded with relaxed atomics so the hot paths pay next
+   * to nothing; the numbers are only read for the report at exit.
+   */
+  class Metrics {
+    public:
+      enum Format { Jpeg, Png, Gif, Bmp, Webp, Tiff, Other, FORMATS };
+
+    private:
+      Metrics() {
+      }
+
+      static const char* nameOf(Format format) {
+        static const char* names[] = { "jpeg", "png", "gif", "bmp", "webp", "tiff", "other" };
+        return names[format];
+      }
+
+      static void row(std::ostream& out, std::string name, Histogram& histogram) {
+        out << tfm::format("  %-24s %8d %9.2f %9.2f %9.2f %9.2f %9.2f",
+            name, histogram.getCount(),
+            histogram.percentile(50), histogram.percentile(90), histogram.percentile(99),
+            histogram.percentile(99.9), histogram.maximum()) << std::endl;
+      }
+
+      static std::string json(Histogram& histogram) {
+        return tfm::format(
+            "{\"count\": %d, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+            histogram.getCount(), histogram.mean(),
+            histogram.percentile(50), histogram.percentile(90), histogram.percentile(99),
+            histogram.percentile(99.9), histogram.maximum());
+      }
+
+    public:
+      // input event to the frame showing the new spread being presented
+      Histogram pageTurn;
+      Histogram decode[FORMATS];
+      Histogram upload;
+      // composing one frame of an animated page
+      Histogram frameDecode;
+      std::atomic<uint64_t> bytesRead { 0 };
+      // reads sent to the disk for local archives, after batching
+      std::atomic<uint64_t> ioRequests { 0 };
+      std::atomic<uint64_t> cacheHits { 0 };
+      std::atomic<uint64_t> cacheMisses { 0 };
+      // pages found in the cache shared with other processes
+      std::atomic<uint64_t> sharedHits { 0 };
+      // frames of animated pages put on screen, skipped for being too late
+      // to show, and not decoded yet when due
+      std::atomic<uint64_t> framesShown { 0 };
+      std::atomic<uint64_t> framesDropped { 0 };
+      std::atomic<uint64_t> framesLate { 0 };
+
+      static Metrics& global() {
+        static Metrics metrics;
+        return metrics;
+      }
+
+      static Format formatOf(const char* name) {
+        for (int format = 0; format < Other; format++) {
+          if (name != NULL && std::string(name) == nameOf((Format) format)) {
+            return (Format) format;
+          }
+        }
+        return Other;
+      }
+
+      double cacheHitRatio() {
+        uint64_t lookups = this->cacheHits + this->cacheMisses;
+        return lookups == 0 ? 0 : (double) this->cacheHits / lookups;
+      }
+
+      void print(std::ostream& out) {
+        out << tfm::format("  %-24s %8s %9s %9s %9s %9s %9s",
+            "ms", "count", "p50", "p90", "p99", "p99.9", "max") << std::endl;
+        row(out, "page turn", this->pageTurn);
+        for (int format = 0; format < FORMATS; format++) {
+          if (this->decode[format].getCount() > 0) {
+            row(out, tfm::format("decode %s", nameOf((Format) format)), this->decode[format]);
+          }
+        }
+        row(out, "texture upload", this->upload);
+        if (this->frameDecode.getCount() > 0) {
+          row(out, "animation frame decode", this->frameDecode);
+        }
+        out << tfm::format("  %-24s %8.1f %%", "page cache hits", this->cacheHitRatio() * 100) << std::endl;
+        out << tfm::format("  %-24s %8.1f MiB", "read from archives", this->bytesRead / 1048576.0) << std::endl;
+        out << tfm::format("  %-24s %8d", "disk reads", this->ioRequests.load()) << std::endl;
+        out << tfm::format("  %-24s %8d", "shared cache hits", this->sharedHits.load()) << std::endl;
+        if (this->framesShown > 0) {
+          out << tfm::format("  %-24s %8d shown, %d dropped, %d late", "animation frames",
+              this->framesShown.load(), this->framesDropped.load(), this->framesLate.load()) << std::endl;
+        }
+        if (Allocations::isEnabled()) {
+          Allocations::global().print(out);
+        }
+      }
+
+      void writeJson(std::ostream& out) {
+        out << "{" << std::endl;
+        out << "  \"page_turn_ms\": " << json(this->pageTurn) << "," << std::endl;
+        out << "  \"decode_ms\": {";
+        bool first = true;
+        for (int format = 0; format < FORMATS; format++) {
+          if (this->decode[format].getCount() > 0) {
+            out << (first ? "" : ",") << std::endl
+                << tfm::format("    \"%s\": %s", nameOf((Format) format), json(this->decode[format]));
+            first = false;
+          }
+        }
+        out << std::endl << "  }," << std::endl;
+        out << "  \"texture_upload_ms\": " << json(this->upload) << "," << std::endl;
+        out << "  \"frame_decode_ms\": " << json(this->frameDecode) << "," << std::endl;
+        out << tfm::format("  \"animation_frames\": {\"shown\": %d, \"dropped\": %d, \"late\": %d},",
+            this->framesShown.load(), this->framesDropped.load(), this->framesLate.load()) << std::endl;
+        out << tfm::format("  \"page_cache\": {\"hits\": %d, \"misses\": %d, \"hit_ratio\": %.4f},",
+            this->cacheHits.load(), this->cacheMisses.load(), this->cacheHitRatio()) << std::endl;
+        out << tfm::format("  \"bytes_read\": %d,", this->bytesRead.load()) << std::endl;
+        out << tfm::format("  \"disk_reads\": %d,", this->ioRequests.load()) << std::endl;
+        out << tfm::format("  \"shared_cache_hits\": %d", this->sharedHits.load());
+        if (Allocations::isEnabled()) {
+          out << "," << std::endl << "  \"allocations\": ";
+          Allocations::global().writeJson(out);
+        }
+        out << std::endl;
+        out << "}" << std::endl;
+      }
+  };
+
+}
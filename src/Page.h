@@ -1,10 +1,17 @@
 #pragma once
 #include <string>
 #include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
 #include <SDL.h>
 #include <SDL_image.h>
 #include <tinyformat.h>
+#include <turbojpeg.h>
+#include "Allocations.h"
 #include "Exception.h"
+#include "Image.h"
+#include "Metrics.h"
 
 namespace app {
 
@@ -21,34 +28,103 @@ namespace app {
       }
   };
 
+  /**
+   * A page ready to draw.
+   * With a hardware renderer it is uploaded to a texture and the pixels
+   * aren't kept. With a software renderer the pixels are kept instead, for
+   * the window to scale itself.
+   * Planar and grey images become IYUV textures, converted to RGB first
+   * for renderers that can't create those.
+   */
   class Page {
     private:
-      SDL_Surface* surface;
-      SDL_Texture* texture;
+      SDL_Texture* texture = NULL;
+      std::shared_ptr<Image> pixels;
       SDL_Rect* src;
 
-    public:
+      /**
+       * An IYUV texture for a planar or grey image. Grey images get flat
+       * chroma planes for the upload only. Falls back to an RGB texture
+       * when the renderer can't make one.
+       */
+      SDL_Texture* uploadPlanar(SDL_Renderer* renderer, Image* image) {
+        // the planes come from JPEGs, which use full range BT.601; SDL
+        // would take them as limited range and crush blacks and whites
+        SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+        SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV,
+            SDL_TEXTUREACCESS_STATIC, image->getWidth(), image->getHeight());
+        if (texture != NULL) {
+          int updated;
+          if (image->getKind() == Image::Kind::Grey) {
+            int chromaPitch = (image->getWidth() + 1) / 2;
+            std::vector<uint8_t> neutral((size_t) chromaPitch * ((image->getHeight() + 1) / 2), 128);
+            updated = SDL_UpdateYUVTexture(texture, NULL,
+                image->plane(0), image->pitch(0),
+                neutral.data(), chromaPitch,
+                neutral.data(), chromaPitch);
+          } else {
+            updated = SDL_UpdateYUVTexture(texture, NULL,
+                image->plane(0), image->pitch(0),
+                image->plane(1), image->pitch(1),
+                image->plane(2), image->pitch(2));
+          }
+          if (updated == 0) {
+            return texture;
+          }
+          SDL_DestroyTexture(texture);
+        }
+        SDL_Surface* converted = image->toSurface();
+        texture = SDL_CreateTextureFromSurface(renderer, converted);
+        SDL_FreeSurface(converted);
+        return texture;
+      }
 
-      Page(SDL_Renderer* renderer, SDL_Surface* surface) {
-        this->surface = surface;
-        this->texture = SDL_CreateTextureFromSurface(renderer, surface);
-        if (this->texture == NULL) {
-          SDL_FreeSurface(this->surface);
-          throw ImageOpenException(tfm::format(
-              "Failed to create surface, reason: %s",
-              SDL_GetError()));
+      void upload(SDL_Renderer* renderer, std::shared_ptr<Image> image) {
+        AllocationTag tag(Allocations::Texture);
+        SDL_RendererInfo info;
+        if (SDL_GetRendererInfo(renderer, &info) == 0
+            && (info.flags & SDL_RENDERER_SOFTWARE) != 0) {
+          this->pixels = image;
+        } else {
+          auto start = std::chrono::steady_clock::now();
+          this->texture = image->getKind() == Image::Kind::Surface
+              ? SDL_CreateTextureFromSurface(renderer, image->getSurface())
+              : this->uploadPlanar(renderer, image.get());
+          Metrics::global().upload.record(std::chrono::steady_clock::now() - start);
+          if (this->texture == NULL) {
+            throw ImageOpenException(tfm::format(
+                "Failed to create surface, reason: %s",
+                SDL_GetError()));
+          }
         }
 
         this->src = new SDL_Rect();
         this->src->x = 0;
         this->src->y = 0;
-        this->src->w = this->surface->w;
-        this->src->h = this->surface->h;
+        this->src->w = image->getWidth();
+        this->src->h = image->getHeight();
+      }
+
+    public:
+
+      /**
+       * Takes ownership of the surface
+       */
+      Page(SDL_Renderer* renderer, SDL_Surface* surface) :
+          Page(renderer, std::make_shared<Image>(surface)) {
+      }
+
+      /**
+       * Share an image that stays in a cache
+       */
+      Page(SDL_Renderer* renderer, std::shared_ptr<Image> image) {
+        this->upload(renderer, image);
       }
 
       ~Page() {
-        SDL_DestroyTexture(this->texture);
-        SDL_FreeSurface(this->surface);
+        if (this->texture != NULL) {
+          SDL_DestroyTexture(this->texture);
+        }
         delete this->src;
       }
 
@@ -65,23 +141,111 @@ namespace app {
       }
 
       static Page* fromMemory(SDL_Renderer* renderer, void* memory, size_t length) {
+        SDL_Surface* surface;
+        try {
+          surface = decode(memory, length);
+        } catch (ImageOpenException& e) {
+          delete[] static_cast<char*>(memory);
+          throw;
+        }
+
+        return new Page(renderer, surface);
+      }
+
+      /**
+       * Decode an encoded image into a surface without touching a renderer,
+       * so it is safe to call from a background thread.
+       * The caller keeps ownership of memory.
+       */
+      static SDL_Surface* decode(const void* memory, size_t length) {
         SDL_RWops* mem = SDL_RWFromConstMem(memory, length);
-        SDL_Surface* surface = IMG_Load_RW(mem, 0);
+        SDL_Surface* surface = IMG_Load_RW(mem, 1);
         if (surface == NULL) {
-          delete[] memory;
           const char* reason = IMG_GetError();
           throw ImageOpenException(tfm::format(
               "Failed to open surface from memory, reason: %s",
               reason));
         }
+        return surface;
+      }
+
+      /**
+       * Decode a JPEG straight to its 4:2:0 YCbCr planes, skipping the
+       * conversion to RGB. Greyscale JPEGs, and colour ones whose chroma
+       * is flat, keep only the Y plane.
+       * NULL for anything else, including other chroma subsamplings, for
+       * the caller to decode to a surface instead.
+       * Safe to call from a background thread.
+       */
+      static Image* decodePlanar(const void* memory, size_t length) {
+        struct Decompressor {
+          tjhandle handle = tjInitDecompress();
+
+          ~Decompressor() {
+            if (this->handle != NULL) {
+              tjDestroy(this->handle);
+            }
+          }
+        };
+        thread_local Decompressor decompressor;
+        if (decompressor.handle == NULL) {
+          return NULL;
+        }
 
+        const unsigned char* jpeg = (const unsigned char*) memory;
+        int width = 0;
+        int height = 0;
+        int subsampling = 0;
+        int colorspace = 0;
+        if (tjDecompressHeader3(decompressor.handle, jpeg, length,
+            &width, &height, &subsampling, &colorspace) != 0
+            || (subsampling != TJSAMP_420 && subsampling != TJSAMP_GRAY)) {
+          return NULL;
+        }
+
+        Image* image = new Image(width, height,
+            subsampling == TJSAMP_GRAY ? Image::Kind::Grey : Image::Kind::Planar);
+        unsigned char* planes[3] = { image->plane(0), image->plane(1), image->plane(2) };
+        int strides[3] = { image->pitch(0), image->pitch(1), image->pitch(2) };
+        if (tjDecompressToYUVPlanes(decompressor.handle, jpeg, length,
+            planes, width, strides, height, 0) != 0) {
+          delete image;
+          return NULL;
+        }
+        image->dropNeutralChroma();
+        return image;
+      }
+
+      /**
+       * A flat page standing in for one that could not be read.
+       * Tiny, the renderer stretches it to whatever the layout asks for.
+       */
+      static Page* placeholder(SDL_Renderer* renderer) {
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(
+            0, 20, 30, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (surface == NULL) {
+          throw ImageOpenException(tfm::format(
+              "Failed to create placeholder, reason: %s",
+              SDL_GetError()));
+        }
+        SDL_FillRect(surface, NULL, SDL_MapRGB(surface->format, 0x40, 0x10, 0x10));
         return new Page(renderer, surface);
       }
 
+      /**
+       * NULL with a software renderer
+       */
       SDL_Texture* getTexture() {
         return this->texture;
       }
 
+      /**
+       * NULL with a hardware renderer
+       */
+      std::shared_ptr<Image> getPixels() {
+        return this->pixels;
+      }
+
       SDL_Rect* getSrc() {
         return this->src;
       }
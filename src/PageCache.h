@@ -0,0 +1,193 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <SDL.h>
+#include "Image.h"
+
+namespace app {
+
+  struct PageKey {
+    uint64_t book;
+    size_t page;
+
+    bool operator==(const PageKey& other) const {
+      return this->book == other.book && this->page == other.page;
+    }
+  };
+
+  struct PageKeyHash {
+    size_t operator()(const PageKey& key) const {
+      // splitmix64 finaliser, so neighbouring pages land in different shards
+      uint64_t x = key.book * 0x9e3779b97f4a7c15ull + key.page;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+      return x ^ (x >> 31);
+    }
+  };
+
+  /**
+   * Decoded pages of every open book, kept under one memory budget.
+   *
+   * The cache is split into shards with a lock each, so lookups from the
+   * windows and inserts from the decode workers only contend when they hit
+   * the same shard. Every shard keeps its own LRU order; when an insert puts
+   * the cache over budget, shards are visited in turn and their least
+   * recently used page dropped until it fits again. No two shard locks are
+   * ever held at once.
+   *
+   * Images are handed out shared, so a page evicted while a window is
+   * uploading it stays alive until the upload is done.
+   */
+  class PageCache {
+    private:
+      static constexpr size_t SHARDS = 16;
+
+      struct Entry {
+        std::shared_ptr<Image> image;
+        size_t bytes;
+        std::list<PageKey>::iterator age;
+      };
+
+      struct Shard {
+        std::mutex lock;
+        // most recently used first
+        std::list<PageKey> lru;
+        std::unordered_map<PageKey, Entry, PageKeyHash> entries;
+      };
+
+      Shard shards[SHARDS];
+      std::atomic<size_t> budget;
+      std::atomic<size_t> used { 0 };
+      std::atomic<size_t> nextVictim { 0 };
+      std::atomic<size_t> hits { 0 };
+      std::atomic<size_t> misses { 0 };
+      std::atomic<size_t> evictions { 0 };
+
+      Shard& shardOf(const PageKey& key) {
+        return this->shards[PageKeyHash()(key) % SHARDS];
+      }
+
+      void remove(Shard& shard, std::unordered_map<PageKey, Entry, PageKeyHash>::iterator it) {
+        this->used -= it->second.bytes;
+        shard.lru.erase(it->second.age);
+        shard.entries.erase(it);
+      }
+
+      /**
+       * drop least recently used pages until the cache fits its budget, or
+       * every shard is empty
+       */
+      void evict() {
+        size_t empty = 0;
+        while (this->used > this->budget && empty < SHARDS) {
+          Shard& shard = this->shards[this->nextVictim++ % SHARDS];
+          std::lock_guard<std::mutex> guard(shard.lock);
+          if (shard.lru.empty()) {
+            empty++;
+            continue;
+          }
+          empty = 0;
+          this->remove(shard, shard.entries.find(shard.lru.back()));
+          this->evictions++;
+        }
+      }
+
+    public:
+      PageCache(size_t budget) :
+          budget(budget) {
+      }
+
+      /**
+       * The image for a page, or NULL.
+       * Safe to call from any thread.
+       */
+      std::shared_ptr<Image> get(const PageKey& key) {
+        Shard& shard = this->shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+          this->misses++;
+          return NULL;
+        }
+        this->hits++;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.age);
+        return it->second.image;
+      }
+
+      bool contains(const PageKey& key) {
+        Shard& shard = this->shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.entries.count(key) > 0;
+      }
+
+      /**
+       * Cache a decoded page, taking ownership of the image.
+       * If another thread cached the page first, that copy wins and is
+       * returned, and this one is freed.
+       */
+      std::shared_ptr<Image> put(const PageKey& key, Image* image) {
+        std::shared_ptr<Image> shared;
+        {
+          Shard& shard = this->shardOf(key);
+          std::lock_guard<std::mutex> guard(shard.lock);
+          auto it = shard.entries.find(key);
+          if (it != shard.entries.end()) {
+            delete image;
+            return it->second.image;
+          }
+          shared = std::shared_ptr<Image>(image);
+          shard.lru.push_front(key);
+          shard.entries[key] = Entry { shared, image->bytes(), shard.lru.begin() };
+          this->used += image->bytes();
+        }
+        this->evict();
+        return shared;
+      }
+
+      /**
+       * Forget every page of a book, when it is closed
+       */
+      void drop(uint64_t book) {
+        for (Shard& shard : this->shards) {
+          std::lock_guard<std::mutex> guard(shard.lock);
+          for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            auto next = std::next(it);
+            if (it->first.book == book) {
+              this->remove(shard, it);
+            }
+            it = next;
+          }
+        }
+      }
+
+      void setBudget(size_t budget) {
+        this->budget = budget;
+        this->evict();
+      }
+
+      size_t getBudget() {
+        return this->budget;
+      }
+
+      size_t getUsed() {
+        return this->used;
+      }
+
+      size_t getHits() {
+        return this->hits;
+      }
+
+      size_t getMisses() {
+        return this->misses;
+      }
+
+      size_t getEvictions() {
+        return this->evictions;
+      }
+  };
+
+}
@@ -0,0 +1,358 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <neither.h>
+#include "Archive.h"
+
+namespace app {
+
+  /**
+   * The pages of a book in reading order: only the entries that are
+   * images, sorted naturally, so page2 comes before page10.
+   *
+   * Built for archives with tens of thousands of entries: names and their
+   * sort keys live in two flat arenas rather than a string each, and every
+   * other field is a column of its own. Sorting moves 32 bit indices, not
+   * strings.
+   *
+   * A sort key is the name with ASCII letters folded to lower case and
+   * every run of digits replaced by '0', the count of its significant
+   * digits, then those digits. Comparing keys bytewise then compares
+   * numbers by value, and everything else like the name itself. Names
+   * whose keys tie, like 01 and 1, fall back to comparing the names.
+   */
+  class PageTable {
+    public:
+      enum class Kind { Image, NotImage, Unknown };
+
+    private:
+      std::vector<char> nameArena;
+      std::vector<uint32_t> nameAt;
+      std::vector<uint16_t> nameLength;
+      std::vector<char> keyArena;
+      std::vector<uint32_t> keyAt;
+      std::vector<uint32_t> keyLength;
+      std::vector<uint32_t> entries;
+      std::vector<uint64_t> offsets;
+      std::vector<uint64_t> compressedSizes;
+      std::vector<uint64_t> sizes;
+      // 0 until the page is decoded
+      std::vector<uint16_t> widths;
+      std::vector<uint16_t> heights;
+
+      std::string_view nameOf(size_t page) const {
+        return std::string_view(this->nameArena.data() + this->nameAt[page], this->nameLength[page]);
+      }
+
+      std::string_view keyOf(size_t page) const {
+        return std::string_view(this->keyArena.data() + this->keyAt[page], this->keyLength[page]);
+      }
+
+      template<typename T>
+      static void permute(std::vector<T>& column, const std::vector<uint32_t>& order) {
+        std::vector<T> sorted;
+        sorted.reserve(column.size());
+        for (uint32_t from : order) {
+          sorted.push_back(column[from]);
+        }
+        column.swap(sorted);
+      }
+
+      static bool endsWith(std::string_view name, const char* suffix) {
+        size_t length = std::strlen(suffix);
+        return name.size() >= length
+            && std::equal(name.end() - length, name.end(), suffix, [](char a, char b) {
+              return std::tolower((unsigned char) a) == b;
+            });
+      }
+
+      /**
+       * 8 bytes of a key from at, big endian so they compare like the key
+       */
+      uint64_t prefixOf(size_t page, size_t at) const {
+        std::string_view key = this->keyOf(page);
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; i++) {
+          prefix <<= 8;
+          if (at + i < key.size()) {
+            prefix |= (unsigned char) key[at + i];
+          }
+        }
+        return prefix;
+      }
+
+    public:
+      /**
+       * Whether an entry is a page, going by its name alone.
+       * Unknown for names without a known extension: only the data can tell.
+       */
+      static Kind classify(const std::string& name) {
+        if (name.empty() || name.back() == '/') {
+          return Kind::NotImage;
+        }
+        // resource forks macOS adds to archives it creates, named like the
+        // image they belong to
+        size_t slash = name.rfind('/');
+        std::string_view base = std::string_view(name).substr(slash == std::string::npos ? 0 : slash + 1);
+        if (name.compare(0, 9, "__MACOSX/") == 0 || base.compare(0, 2, "._") == 0) {
+          return Kind::NotImage;
+        }
+
+        for (const char* extension : { ".jpg", ".jpeg", ".jpe", ".png", ".gif",
+            ".bmp", ".webp", ".tif", ".tiff" }) {
+          if (endsWith(base, extension)) {
+            return Kind::Image;
+          }
+        }
+        if (base.find('.') == std::string::npos) {
+          return Kind::Unknown;
+        }
+        return Kind::NotImage;
+      }
+
+      /**
+       * how many leading bytes imageFormat needs to tell every format apart
+       */
+      static constexpr size_t MAGIC_SIZE = 12;
+
+      /**
+       * the format data is encoded in going by its first bytes, like
+       * "jpeg", NULL if it isn't one we can decode
+       */
+      static const char* imageFormat(const char* data, size_t length) {
+        const unsigned char* bytes = (const unsigned char*) data;
+        auto starts = [&](const char* magic, size_t size, size_t at = 0) {
+          return length >= at + size && std::memcmp(bytes + at, magic, size) == 0;
+        };
+        if (starts("\xff\xd8\xff", 3)) {
+          return "jpeg";
+        } else if (starts("\x89PNG\r\n\x1a\n", 8)) {
+          return "png";
+        } else if (starts("GIF87a", 6) || starts("GIF89a", 6)) {
+          return "gif";
+        } else if (starts("BM", 2)) {
+          return "bmp";
+        } else if (starts("RIFF", 4) && starts("WEBP", 4, 8)) {
+          return "webp";
+        } else if (starts("II*\0", 4) || starts("MM\0*", 4)) {
+          return "tiff";
+        }
+        return NULL;
+      }
+
+      /**
+       * whether data starts like one of the image formats we can decode
+       */
+      static bool hasImageMagic(const char* data, size_t length) {
+        return imageFormat(data, length) != NULL;
+      }
+
+      static void appendNaturalKey(const char* name, size_t length, std::vector<char>& key) {
+        for (size_t i = 0; i < length;) {
+          unsigned char c = name[i];
+          if (!std::isdigit(c)) {
+            key.push_back(c < 0x80 ? std::tolower(c) : c);
+            i++;
+            continue;
+          }
+          size_t start = i;
+          while (start < length && name[start] == '0') {
+            start++;
+          }
+          size_t end = start;
+          while (end < length && std::isdigit((unsigned char) name[end])) {
+            end++;
+          }
+          // a run of zeros is the number 0, one significant digit
+          if (start == end) {
+            start--;
+          }
+          size_t digits = std::min(end - start, (size_t) 255);
+          key.push_back('0');
+          key.push_back((char) digits);
+          key.insert(key.end(), name + start, name + start + digits);
+          i = end;
+        }
+      }
+
+      static std::string naturalKey(const std::string& name) {
+        std::vector<char> key;
+        appendNaturalKey(name.data(), name.size(), key);
+        return std::string(key.begin(), key.end());
+      }
+
+      void reserve(size_t entries) {
+        this->nameAt.reserve(entries);
+        this->nameLength.reserve(entries);
+        this->keyAt.reserve(entries);
+        this->keyLength.reserve(entries);
+        this->entries.reserve(entries);
+        this->offsets.reserve(entries);
+        this->compressedSizes.reserve(entries);
+        this->sizes.reserve(entries);
+      }
+
+      /**
+       * Append a page. Call sort once everything is added.
+       */
+      void add(const ArchiveEntry& entry) {
+        this->nameAt.push_back(this->nameArena.size());
+        this->nameLength.push_back(entry.name.size());
+        this->nameArena.insert(this->nameArena.end(), entry.name.begin(), entry.name.end());
+
+        size_t keyStart = this->keyArena.size();
+        appendNaturalKey(entry.name.data(), entry.name.size(), this->keyArena);
+        this->keyAt.push_back(keyStart);
+        this->keyLength.push_back(this->keyArena.size() - keyStart);
+
+        this->entries.push_back(entry.index);
+        this->offsets.push_back(entry.offset);
+        this->compressedSizes.push_back(entry.compressedSize);
+        this->sizes.push_back(entry.size);
+        this->widths.push_back(0);
+        this->heights.push_back(0);
+      }
+
+      /**
+       * Put the pages in natural order.
+       * Names in an archive mostly share a directory prefix, so the sort
+       * skips the prefix all keys have in common and compares the next 8
+       * bytes as one integer, only going to the arena on a tie.
+       */
+      void sort() {
+        size_t common = this->size() == 0 ? 0 : this->keyLength[0];
+        for (size_t page = 1; page < this->size() && common > 0; page++) {
+          std::string_view first = this->keyOf(0);
+          std::string_view key = this->keyOf(page);
+          size_t same = 0;
+          size_t limit = std::min(common, key.size());
+          while (same < limit && first[same] == key[same]) {
+            same++;
+          }
+          common = same;
+        }
+
+        std::vector<std::pair<uint64_t, uint32_t>> ranked;
+        ranked.reserve(this->size());
+        for (size_t page = 0; page < this->size(); page++) {
+          ranked.push_back(std::make_pair(this->prefixOf(page, common), page));
+        }
+        std::sort(ranked.begin(), ranked.end(),
+            [&](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+              if (a.first != b.first) {
+                return a.first < b.first;
+              }
+              int compared = this->keyOf(a.second).compare(this->keyOf(b.second));
+              return compared != 0 ? compared < 0 : this->nameOf(a.second) < this->nameOf(b.second);
+            });
+        std::vector<uint32_t> order;
+        order.reserve(ranked.size());
+        for (auto entry : ranked) {
+          order.push_back(entry.second);
+        }
+
+        permute(this->nameAt, order);
+        permute(this->nameLength, order);
+        permute(this->keyAt, order);
+        permute(this->keyLength, order);
+        permute(this->entries, order);
+        permute(this->offsets, order);
+        permute(this->compressedSizes, order);
+        permute(this->sizes, order);
+        permute(this->widths, order);
+        permute(this->heights, order);
+        this->nameArena.shrink_to_fit();
+        this->keyArena.shrink_to_fit();
+      }
+
+      size_t size() const {
+        return this->nameAt.size();
+      }
+
+      /**
+       * throws std::out_of_range past the last page, like vector::at
+       */
+      std::string getName(size_t page) const {
+        this->nameAt.at(page);
+        return std::string(this->nameOf(page));
+      }
+
+      std::vector<std::string> getNames() const {
+        std::vector<std::string> names;
+        names.reserve(this->size());
+        for (size_t page = 0; page < this->size(); page++) {
+          names.push_back(std::string(this->nameOf(page)));
+        }
+        return names;
+      }
+
+      /**
+       * the page stored under an entry name
+       */
+      neither::Maybe<size_t> find(const std::string& name) const {
+        std::string key = naturalKey(name);
+        size_t low = 0;
+        size_t high = this->size();
+        while (low < high) {
+          size_t middle = (low + high) / 2;
+          int compared = this->keyOf(middle).compare(key);
+          if (compared < 0 || (compared == 0 && this->nameOf(middle) < name)) {
+            low = middle + 1;
+          } else {
+            high = middle;
+          }
+        }
+        if (low < this->size() && this->nameOf(low) == name) {
+          return { low };
+        }
+        return {};
+      }
+
+      uint32_t getEntry(size_t page) const {
+        return this->entries[page];
+      }
+
+      uint64_t getOffset(size_t page) const {
+        return this->offsets[page];
+      }
+
+      uint64_t getCompressedSize(size_t page) const {
+        return this->compressedSizes[page];
+      }
+
+      uint64_t getSize(size_t page) const {
+        return this->sizes[page];
+      }
+
+      /**
+       * Remember a page's size once decoded. Different pages may be set
+       * from different threads.
+       */
+      void setDimensions(size_t page, int width, int height) {
+        this->widths[page] = std::min(width, 0xffff);
+        this->heights[page] = std::min(height, 0xffff);
+      }
+
+      /**
+       * width and height, 0 and 0 while unknown
+       */
+      std::pair<int, int> getDimensions(size_t page) const {
+        return std::make_pair(this->widths[page], this->heights[page]);
+      }
+
+      /**
+       * memory held, for comparing against a vector of strings
+       */
+      size_t bytes() const {
+        return this->nameArena.capacity() + this->keyArena.capacity()
+            + this->size() * (sizeof(uint32_t) * 4 + sizeof(uint16_t) * 3 + sizeof(uint64_t) * 3);
+      }
+  };
+
+}
@@ -0,0 +1,272 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <utility>
+#include <vector>
+#include <tinyformat.h>
+
+namespace app {
+
+  struct PrefetchOptions {
+    // pages decoded ahead per navigation, per window
+    size_t budget = 6;
+    // print hit rate and wasted work when the window closes
+    bool report = false;
+  };
+
+  /**
+   * Decides which pages to decode ahead from how this reader moves.
+   *
+   * Every page turn is classified as forward, back, a parity shift or a
+   * jump, and counted in a table for the current reading direction and
+   * parity, with older turns decaying away. The chance of each move
+   * predicts where the reader goes next; chaining forward or back moves
+   * predicts further, and the reader's dwell time against the decode time
+   * decides how many moves ahead are worth looking. A jump predicts a jump
+   * back to where it came from.
+   *
+   * Candidate spreads are ranked by probability and pages taken from the
+   * top until the budget is spent.
+   *
+   * Records how often the shown spread was predicted, how often it was
+   * already decoded, and how much prefetch decoding was never shown.
+   */
+  class PrefetchPlanner {
+    private:
+      enum Move { Forward, Back, Parity, Jump, MOVES };
+      // how much one turn weighs against the last ~10
+      static constexpr double DECAY = 0.9;
+      // weight of the newest sample in the dwell and decode time averages
+      static constexpr double SMOOTHING = 0.3;
+      static constexpr int MAX_STEPS = 8;
+
+      size_t budget;
+      size_t pages;
+      // [leftToRight][parity][move], starts out expecting a forward reader
+      double counts[2][2][MOVES];
+      int jumpedFrom = -1;
+      double dwellMs = 0;
+      double decodeMs = 0;
+      std::chrono::steady_clock::time_point lastMove;
+      bool moved = false;
+
+      std::mutex lock;
+      std::set<size_t> planned;
+      // pages decoded by prefetch -> ms spent, and which of them were shown
+      std::map<size_t, double> prefetched;
+      std::set<size_t> used;
+      size_t navigations = 0;
+      size_t predicted = 0;
+      size_t pagesShown = 0;
+      size_t pagesReady = 0;
+
+      static Move classify(int from, int to) {
+        if (to == from + 2) {
+          return Forward;
+        } else if (to == from - 2) {
+          return Back;
+        } else if (to == from + 1 || to == from - 1) {
+          return Parity;
+        }
+        return Jump;
+      }
+
+      double* table(int page, bool leftToRight) {
+        return this->counts[leftToRight ? 1 : 0][page % 2 == 0 ? 0 : 1];
+      }
+
+      double probability(int page, bool leftToRight, Move move) {
+        double* counts = this->table(page, leftToRight);
+        double total = 0;
+        for (int i = 0; i < MOVES; i++) {
+          total += counts[i];
+        }
+        return counts[move] / total;
+      }
+
+      /**
+       * how many turns the reader can make while one page decodes, plus
+       * the one coming up
+       */
+      int steps(double decodeMs) {
+        if (this->dwellMs <= 0 || decodeMs <= 0) {
+          return 1;
+        }
+        return std::min(MAX_STEPS, 1 + (int) std::ceil(decodeMs * 2 / this->dwellMs));
+      }
+
+    public:
+      PrefetchPlanner(size_t pages, size_t budget) {
+        this->pages = pages;
+        this->budget = budget;
+        for (auto& direction : this->counts) {
+          for (auto& parity : direction) {
+            parity[Forward] = 4;
+            parity[Back] = 1;
+            parity[Parity] = 0.25;
+            parity[Jump] = 0.25;
+          }
+        }
+      }
+
+      /**
+       * The book has this many pages now, after a growing archive got more
+       */
+      void resized(size_t pages) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->pages = pages;
+      }
+
+      /**
+       * Learn from one key press. Presses that didn't turn the page, like
+       * swapping direction, only change the context of the next plan.
+       */
+      void navigated(int from, int to, bool leftToRight) {
+        if (from == to) {
+          return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (this->moved) {
+          double dwell = std::chrono::duration<double, std::milli>(now - this->lastMove).count();
+          this->dwellMs = this->dwellMs <= 0
+              ? dwell
+              : this->dwellMs * (1 - SMOOTHING) + dwell * SMOOTHING;
+        }
+        this->moved = true;
+        this->lastMove = now;
+
+        Move move = classify(from, to);
+        double* counts = this->table(from, leftToRight);
+        for (int i = 0; i < MOVES; i++) {
+          counts[i] *= DECAY;
+        }
+        counts[move] += 1;
+        if (move == Jump) {
+          this->jumpedFrom = from;
+        }
+      }
+
+      /**
+       * Pages to decode ahead of the spread starting at page, most likely
+       * first, at most the budget
+       */
+      std::vector<size_t> plan(int page, bool leftToRight) {
+        double forward = this->probability(page, leftToRight, Forward);
+        double back = this->probability(page, leftToRight, Back);
+        double parity = this->probability(page, leftToRight, Parity);
+        double jump = this->probability(page, leftToRight, Jump);
+
+        // spread start -> chance of being shown soon
+        std::map<int, double> candidates;
+        auto consider = [&](int spread, double chance) {
+          if (spread < 0 || spread >= (int) this->pages || spread == page) {
+            return;
+          }
+          candidates[spread] = std::max(candidates[spread], chance);
+        };
+        double decodeMs;
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          decodeMs = this->decodeMs;
+        }
+        double ahead = 1;
+        double behind = 1;
+        for (int step = 1; step <= this->steps(decodeMs); step++) {
+          ahead *= forward;
+          behind *= back;
+          consider(page + 2 * step, ahead);
+          consider(page - 2 * step, behind);
+        }
+        int shifted = page % 2 == 0 ? page + 1 : page - 1;
+        consider(shifted, parity);
+        consider(shifted + 2, parity * forward);
+        if (this->jumpedFrom >= 0) {
+          consider(this->jumpedFrom, jump);
+        }
+
+        std::vector<std::pair<int, double>> ranked(candidates.begin(), candidates.end());
+        std::stable_sort(ranked.begin(), ranked.end(),
+            [](const std::pair<int, double>& a, const std::pair<int, double>& b) {
+              return a.second > b.second;
+            });
+
+        std::vector<size_t> wanted;
+        for (auto entry : ranked) {
+          for (int p : { entry.first, entry.first + 1 }) {
+            if (wanted.size() < this->budget && p < (int) this->pages
+                && std::find(wanted.begin(), wanted.end(), p) == wanted.end()) {
+              wanted.push_back(p);
+            }
+          }
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->planned = std::set<size_t>(wanted.begin(), wanted.end());
+        return wanted;
+      }
+
+      /**
+       * A prefetched page finished decoding. Called from the decode threads.
+       */
+      void decoded(size_t page, double ms) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->decodeMs = this->decodeMs <= 0
+            ? ms
+            : this->decodeMs * (1 - SMOOTHING) + ms * SMOOTHING;
+        this->prefetched[page] += ms;
+      }
+
+      /**
+       * The spread starting at page is on screen
+       */
+      void shown(int page) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->moved) {
+          this->navigations++;
+          if (this->planned.count(page) > 0) {
+            this->predicted++;
+          }
+        }
+        for (int p : { page, page + 1 }) {
+          if (p < 0 || p >= (int) this->pages) {
+            continue;
+          }
+          this->pagesShown++;
+          if (this->prefetched.count(p) > 0) {
+            this->pagesReady++;
+            this->used.insert(p);
+          }
+        }
+      }
+
+      void report(std::ostream& out) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        size_t wasted = 0;
+        double wastedMs = 0;
+        double totalMs = 0;
+        for (auto entry : this->prefetched) {
+          totalMs += entry.second;
+          if (this->used.count(entry.first) == 0) {
+            wasted++;
+            wastedMs += entry.second;
+          }
+        }
+        out << tfm::format("  %-24s %8d", "page turns", this->navigations) << std::endl;
+        out << tfm::format("  %-24s %8.1f %%", "predicted",
+            this->navigations == 0 ? 0.0 : 100.0 * this->predicted / this->navigations) << std::endl;
+        out << tfm::format("  %-24s %8.1f %%", "pages already decoded",
+            this->pagesShown == 0 ? 0.0 : 100.0 * this->pagesReady / this->pagesShown) << std::endl;
+        out << tfm::format("  %-24s %8d", "pages prefetched", this->prefetched.size()) << std::endl;
+        out << tfm::format("  %-24s %8d", "prefetched, never shown", wasted) << std::endl;
+        out << tfm::format("  %-24s %8.1f ms of %.1f ms", "wasted decode", wastedMs, totalMs) << std::endl;
+        out << tfm::format("  %-24s %8.1f ms", "mean dwell", this->dwellMs) << std::endl;
+        out << tfm::format("  %-24s %8.1f ms", "mean decode", this->decodeMs) << std::endl;
+      }
+  };
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace app {
+
+  /**
+   * Random access to the bytes of a remote archive.
+   * Each call may be a network round trip, so callers should ask for large
+   * ranges rather than many small ones.
+   */
+  class RangeSource {
+    public:
+      virtual ~RangeSource() {
+      }
+
+      /**
+       * total size of the resource in bytes
+       */
+      virtual uint64_t size() = 0;
+
+      /**
+       * read exactly [offset, offset + length)
+       */
+      virtual std::vector<char> read(uint64_t offset, uint64_t length) = 0;
+
+      /**
+       * Read up to the last length bytes, setting offset to where they start.
+       * Sources that can learn the size and the tail in one round trip should
+       * override this.
+       */
+      virtual std::vector<char> readTail(uint64_t length, uint64_t* offset) {
+        uint64_t total = this->size();
+        uint64_t count = std::min(length, total);
+        *offset = total - count;
+        return this->read(*offset, count);
+      }
+
+      /**
+       * number of requests made so far
+       */
+      virtual size_t requests() {
+        return 0;
+      }
+  };
+
+}
@@ -0,0 +1,299 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <tinyformat.h>
+#include "Archive.h"
+#include "BlockCache.h"
+#include "Exception.h"
+#include "RangeSource.h"
+#include "Zip.h"
+
+namespace app {
+
+  /**
+   * An archive read over range requests without downloading it.
+   *
+   * Opening fetches the tail of the file, which normally holds the end of
+   * central directory record and the whole central directory, in one round
+   * trip. Reading a page fetches it together with its spread neighbours in
+   * one coalesced request, and schedules read-ahead in reading order on a
+   * second connection. The read-ahead window doubles while the reader keeps
+   * turning pages in the same direction and shrinks back on a jump.
+   */
+  class RemoteArchive: public Archive {
+    private:
+      // large enough for the central directory of a few thousand entries
+      static constexpr uint64_t TAIL_SIZE = 256 * 1024;
+      static constexpr uint64_t MIN_READ_AHEAD = 2 * 1024 * 1024;
+      static constexpr uint64_t MAX_READ_AHEAD = 32 * 1024 * 1024;
+
+      RangeSource* foreground;
+      RangeSource* background;
+      BlockCache* cache;
+      std::vector<zip::Entry> entries;
+      std::unordered_map<std::string, size_t> byName;
+      // end of each entry's bytes: the next local header or the directory
+      std::vector<uint64_t> spanEnd;
+      // reading position -> entry, and back; npos for unlisted entries
+      std::vector<size_t> order;
+      std::vector<size_t> position;
+      static constexpr size_t npos = -1;
+
+      long lastSpread = -1;
+      int direction = 1;
+      uint64_t window = MIN_READ_AHEAD;
+
+      std::thread readAhead;
+      std::mutex lock;
+      std::condition_variable wake;
+      std::vector<std::pair<uint64_t, uint64_t>> plan;
+      uint64_t generation = 0;
+      bool stopping = false;
+
+      void open() {
+        uint64_t tailOffset;
+        std::vector<char> tail = this->cache->readTail(TAIL_SIZE, &tailOffset);
+
+        uint64_t zip64Offset;
+        zip::CentralDirectory directory = zip::readEndOfCentralDirectory(
+            tail, tailOffset, &zip64Offset);
+        if (zip64Offset != 0) {
+          directory = zip::readZip64EndOfCentralDirectory(this->cache->read(
+              zip64Offset, zip::ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE));
+        }
+
+        std::vector<char> raw;
+        if (directory.offset >= tailOffset) {
+          if (directory.offset - tailOffset > tail.size()
+              || directory.size > tail.size() - (directory.offset - tailOffset)) {
+            throw IOException("central directory past the end of the archive");
+          }
+          auto start = tail.begin() + (directory.offset - tailOffset);
+          raw = std::vector<char>(start, start + directory.size);
+        } else {
+          raw = this->cache->read(directory.offset, directory.size);
+        }
+        this->entries = zip::readCentralDirectory(raw);
+
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          this->byName[this->entries[i].name] = i;
+        }
+        this->spanEnd = zip::spanEnds(this->entries, directory.offset);
+
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          this->order.push_back(i);
+          this->position.push_back(i);
+        }
+      }
+
+      std::pair<uint64_t, uint64_t> span(size_t entry) {
+        uint64_t start = this->entries[entry].localHeaderOffset;
+        return std::make_pair(start, this->spanEnd[entry] - start);
+      }
+
+      void runReadAhead() {
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true) {
+          this->wake.wait(guard, [&]() {
+            return this->stopping || !this->plan.empty();
+          });
+          if (this->stopping) {
+            return;
+          }
+          std::vector<std::pair<uint64_t, uint64_t>> ranges;
+          ranges.swap(this->plan);
+          uint64_t planned = this->generation;
+          guard.unlock();
+
+          this->cache->prefetch(ranges, [&]() {
+            std::lock_guard<std::mutex> check(this->lock);
+            return this->stopping || this->generation != planned;
+          });
+
+          guard.lock();
+        }
+      }
+
+      /**
+       * Grow or reset the read-ahead window from how the reader moved, and
+       * hand the entries it covers to the read-ahead thread.
+       */
+      void planReadAhead(size_t at) {
+        long spread = at / 2;
+        bool sequential = this->lastSpread >= 0
+            && std::abs(spread - this->lastSpread) <= 1;
+        int moved = spread > this->lastSpread ? 1 : (spread < this->lastSpread ? -1 : 0);
+        if (sequential && (moved == 0 || moved == this->direction)) {
+          if (moved != 0) {
+            this->window = std::min(this->window * 2, MAX_READ_AHEAD);
+          }
+        } else {
+          this->window = MIN_READ_AHEAD;
+          if (moved != 0) {
+            this->direction = moved;
+          }
+        }
+        this->lastSpread = spread;
+
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        uint64_t planned = 0;
+        // the current spread is fetched in the foreground
+        long next = ((long) at / 2 + this->direction) * 2;
+        for (long p = next; p >= 0 && p < (long) this->order.size() && planned < this->window;
+            p += this->direction) {
+          std::pair<uint64_t, uint64_t> range = this->span(this->order[p]);
+          ranges.push_back(range);
+          planned += range.second;
+        }
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->generation++;
+        this->plan = ranges;
+        this->wake.notify_one();
+      }
+
+    public:
+      /**
+       * Takes ownership of both sources. They must not share a connection:
+       * the background source is used from the read-ahead thread.
+       */
+      RemoteArchive(
+          RangeSource* foreground,
+          RangeSource* background,
+          std::string cacheDir) {
+        this->foreground = foreground;
+        this->background = background;
+        this->cache = new BlockCache(foreground, background, cacheDir);
+        try {
+          this->open();
+        } catch (...) {
+          delete this->cache;
+          delete this->foreground;
+          delete this->background;
+          throw;
+        }
+        this->readAhead = std::thread(&RemoteArchive::runReadAhead, this);
+      }
+
+      ~RemoteArchive() {
+        {
+          std::lock_guard<std::mutex> guard(this->lock);
+          this->stopping = true;
+          this->wake.notify_one();
+        }
+        this->readAhead.join();
+        delete this->cache;
+        delete this->foreground;
+        delete this->background;
+      }
+
+      std::vector<std::string> getNames() {
+        std::vector<std::string> names;
+        for (auto entry : this->entries) {
+          names.push_back(entry.name);
+        }
+        return names;
+      }
+
+      std::vector<ArchiveEntry> getEntries() {
+        std::vector<ArchiveEntry> entries;
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          const zip::Entry& entry = this->entries[i];
+          entries.push_back(ArchiveEntry {
+              entry.name, i, entry.localHeaderOffset, entry.compressedSize, entry.size });
+        }
+        return entries;
+      }
+
+      void setReadingOrder(const std::vector<std::string>& names) {
+        std::vector<size_t> order;
+        std::fill(this->position.begin(), this->position.end(), npos);
+        for (std::string name : names) {
+          auto it = this->byName.find(name);
+          if (it != this->byName.end()) {
+            this->position[it->second] = order.size();
+            order.push_back(it->second);
+          }
+        }
+        this->order = order;
+      }
+
+      uint32_t getCrc(const std::string& name) {
+        auto it = this->byName.find(name);
+        if (it == this->byName.end()) {
+          throw IOException(tfm::format("no entry named %s", name));
+        }
+        return this->entries[it->second].crc;
+      }
+
+      std::vector<char> read(const std::string& name) {
+        auto it = this->byName.find(name);
+        if (it == this->byName.end()) {
+          throw IOException(tfm::format("no entry named %s", name));
+        }
+        size_t index = it->second;
+        const zip::Entry& entry = this->entries[index];
+        size_t at = this->position[index];
+
+        // fetch the whole spread, whatever the parity, in one request when
+        // the neighbouring pages sit next to this one in the file
+        std::pair<uint64_t, uint64_t> range = this->span(index);
+        uint64_t start = range.first;
+        uint64_t end = range.first + range.second;
+        if (at != npos && at > 0 && this->spanEnd[this->order[at - 1]] == start) {
+          start = this->entries[this->order[at - 1]].localHeaderOffset;
+        }
+        if (at != npos && at + 1 < this->order.size()
+            && this->entries[this->order[at + 1]].localHeaderOffset == end) {
+          end = this->spanEnd[this->order[at + 1]];
+        }
+        std::vector<char> data = this->cache->read(start, end - start);
+
+        // only after the foreground read, so read-ahead never holds blocks
+        // this page is waiting for
+        if (at != npos) {
+          this->planReadAhead(at);
+        }
+
+        size_t header = range.first - start;
+        size_t dataAt = header + zip::localDataOffset(data, header);
+        if (dataAt + entry.compressedSize > data.size()) {
+          throw IOException(tfm::format("entry %s runs past its span", name));
+        }
+        return zip::extract(entry, data.data() + dataAt, entry.compressedSize);
+      }
+
+      /**
+       * Fetches only the blocks the start of the entry is in, and plans no
+       * read-ahead: this isn't the reader turning pages
+       */
+      std::vector<char> readPrefix(const std::string& name, size_t length) {
+        auto it = this->byName.find(name);
+        if (it == this->byName.end()) {
+          throw IOException(tfm::format("no entry named %s", name));
+        }
+        const zip::Entry& entry = this->entries[it->second];
+        uint64_t dataAt = entry.localHeaderOffset + zip::localDataOffset(
+            this->cache->read(entry.localHeaderOffset, zip::LOCAL_HEADER_SIZE));
+        return zip::extractPrefix(entry, length, [&](uint64_t from, uint64_t count) {
+          return this->cache->read(dataAt + from, count);
+        });
+      }
+
+      /**
+       * number of requests sent so far, on both connections
+       */
+      size_t requests() {
+        return this->foreground->requests() + this->background->requests();
+      }
+  };
+
+}
@@ -0,0 +1,326 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "Image.h"
+#include "SdlEngine.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace app {
+
+  /**
+   * Scales 32 bit surfaces on the CPU, for when the renderer is software
+   * and SDL_RenderCopy would scale every frame with a slow general purpose
+   * loop.
+   *
+   * Shrinking by two or more is done by averaging 2x2 blocks until the
+   * image is less than twice the target size, an area filter that doesn't
+   * alias the way bilinear sampling of a much larger image does. The rest
+   * is bilinear, separable: every output row blends two horizontally
+   * interpolated source rows. Weights are 7 bit so all the arithmetic fits
+   * 16 bit lanes, with SSE2 doing two pixels at a time.
+   *
+   * Rows are split between threads.
+   */
+  class Scaler {
+    private:
+      // weights are out of 128
+      static constexpr int ONE = 128;
+      static constexpr int SHIFT = 7;
+
+      struct Taps {
+        std::vector<int> at;
+        // weight of the sample after at, out of ONE
+        std::vector<uint16_t> weight;
+      };
+
+      static Taps taps(int from, int to) {
+        Taps taps;
+        for (int i = 0; i < to; i++) {
+          double s = std::max(0.0, (i + 0.5) * from / to - 0.5);
+          int at = std::min((int) s, from - 1);
+          int weight = at + 1 < from ? (int) std::lround((s - at) * ONE) : 0;
+          if (weight == ONE) {
+            at++;
+            weight = 0;
+          }
+          taps.at.push_back(at);
+          taps.weight.push_back(weight);
+        }
+        return taps;
+      }
+
+      static uint32_t* row(SDL_Surface* surface, int y) {
+        return (uint32_t*) ((uint8_t*) surface->pixels + (size_t) y * surface->pitch);
+      }
+
+      static void parallelRows(int rows, std::function<void(int, int)> work) {
+        // below this many rows a thread costs more than it saves
+        const int minRows = 32;
+        int threads = std::min(
+            (int) std::max(1u, std::thread::hardware_concurrency()),
+            std::max(1, rows / minRows));
+        std::vector<std::thread> workers;
+        int band = (rows + threads - 1) / threads;
+        for (int start = band; start < rows; start += band) {
+          workers.push_back(std::thread(work, start, std::min(rows, start + band)));
+        }
+        work(0, std::min(rows, band));
+        for (std::thread& worker : workers) {
+          worker.join();
+        }
+      }
+
+      /**
+       * average 2x2 blocks of src into dst, which is half its size
+       */
+      static void halveRows(SDL_Surface* src, SDL_Surface* dst, int from, int to) {
+        for (int y = from; y < to; y++) {
+          uint32_t* top = row(src, y * 2);
+          uint32_t* bottom = row(src, y * 2 + 1);
+          uint32_t* out = row(dst, y);
+          int x = 0;
+#if defined(__SSE2__)
+          for (; x + 4 <= dst->w; x += 4) {
+            __m128i a = _mm_avg_epu8(
+                _mm_loadu_si128((const __m128i*) (top + x * 2)),
+                _mm_loadu_si128((const __m128i*) (bottom + x * 2)));
+            __m128i b = _mm_avg_epu8(
+                _mm_loadu_si128((const __m128i*) (top + x * 2 + 4)),
+                _mm_loadu_si128((const __m128i*) (bottom + x * 2 + 4)));
+            __m128i even = _mm_castps_si128(_mm_shuffle_ps(
+                _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(_mm_shuffle_ps(
+                _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+            _mm_storeu_si128((__m128i*) (out + x), _mm_avg_epu8(even, odd));
+          }
+#endif
+          for (; x < dst->w; x++) {
+            const uint8_t* p = (const uint8_t*) (top + x * 2);
+            const uint8_t* q = (const uint8_t*) (bottom + x * 2);
+            uint8_t* o = (uint8_t*) (out + x);
+            for (int c = 0; c < 4; c++) {
+              o[c] = (p[c] + p[c + 4] + q[c] + q[c + 4] + 2) / 4;
+            }
+          }
+        }
+      }
+
+      /**
+       * interpolate one source row to the output width, 4 channels of
+       * 0..255 per pixel in 16 bit lanes
+       */
+      static void horizontal(const uint32_t* in, const Taps& taps, int srcW, uint16_t* out) {
+        int w = taps.at.size();
+        int x = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi16(ONE);
+        const __m128i half = _mm_set1_epi16(ONE / 2);
+        for (; x + 2 <= w; x += 2) {
+          int a0 = taps.at[x];
+          int a1 = taps.at[x + 1];
+          __m128i left = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+              _mm_cvtsi32_si128(in[a0]), _mm_cvtsi32_si128(in[a1])), zero);
+          __m128i right = _mm_unpacklo_epi8(_mm_unpacklo_epi32(
+              _mm_cvtsi32_si128(in[std::min(a0 + 1, srcW - 1)]),
+              _mm_cvtsi32_si128(in[std::min(a1 + 1, srcW - 1)])), zero);
+          __m128i weight = _mm_unpacklo_epi64(
+              _mm_set1_epi16(taps.weight[x]), _mm_set1_epi16(taps.weight[x + 1]));
+          __m128i mixed = _mm_add_epi16(
+              _mm_mullo_epi16(left, _mm_sub_epi16(one, weight)),
+              _mm_mullo_epi16(right, weight));
+          mixed = _mm_srli_epi16(_mm_add_epi16(mixed, half), SHIFT);
+          _mm_storeu_si128((__m128i*) (out + x * 4), mixed);
+        }
+#endif
+        for (; x < w; x++) {
+          const uint8_t* left = (const uint8_t*) (in + taps.at[x]);
+          const uint8_t* right = (const uint8_t*) (in + std::min(taps.at[x] + 1, srcW - 1));
+          int weight = taps.weight[x];
+          for (int c = 0; c < 4; c++) {
+            out[x * 4 + c] = (left[c] * (ONE - weight) + right[c] * weight + ONE / 2) >> SHIFT;
+          }
+        }
+      }
+
+      static void vertical(const uint16_t* top, const uint16_t* bottom, int weight, int w, uint32_t* out) {
+        int lanes = w * 4;
+        int i = 0;
+        uint8_t* bytes = (uint8_t*) out;
+#if defined(__SSE2__)
+        const __m128i upper = _mm_set1_epi16(ONE - weight);
+        const __m128i lower = _mm_set1_epi16(weight);
+        const __m128i half = _mm_set1_epi16(ONE / 2);
+        for (; i + 16 <= lanes; i += 16) {
+          __m128i a = _mm_add_epi16(
+              _mm_mullo_epi16(_mm_loadu_si128((const __m128i*) (top + i)), upper),
+              _mm_mullo_epi16(_mm_loadu_si128((const __m128i*) (bottom + i)), lower));
+          __m128i b = _mm_add_epi16(
+              _mm_mullo_epi16(_mm_loadu_si128((const __m128i*) (top + i + 8)), upper),
+              _mm_mullo_epi16(_mm_loadu_si128((const __m128i*) (bottom + i + 8)), lower));
+          a = _mm_srli_epi16(_mm_add_epi16(a, half), SHIFT);
+          b = _mm_srli_epi16(_mm_add_epi16(b, half), SHIFT);
+          _mm_storeu_si128((__m128i*) (bytes + i), _mm_packus_epi16(a, b));
+        }
+#endif
+        for (; i < lanes; i++) {
+          bytes[i] = (top[i] * (ONE - weight) + bottom[i] * weight + ONE / 2) >> SHIFT;
+        }
+      }
+
+      static void bilinearRows(SDL_Surface* src, SDL_Surface* dst, const Taps& columns, const Taps& rows, int from, int to) {
+        std::vector<uint16_t> top(dst->w * 4 + 8);
+        std::vector<uint16_t> bottom(dst->w * 4 + 8);
+        int topRow = -1;
+        int bottomRow = -1;
+        for (int y = from; y < to; y++) {
+          int at = rows.at[y];
+          int next = std::min(at + 1, src->h - 1);
+          // consecutive output rows mostly share source rows
+          if (topRow != at) {
+            if (bottomRow == at) {
+              top.swap(bottom);
+              bottomRow = -1;
+            } else {
+              horizontal(row(src, at), columns, src->w, top.data());
+            }
+            topRow = at;
+          }
+          if (bottomRow != next) {
+            horizontal(row(src, next), columns, src->w, bottom.data());
+            bottomRow = next;
+          }
+          vertical(top.data(), bottom.data(), rows.weight[y], dst->w, row(dst, y));
+        }
+      }
+
+      static SDL_Surface* create(int w, int h) {
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (surface == NULL) {
+          throw SDLException(tfm::format(
+              "failed to create %dx%d surface, reason: %s",
+              w, h, SDL_GetError()));
+        }
+        return surface;
+      }
+
+    public:
+      /**
+       * A new ARGB8888 surface of w by h holding src scaled.
+       * src may be in any format and is left untouched.
+       */
+      static SDL_Surface* scale(SDL_Surface* src, int w, int h) {
+        SDL_Surface* current = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_ARGB8888, 0);
+        if (current == NULL) {
+          throw SDLException(tfm::format(
+              "failed to convert surface for scaling, reason: %s",
+              SDL_GetError()));
+        }
+
+        try {
+          while (current->w >= w * 2 && current->h >= h * 2) {
+            SDL_Surface* half = create(current->w / 2, current->h / 2);
+            parallelRows(half->h, [&](int from, int to) {
+              halveRows(current, half, from, to);
+            });
+            SDL_FreeSurface(current);
+            current = half;
+          }
+
+          SDL_Surface* scaled = create(w, h);
+          Taps columns = taps(current->w, w);
+          Taps rows = taps(current->h, h);
+          parallelRows(h, [&](int from, int to) {
+            bilinearRows(current, scaled, columns, rows, from, to);
+          });
+          SDL_FreeSurface(current);
+          SDL_SetSurfaceBlendMode(scaled, SDL_BLENDMODE_NONE);
+          return scaled;
+        } catch (...) {
+          SDL_FreeSurface(current);
+          throw;
+        }
+      }
+  };
+
+  /**
+   * The last few scaled pages, so a frame that doesn't change the layout
+   * only blits. Entries are keyed by the source image and target size;
+   * holding the source keeps its address from being reused by another page.
+   */
+  class ScaledPages {
+    private:
+      struct Entry {
+        std::shared_ptr<Image> source;
+        SDL_Surface* scaled;
+        size_t used;
+      };
+
+      std::vector<Entry> entries;
+      size_t capacity;
+      size_t clock = 0;
+
+    public:
+      ScaledPages(size_t capacity) {
+        this->capacity = capacity;
+      }
+
+      ~ScaledPages() {
+        this->clear();
+      }
+
+      void clear() {
+        for (Entry& entry : this->entries) {
+          SDL_FreeSurface(entry.scaled);
+        }
+        this->entries.clear();
+      }
+
+      /**
+       * source scaled to w by h, owned by the cache
+       */
+      SDL_Surface* get(std::shared_ptr<Image> source, int w, int h) {
+        this->clock++;
+        for (Entry& entry : this->entries) {
+          if (entry.source == source && entry.scaled->w == w && entry.scaled->h == h) {
+            entry.used = this->clock;
+            return entry.scaled;
+          }
+        }
+
+        SDL_Surface* scaled;
+        if (source->getKind() != Image::Kind::Surface) {
+          SDL_Surface* converted = source->toSurface();
+          try {
+            scaled = Scaler::scale(converted, w, h);
+          } catch (...) {
+            SDL_FreeSurface(converted);
+            throw;
+          }
+          SDL_FreeSurface(converted);
+        } else {
+          scaled = Scaler::scale(source->getSurface(), w, h);
+        }
+        if (this->entries.size() >= this->capacity) {
+          auto oldest = std::min_element(this->entries.begin(), this->entries.end(),
+              [](const Entry& a, const Entry& b) {
+                return a.used < b.used;
+              });
+          SDL_FreeSurface(oldest->scaled);
+          this->entries.erase(oldest);
+        }
+        this->entries.push_back(Entry { source, scaled, this->clock });
+        return scaled;
+      }
+  };
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <vector>
+#include <SDL.h>
+
+namespace app {
+
+  /**
+   * Parts of the frame that are rebuilt independently
+   */
+  enum class Layer {
+    // which pages are shown: needs the pages fetched again
+    Pages = 1 << 0,
+    // where things go: the canvas changed size, nothing is decoded again
+    Layout = 1 << 1,
+    StatusBar = 1 << 2,
+    Overlay = 1 << 3,
+    // an animated page moved on to its next frame: nothing is rebuilt
+    Frames = 1 << 4,
+  };
+
+  /**
+   * What has to be rebuilt before the next frame, and where the last
+   * layout put everything.
+   *
+   * The renderer's back buffer isn't preserved across presents, so any dirty
+   * layer means the whole frame is composited again from the retained
+   * textures; the flags decide what is rebuilt first and whether a frame is
+   * presented at all. Nothing dirty, no frame.
+   */
+  class Scene {
+    private:
+      unsigned int dirty = 0;
+
+    public:
+      SDL_Rect canvas = { 0, 0, 0, 0 };
+      SDL_Rect left = { 0, 0, 0, 0 };
+      SDL_Rect right = { 0, 0, 0, 0 };
+      SDL_Rect statusText = { 0, 0, 0, 0 };
+      SDL_Rect statusBar = { 0, 0, 0, 0 };
+      SDL_Rect overlay = { 0, 0, 0, 0 };
+
+      Scene() {
+        this->markAll();
+      }
+
+      void mark(Layer layer) {
+        this->dirty |= static_cast<unsigned int>(layer);
+      }
+
+      void markAll() {
+        this->mark(Layer::Pages);
+        this->mark(Layer::Layout);
+        this->mark(Layer::StatusBar);
+        this->mark(Layer::Overlay);
+      }
+
+      bool isDirty() {
+        return this->dirty != 0;
+      }
+
+      bool isDirty(Layer layer) {
+        return (this->dirty & static_cast<unsigned int>(layer)) != 0;
+      }
+
+      void clean() {
+        this->dirty = 0;
+      }
+
+      /**
+       * The parts of the canvas that differ from the frame laid out in
+       * before, going by what is dirty: where things were and where they
+       * are now. Everything when the layout changed.
+       */
+      std::vector<SDL_Rect> damage(const Scene& before) {
+        if (this->isDirty(Layer::Layout)) {
+          return { this->canvas };
+        }
+        std::vector<SDL_Rect> changed;
+        if (this->isDirty(Layer::Pages) || this->isDirty(Layer::Frames)) {
+          changed.insert(changed.end(), { before.left, before.right, this->left, this->right });
+        }
+        if (this->isDirty(Layer::StatusBar)) {
+          changed.insert(changed.end(), { before.statusBar, this->statusBar });
+        }
+        if (this->isDirty(Layer::Overlay)) {
+          changed.insert(changed.end(), { before.overlay, this->overlay });
+        }
+
+        std::vector<SDL_Rect> damage;
+        for (SDL_Rect rect : changed) {
+          SDL_Rect visible;
+          if (SDL_IntersectRect(&rect, &this->canvas, &visible)) {
+            damage.push_back(visible);
+          }
+        }
+        return damage;
+      }
+  };
+
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tinyformat.h>
+#include "Archive.h"
+#include "Exception.h"
+#include "IoScheduler.h"
+#include "Zip.h"
+
+namespace app {
+
+  /**
+   * A local archive read with our own zip code rather than libzippp, so
+   * entry reads go through an IoScheduler: pages about to be decoded are
+   * read in offset order, neighbours in one request.
+   *
+   * Only handles stored and deflated entries; opening throws IOException
+   * for anything else, for the caller to fall back to LocalArchive.
+   */
+  class ScheduledArchive: public Archive {
+    private:
+      // large enough for the central directory of a few thousand entries
+      static constexpr uint64_t TAIL_SIZE = 256 * 1024;
+
+      IoScheduler* io;
+      std::vector<zip::Entry> entries;
+      std::unordered_map<std::string, size_t> byName;
+      std::vector<uint64_t> spanEnd;
+
+      void open() {
+        uint64_t tailOffset = this->io->size() - std::min(TAIL_SIZE, this->io->size());
+        std::vector<char> tail = this->io->read(tailOffset, this->io->size() - tailOffset);
+
+        uint64_t zip64Offset;
+        zip::CentralDirectory directory = zip::readEndOfCentralDirectory(
+            tail, tailOffset, &zip64Offset);
+        if (zip64Offset != 0) {
+          directory = zip::readZip64EndOfCentralDirectory(this->io->read(
+              zip64Offset, zip::ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE));
+        }
+
+        std::vector<char> raw;
+        if (directory.offset >= tailOffset) {
+          if (directory.offset - tailOffset > tail.size()
+              || directory.size > tail.size() - (directory.offset - tailOffset)) {
+            throw IOException("central directory past the end of the archive");
+          }
+          auto start = tail.begin() + (directory.offset - tailOffset);
+          raw = std::vector<char>(start, start + directory.size);
+        } else {
+          raw = this->io->read(directory.offset, directory.size);
+        }
+        this->entries = zip::readCentralDirectory(raw);
+
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          const zip::Entry& entry = this->entries[i];
+          if (entry.method != zip::METHOD_STORE && entry.method != zip::METHOD_DEFLATE) {
+            throw IOException(tfm::format(
+                "unsupported compression method %d for %s",
+                entry.method, entry.name));
+          }
+          this->byName[entry.name] = i;
+        }
+        this->spanEnd = zip::spanEnds(this->entries, directory.offset);
+      }
+
+      size_t indexOf(const std::string& name) {
+        auto it = this->byName.find(name);
+        if (it == this->byName.end()) {
+          throw IOException(tfm::format("no entry named %s", name));
+        }
+        return it->second;
+      }
+
+      IoScheduler::Range span(size_t entry) {
+        uint64_t start = this->entries[entry].localHeaderOffset;
+        return IoScheduler::Range { start, this->spanEnd[entry] - start };
+      }
+
+    public:
+      ScheduledArchive(std::string path) {
+        this->io = new IoScheduler(path);
+        try {
+          this->open();
+        } catch (...) {
+          delete this->io;
+          throw;
+        }
+      }
+
+      ~ScheduledArchive() {
+        delete this->io;
+      }
+
+      std::vector<std::string> getNames() {
+        std::vector<std::string> names;
+        for (auto entry : this->entries) {
+          names.push_back(entry.name);
+        }
+        return names;
+      }
+
+      std::vector<ArchiveEntry> getEntries() {
+        std::vector<ArchiveEntry> entries;
+        for (size_t i = 0; i < this->entries.size(); i++) {
+          const zip::Entry& entry = this->entries[i];
+          entries.push_back(ArchiveEntry {
+              entry.name, i, entry.localHeaderOffset, entry.compressedSize, entry.size });
+        }
+        return entries;
+      }
+
+      uint32_t getCrc(const std::string& name) {
+        return this->entries[this->indexOf(name)].crc;
+      }
+
+      void willRead(const std::vector<std::string>& names) {
+        std::vector<IoScheduler::Range> ranges;
+        for (const std::string& name : names) {
+          auto it = this->byName.find(name);
+          if (it != this->byName.end()) {
+            ranges.push_back(this->span(it->second));
+          }
+        }
+        this->io->prefetch(ranges);
+      }
+
+      std::vector<char> read(const std::string& name) {
+        size_t index = this->indexOf(name);
+        const zip::Entry& entry = this->entries[index];
+        IoScheduler::Range range = this->span(index);
+        std::vector<char> data = this->io->read(range.offset, range.length);
+        size_t dataAt = zip::localDataOffset(data);
+        if (dataAt + entry.compressedSize > data.size()) {
+          throw IOException(tfm::format("entry %s runs past its span", name));
+        }
+        return zip::extract(entry, data.data() + dataAt, entry.compressedSize);
+      }
+
+      std::vector<char> readPrefix(const std::string& name, size_t length) {
+        const zip::Entry& entry = this->entries[this->indexOf(name)];
+        uint64_t dataAt = entry.localHeaderOffset + zip::localDataOffset(
+            this->io->read(entry.localHeaderOffset, zip::LOCAL_HEADER_SIZE));
+        return zip::extractPrefix(entry, length, [&](uint64_t from, uint64_t count) {
+          return this->io->read(dataAt + from, count);
+        });
+      }
+
+      void readChunks(
+          const std::string& name,
+          size_t chunkSize,
+          std::function<bool(const char*, size_t)> consume) {
+        const zip::Entry& entry = this->entries[this->indexOf(name)];
+        uint64_t dataAt = entry.localHeaderOffset + zip::localDataOffset(
+            this->io->read(entry.localHeaderOffset, zip::LOCAL_HEADER_SIZE));
+        zip::extractChunks(entry, chunkSize, [&](uint64_t from, uint64_t count) {
+          return this->io->read(dataAt + from, count);
+        }, consume);
+      }
+  };
+
+}
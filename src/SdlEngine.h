@@ -24,7 +24,11 @@ namespace app {
 
   class SdlEngine {
     public:
-      SdlEngine() {
+      /**
+       * loadImageCodecs: pass false when a BookLoader is initialising the
+       * image codecs on its own thread
+       */
+      SdlEngine(bool loadImageCodecs = true) {
         int result = SDL_Init(SDL_INIT_VIDEO);
         if (result < 0) {
           throw SDLException(tfm::format(
@@ -32,14 +36,8 @@ namespace app {
               result, SDL_GetError()));
         }
 
-        // IMG_INIT_TIF
-        // IMG_INIT_WEBP
-        int imageFlags = IMG_INIT_PNG | IMG_INIT_JPG;
-        result = IMG_Init(imageFlags);
-        if (imageFlags != result) {
-          throw SDLException(tfm::format(
-              "failed to initialize sdl image. result: %s (expected: %s), reason: %s",
-              result, imageFlags, IMG_GetError()));
+        if (loadImageCodecs) {
+          initImage();
         }
 
         if (TTF_Init() == -1) {
@@ -52,6 +50,23 @@ namespace app {
 
       }
 
+      /**
+       * Load the image codecs.
+       * Does not depend on SDL_Init so it may run on a background thread
+       * while video is being initialised.
+       */
+      static void initImage() {
+        // IMG_INIT_TIF
+        // IMG_INIT_WEBP
+        int imageFlags = IMG_INIT_PNG | IMG_INIT_JPG;
+        int result = IMG_Init(imageFlags);
+        if (imageFlags != result) {
+          throw SDLException(tfm::format(
+              "failed to initialize sdl image. result: %s (expected: %s), reason: %s",
+              result, imageFlags, IMG_GetError()));
+        }
+      }
+
       ~SdlEngine() {
         IMG_Quit();
         SDL_Quit();
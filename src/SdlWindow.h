@@ -1,13 +1,60 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <SDL.h>
+#include <tinyformat.h>
+#include "SdlEngine.h"
 
 namespace app {
 
+  /**
+   * A window and its renderer.
+   *
+   * Without an accelerated renderer the window is drawn in software: pages
+   * are scaled by the caller and blitted into the window surface, a
+   * software renderer draws text into the same surface, and only the
+   * damaged parts are pushed to the screen.
+   */
   class SdlWindow {
     private:
       SDL_Window* window;
       SDL_Renderer* renderer;
+      bool software = false;
+      // the window surface the software renderer draws into
+      SDL_Surface* surface = NULL;
+
+      /**
+       * (re)create the software renderer on the current window surface
+       */
+      void attachSurface() {
+        this->surface = SDL_GetWindowSurface(this->window);
+        if (this->surface == NULL) {
+          throw SDLException(tfm::format(
+              "failed to get window surface, reason: %s",
+              SDL_GetError()));
+        }
+        if (this->renderer != NULL) {
+          SDL_DestroyRenderer(this->renderer);
+        }
+        this->renderer = SDL_CreateSoftwareRenderer(this->surface);
+        if (this->renderer == NULL) {
+          throw SDLException(tfm::format(
+              "failed to create software renderer, reason: %s",
+              SDL_GetError()));
+        }
+      }
+
+      /**
+       * The software renderer always matches its surface, and is replaced
+       * with it on the next frame
+       */
+      void fitRenderer() {
+        if (!this->software) {
+          SDL_Rect canvas = this->getCanvas();
+          SDL_RenderSetLogicalSize(this->renderer, canvas.w, canvas.h);
+        }
+      }
+
     public:
       SdlWindow(
           std::string windowName,
@@ -15,11 +62,27 @@ namespace app {
         this->window = SDL_CreateWindow(
             windowName.c_str(),
             x, y, w, h,
-            SDL_WINDOW_SHOWN);
+            SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
         this->renderer = SDL_CreateRenderer(
             window,
             -1,
             SDL_RENDERER_ACCELERATED);
+
+        SDL_RendererInfo info;
+        if (this->renderer != NULL && SDL_GetRendererInfo(this->renderer, &info) == 0
+            && (info.flags & SDL_RENDERER_SOFTWARE) != 0) {
+          SDL_DestroyRenderer(this->renderer);
+          this->renderer = NULL;
+        }
+        if (this->renderer == NULL) {
+          this->software = true;
+          try {
+            this->attachSurface();
+          } catch (...) {
+            SDL_DestroyWindow(this->window);
+            throw;
+          }
+        }
       }
 
       ~SdlWindow() {
@@ -42,29 +105,97 @@ namespace app {
 
       void fullscreen() {
         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
-        SDL_Rect screen = this->getScreen();
-        SDL_RenderSetLogicalSize(this->renderer, screen.w, screen.h);
+        this->fitRenderer();
       }
 
       void fakeFullscreen() {
         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
-        SDL_Rect screen = this->getScreen();
-        SDL_RenderSetLogicalSize(this->renderer, screen.w, screen.h);
+        this->fitRenderer();
       }
 
       void windowed() {
         SDL_SetWindowFullscreen(window, 0);
-        SDL_Rect screen = this->getScreen();
-        SDL_RenderSetLogicalSize(this->renderer, screen.w, screen.h);
+        this->fitRenderer();
       }
 
       void clear() {
         SDL_RenderClear(renderer);
       }
 
-      void update() {
-        SDL_RenderPresent(renderer);
-        SDL_UpdateWindowSurface(window);
+      /**
+       * Call when the window changed size so drawing keeps using window
+       * coordinates rather than being scaled from the old size
+       */
+      void resized() {
+        this->fitRenderer();
+      }
+
+      bool isSoftware() {
+        return this->software;
+      }
+
+      /**
+       * In software mode a resize replaces the window surface, and the
+       * renderer drawing into it has to be replaced as well. Check before
+       * every frame; when true, destroy every texture made with the current
+       * renderer, then call renewRenderer.
+       */
+      bool surfaceChanged() {
+        if (!this->software) {
+          return false;
+        }
+        SDL_Surface* current = SDL_GetWindowSurface(this->window);
+        return current != this->surface || current->w != this->surface->w
+            || current->h != this->surface->h;
+      }
+
+      void renewRenderer() {
+        this->attachSurface();
+      }
+
+      /**
+       * Whether the renderer can create textures of a pixel format without
+       * SDL converting them. Always false in software mode, where pages are
+       * never uploaded.
+       */
+      bool supportsTextureFormat(Uint32 format) {
+        SDL_RendererInfo info;
+        if (this->software || SDL_GetRendererInfo(this->renderer, &info) != 0) {
+          return false;
+        }
+        for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+          if (info.texture_formats[i] == format) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      /**
+       * the surface software frames are composed in, NULL with a hardware
+       * renderer
+       */
+      SDL_Surface* getSurface() {
+        return this->surface;
+      }
+
+      /**
+       * Show the frame. In software mode only the damaged rectangles are
+       * copied to the screen.
+       */
+      void update(const std::vector<SDL_Rect>& damage) {
+        if (!this->software) {
+          SDL_RenderPresent(renderer);
+          return;
+        }
+        SDL_RenderFlush(this->renderer);
+        if (!damage.empty()) {
+          SDL_UpdateWindowSurfaceRects(this->window, damage.data(), damage.size());
+        }
+      }
+
+      Uint32 getId() {
+        return SDL_GetWindowID(this->window);
       }
 
       SDL_Renderer* getRenderer() {
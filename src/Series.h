@@ -0,0 +1,159 @@
+#pragma once
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <tinyformat.h>
+#include "Book.h"
+#include "BookLoader.h"
+#include "Exception.h"
+#include "Journal.h"
+#include "PageCache.h"
+#include "PageTable.h"
+#include "SharedPageCache.h"
+
+namespace app {
+
+  /**
+   * The volumes of a series, read one after the other in one window.
+   *
+   * While the reader is in the last LOOKAHEAD_PAGES of a volume, the next
+   * one is opened and its first spread decoded into the page cache in the
+   * background, so turning past the end shows it without waiting. Going
+   * back past the start of a volume opens the one before as it is needed.
+   */
+  class Series {
+    private:
+      std::vector<std::string> volumes;
+      PageCache* cache;
+      SharedPageCache* shared;
+      // the volume opening in the background, NULL for none
+      BookLoader* next = NULL;
+      size_t nextVolume = 0;
+
+      static bool isArchive(const std::filesystem::path& path) {
+        std::string extension = path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension == ".cbz" || extension == ".zip";
+      }
+
+    public:
+      /**
+       * how close to the end of a volume the next one starts opening
+       */
+      static constexpr size_t LOOKAHEAD_PAGES = 6;
+
+      /**
+       * Archives to read in order. Directories stand for the archives
+       * directly inside them, in natural order of their names.
+       * Throws IOException if a directory can't be listed.
+       */
+      static std::vector<std::string> expand(const std::vector<std::string>& paths) {
+        std::vector<std::string> volumes;
+        for (const std::string& path : paths) {
+          std::error_code error;
+          if (!std::filesystem::is_directory(path, error)) {
+            volumes.push_back(path);
+            continue;
+          }
+          std::vector<std::filesystem::path> found;
+          for (auto it = std::filesystem::directory_iterator(path, error);
+              !error && it != std::filesystem::directory_iterator(); it.increment(error)) {
+            if (it->is_regular_file(error) && isArchive(it->path())) {
+              found.push_back(it->path());
+            }
+          }
+          if (error) {
+            throw IOException(tfm::format("failed to list %s, reason: %s", path, error.message()));
+          }
+          std::sort(found.begin(), found.end(),
+              [](const std::filesystem::path& a, const std::filesystem::path& b) {
+                return PageTable::naturalKey(a.filename().string())
+                    < PageTable::naturalKey(b.filename().string());
+              });
+          for (const std::filesystem::path& volume : found) {
+            volumes.push_back(volume.string());
+          }
+        }
+        return volumes;
+      }
+
+      /**
+       * The volumes share the page cache, and the cache shared with other
+       * processes, of the books opened before them
+       */
+      Series(std::vector<std::string> volumes, PageCache* cache, SharedPageCache* shared) {
+        if (volumes.empty()) {
+          throw Exception("a series needs at least one volume");
+        }
+        this->volumes = volumes;
+        this->cache = cache;
+        this->shared = shared;
+      }
+
+      ~Series() {
+        delete this->next;
+      }
+
+      size_t size() {
+        return this->volumes.size();
+      }
+
+      std::string getPath(size_t volume) {
+        return this->volumes[volume];
+      }
+
+      /**
+       * the volume to pick the series up in: the one read last, going by
+       * when their journals were saved, or the first
+       */
+      size_t resumeVolume() {
+        size_t resume = 0;
+        auto latest = std::filesystem::file_time_type::min();
+        for (size_t volume = 0; volume < this->volumes.size(); volume++) {
+          auto saved = Journal::savedAt(this->volumes[volume]);
+          if (saved > latest) {
+            latest = saved;
+            resume = volume;
+          }
+        }
+        return resume;
+      }
+
+      /**
+       * Start opening a volume and decoding its first spread in the
+       * background, unless it already is. Drops any other volume opening.
+       */
+      void prefetch(size_t volume) {
+        if (volume >= this->volumes.size() || (this->next != NULL && this->nextVolume == volume)) {
+          return;
+        }
+        delete this->next;
+        this->next = new BookLoader(this->volumes[volume], { 0, 1 }, this->cache, this->shared, NULL, false);
+        this->nextVolume = volume;
+      }
+
+      /**
+       * Open a volume, taking it from the background if prefetch started it.
+       * Ownership of the book passes to the caller.
+       * Throws whatever opening the archive throws.
+       */
+      Book* open(size_t volume) {
+        BookLoader* loader = this->next;
+        if (loader == NULL || this->nextVolume != volume) {
+          delete loader;
+          loader = new BookLoader(this->volumes[volume], {}, this->cache, this->shared, NULL, false);
+        }
+        this->next = NULL;
+        try {
+          Book* book = loader->get();
+          delete loader;
+          return book;
+        } catch (...) {
+          delete loader;
+          throw;
+        }
+      }
+  };
+
+}
@@ -0,0 +1,576 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "Image.h"
+#include "util.h"
+
+namespace app {
+
+  /**
+   * Decoded pages shared by all of a user's reader processes through one
+   * POSIX shared memory segment, so several readers of the same volume
+   * decode each page once and hold one copy of it.
+   *
+   * The segment is a header, a directory of fixed size slots and an arena
+   * of pixels. A slot names a page by a 64 bit key, made from the archive's
+   * identity and the entry, and holds the extent of the arena its pixels
+   * are in along with their size and layout.
+   *
+   * Lookups take no lock. A reader sets its bit in the slot's holders,
+   * then checks the slot is still ready and still the page it wanted;
+   * eviction marks the slot evicting, then checks holders is empty, and
+   * backs off if it isn't. Both sides use sequentially consistent atomics,
+   * so one of them always sees the other. A bit per process rather than a
+   * count means a process that dies holding pages can be cleared out:
+   * whoever allocates next finds its pid gone and drops its bits.
+   *
+   * Allocation and eviction take a robust process-shared mutex, so a crash
+   * while holding it doesn't wedge the others. Extents are placed first
+   * fit, evicting the least recently used pages nobody holds until one
+   * fits. Two processes that miss the same page at once both decode it;
+   * the second to publish finds the first's copy and uses that.
+   *
+   * Images should be freed once shown rather than kept for later: a held
+   * page can't be evicted, so a reader keeping everything it has seen
+   * fills the arena for every other reader.
+   *
+   * At most 64 processes can attach at once. Images from the cache must be
+   * freed before it is.
+   */
+  class SharedPageCache {
+    private:
+      static constexpr uint32_t VERSION = 2;
+      static constexpr uint32_t SLOTS = 1024;
+      static constexpr int PROCESSES = 64;
+      static constexpr uint64_t ALIGNMENT = 64;
+
+      enum State : uint32_t { Free, Filling, Ready, Evicting };
+
+      struct Slot {
+        std::atomic<uint32_t> state;
+        // pid of the process filling the slot
+        std::atomic<int32_t> owner;
+        std::atomic<uint64_t> key;
+        // a bit per process holding the pixels
+        std::atomic<uint64_t> holders;
+        std::atomic<uint64_t> used;
+        uint64_t offset;
+        uint64_t length;
+        int32_t width;
+        int32_t height;
+        int32_t pitch;
+        uint32_t kind;
+        // pixel format and bits per pixel of surfaces
+        uint32_t format;
+        uint32_t depth;
+        // whether the encoded page is animated, its pixels the first frame
+        uint32_t animated;
+      };
+
+      struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slots;
+        uint64_t size;
+        uint64_t arenaOffset;
+        uint64_t arenaSize;
+        pthread_mutex_t lock;
+        std::atomic<uint64_t> clock;
+        std::atomic<int32_t> processes[PROCESSES];
+      };
+
+      static_assert(std::atomic<uint32_t>::is_always_lock_free, "slots need lock free atomics");
+      static_assert(std::atomic<uint64_t>::is_always_lock_free, "slots need lock free atomics");
+
+      std::string name;
+      int fd = -1;
+      uint8_t* base = NULL;
+      size_t mapped = 0;
+      Header* header = NULL;
+      Slot* slots = NULL;
+      // our bit in the holders of every slot, -1 when disabled
+      int process = -1;
+      // images of each slot this process has out; the shared bit is set
+      // while any are
+      std::vector<uint32_t> leases;
+      std::mutex leaseLock;
+
+      static size_t align(size_t size) {
+        return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+      }
+
+      bool fail(const std::string& reason) {
+        std::cerr << tfm::format("shared page cache disabled: %s: %s", reason, std::strerror(errno)) << std::endl;
+        return false;
+      }
+
+      void initialize(size_t size) {
+        std::memset(this->base, 0, sizeof(Header) + sizeof(Slot) * SLOTS);
+        this->header->version = VERSION;
+        this->header->slots = SLOTS;
+        this->header->size = size;
+        this->header->arenaOffset = align(sizeof(Header) + sizeof(Slot) * SLOTS);
+        this->header->arenaSize = size - this->header->arenaOffset;
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&this->header->lock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        // a segment without its magic is redone by the next process, so
+        // it goes in last
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::memcpy(this->header->magic, "CBZPAGES", 8);
+      }
+
+      /**
+       * Map the segment, creating it if we are the first, and claim a
+       * process bit. Runs under an flock of the segment, so the first
+       * process finishes setting it up before anyone else looks.
+       */
+      bool attach(size_t size) {
+        struct stat info;
+        if (fstat(this->fd, &info) != 0) {
+          return this->fail("fstat");
+        }
+        bool fresh = info.st_size == 0;
+        if (fresh) {
+          if (ftruncate(this->fd, size) != 0) {
+            return this->fail("ftruncate");
+          }
+        } else {
+          size = info.st_size;
+        }
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        if (mapping == MAP_FAILED) {
+          return this->fail("mmap");
+        }
+        this->base = (uint8_t*) mapping;
+        this->mapped = size;
+        this->header = (Header*) this->base;
+        this->slots = (Slot*) (this->base + sizeof(Header));
+        if (fresh || std::memcmp(this->header->magic, "CBZPAGES", 8) != 0) {
+          this->initialize(size);
+        } else if (this->header->version != VERSION || this->header->slots != SLOTS) {
+          errno = EPROTO;
+          return this->fail("made by another version of the reader");
+        }
+
+        this->lock();
+        this->reap();
+        for (int i = 0; i < PROCESSES && this->process < 0; i++) {
+          int32_t empty = 0;
+          if (this->header->processes[i].compare_exchange_strong(empty, getpid())) {
+            this->process = i;
+          }
+        }
+        this->unlock();
+        if (this->process < 0) {
+          errno = EUSERS;
+          return this->fail("too many readers");
+        }
+        return true;
+      }
+
+      void lock() {
+        if (pthread_mutex_lock(&this->header->lock) == EOWNERDEAD) {
+          // every change made under the lock is a single store, so what
+          // the dead process left is consistent
+          pthread_mutex_consistent(&this->header->lock);
+        }
+      }
+
+      void unlock() {
+        pthread_mutex_unlock(&this->header->lock);
+      }
+
+      /**
+       * Drop the bits and half filled slots of processes that died
+       * without detaching. Called with the lock held.
+       */
+      void reap() {
+        for (int i = 0; i < PROCESSES; i++) {
+          int32_t pid = this->header->processes[i];
+          if (pid == 0 || i == this->process || kill(pid, 0) == 0 || errno != ESRCH) {
+            continue;
+          }
+          for (uint32_t s = 0; s < SLOTS; s++) {
+            Slot& slot = this->slots[s];
+            slot.holders.fetch_and(~(1ull << i));
+            if (slot.state == Filling && slot.owner == pid) {
+              slot.key = 0;
+              slot.state = Free;
+            }
+          }
+          this->header->processes[i].compare_exchange_strong(pid, 0);
+        }
+      }
+
+      /**
+       * Free the least recently used ready slot nobody holds.
+       * false if there is none. Called with the lock held.
+       */
+      bool evictOne() {
+        std::vector<bool> held(SLOTS, false);
+        while (true) {
+          int oldest = -1;
+          for (uint32_t s = 0; s < SLOTS; s++) {
+            Slot& slot = this->slots[s];
+            if (!held[s] && slot.state == Ready && slot.holders == 0
+                && (oldest < 0 || slot.used < this->slots[oldest].used)) {
+              oldest = s;
+            }
+          }
+          if (oldest < 0) {
+            return false;
+          }
+          Slot& slot = this->slots[oldest];
+          uint32_t ready = Ready;
+          if (!slot.state.compare_exchange_strong(ready, Evicting)) {
+            held[oldest] = true;
+            continue;
+          }
+          if (slot.holders != 0) {
+            // a reader got in between
+            slot.state = Ready;
+            held[oldest] = true;
+            continue;
+          }
+          slot.key = 0;
+          slot.state = Free;
+          return true;
+        }
+      }
+
+      /**
+       * Offset of a free extent of the arena, evicting until there is one.
+       * -1 if everything in the way is held. Called with the lock held.
+       */
+      int64_t allocate(uint64_t length) {
+        while (true) {
+          std::vector<std::pair<uint64_t, uint64_t>> extents;
+          for (uint32_t s = 0; s < SLOTS; s++) {
+            if (this->slots[s].state != Free) {
+              extents.push_back(std::make_pair(this->slots[s].offset, this->slots[s].offset + this->slots[s].length));
+            }
+          }
+          std::sort(extents.begin(), extents.end());
+          uint64_t at = 0;
+          for (auto& extent : extents) {
+            if (extent.first >= at + length) {
+              return at;
+            }
+            at = std::max(at, align(extent.second));
+          }
+          if (this->header->arenaSize >= at + length) {
+            return at;
+          }
+          if (!this->evictOne()) {
+            return -1;
+          }
+        }
+      }
+
+      /**
+       * A free slot, near where lookups of key start, evicting if every
+       * slot is taken. -1 if none can be had. Called with the lock held.
+       */
+      int claimSlot(uint64_t key) {
+        for (int attempt = 0; attempt < 2; attempt++) {
+          for (uint32_t i = 0; i < SLOTS; i++) {
+            uint32_t s = (key + i) % SLOTS;
+            if (this->slots[s].state == Free) {
+              return s;
+            }
+          }
+          if (!this->evictOne()) {
+            return -1;
+          }
+        }
+        return -1;
+      }
+
+      /**
+       * Set our bit in a slot's holders for one more image, then make
+       * sure it still holds key. Lock free.
+       */
+      bool lease(uint32_t s, uint64_t key) {
+        Slot& slot = this->slots[s];
+        std::lock_guard<std::mutex> guard(this->leaseLock);
+        if (this->leases[s]++ == 0) {
+          slot.holders.fetch_or(1ull << this->process);
+        }
+        if (slot.state == Ready && slot.key == key) {
+          slot.used = ++this->header->clock;
+          return true;
+        }
+        if (--this->leases[s] == 0) {
+          slot.holders.fetch_and(~(1ull << this->process));
+        }
+        return false;
+      }
+
+      void unlease(uint32_t s) {
+        std::lock_guard<std::mutex> guard(this->leaseLock);
+        if (--this->leases[s] == 0) {
+          this->slots[s].holders.fetch_and(~(1ull << this->process));
+        }
+      }
+
+      /**
+       * An image over a leased slot's pixels that gives the lease back
+       * when freed
+       */
+      Image* wrap(uint32_t s) {
+        Slot& slot = this->slots[s];
+        uint8_t* pixels = this->base + this->header->arenaOffset + slot.offset;
+        auto unshare = [this, s]() { this->unlease(s); };
+        if ((Image::Kind) slot.kind != Image::Kind::Surface) {
+          return new Image(slot.width, slot.height, (Image::Kind) slot.kind, pixels, unshare);
+        }
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom(
+            pixels, slot.width, slot.height, slot.depth, slot.pitch, slot.format);
+        if (surface == NULL) {
+          this->unlease(s);
+          return NULL;
+        }
+        return new Image(surface, unshare);
+      }
+
+    public:
+      /**
+       * Attach to the segment of this user, creating it with room for
+       * bytes of pixels if no other reader has. 0 bytes, or a segment that
+       * can't be opened, leaves the cache disabled: every lookup misses and
+       * nothing is published.
+       */
+      SharedPageCache(size_t bytes) {
+        if (bytes == 0) {
+          return;
+        }
+        this->name = tfm::format("/cbzreader-pages-%d", getuid());
+        this->fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (this->fd < 0) {
+          this->fail("shm_open");
+          return;
+        }
+        flock(this->fd, LOCK_EX);
+        size_t size = align(sizeof(Header) + sizeof(Slot) * SLOTS) + align(bytes);
+        bool attached = this->attach(size);
+        flock(this->fd, LOCK_UN);
+        if (!attached) {
+          this->detach();
+          return;
+        }
+        this->leases.resize(SLOTS, 0);
+      }
+
+      SharedPageCache(const SharedPageCache&) = delete;
+      SharedPageCache& operator=(const SharedPageCache&) = delete;
+
+      ~SharedPageCache() {
+        this->detach();
+      }
+
+      /**
+       * Give back our bit and process slot, and remove the segment if we
+       * were the last reader attached to it.
+       */
+      void detach() {
+        if (this->fd < 0) {
+          return;
+        }
+        flock(this->fd, LOCK_EX);
+        if (this->process >= 0) {
+          for (uint32_t s = 0; s < SLOTS; s++) {
+            this->slots[s].holders.fetch_and(~(1ull << this->process));
+          }
+          this->header->processes[this->process] = 0;
+          this->process = -1;
+          bool last = true;
+          for (int i = 0; i < PROCESSES; i++) {
+            int32_t pid = this->header->processes[i];
+            last = last && (pid == 0 || (kill(pid, 0) != 0 && errno == ESRCH));
+          }
+          if (last) {
+            shm_unlink(this->name.c_str());
+          }
+        }
+        if (this->base != NULL) {
+          munmap(this->base, this->mapped);
+          this->base = NULL;
+        }
+        flock(this->fd, LOCK_UN);
+        close(this->fd);
+        this->fd = -1;
+      }
+
+      bool isEnabled() {
+        return this->process >= 0;
+      }
+
+      /**
+       * The key of a page, from the identity of its archive and its entry
+       */
+      static uint64_t keyOf(uint64_t archive, const std::string& entry, uint64_t offset, uint64_t size) {
+        uint64_t key = fnv1a(tfm::format("%016x:%d:%d:%s", archive, offset, size, entry));
+        // 0 marks a free slot
+        return key == 0 ? 1 : key;
+      }
+
+      /**
+       * Whether a reader has published the page stored under key. It may
+       * be evicted before it is asked for. Takes no lock.
+       */
+      bool contains(uint64_t key) {
+        if (!this->isEnabled()) {
+          return false;
+        }
+        for (uint32_t i = 0; i < SLOTS; i++) {
+          Slot& slot = this->slots[(key + i) % SLOTS];
+          if (slot.key == key && slot.state == Ready) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      /**
+       * The page stored under key, its pixels borrowed from the segment,
+       * or NULL if no reader has published it. animated, if not NULL, is
+       * set to whether the page was published as animated. Takes no lock.
+       */
+      Image* get(uint64_t key, bool* animated = NULL) {
+        if (!this->isEnabled()) {
+          return NULL;
+        }
+        for (uint32_t i = 0; i < SLOTS; i++) {
+          uint32_t s = (key + i) % SLOTS;
+          Slot& slot = this->slots[s];
+          if (slot.key == key && slot.state == Ready && this->lease(s, key)) {
+            // read under the lease, the slot can't be reused until it goes
+            bool wasAnimated = slot.animated != 0;
+            Image* image = this->wrap(s);
+            if (image != NULL) {
+              if (animated != NULL) {
+                *animated = wasAnimated;
+              }
+              return image;
+            }
+          }
+        }
+        return NULL;
+      }
+
+      /**
+       * Publish a freshly decoded page under key and return an image over
+       * the shared copy in its place, deleting the one passed in. If the
+       * page is already there that copy is used instead. Images that can't
+       * be shared, palettised surfaces or ones too big for the cache, or
+       * ones that find no room, are returned as they are. animated is kept
+       * with the pixels for the readers that get them.
+       */
+      Image* put(uint64_t key, Image* image, bool animated) {
+        if (!this->isEnabled()) {
+          return image;
+        }
+        Slot shape;
+        const uint8_t* pixels = NULL;
+        shape.kind = (uint32_t) image->getKind();
+        shape.width = image->getWidth();
+        shape.height = image->getHeight();
+        shape.pitch = 0;
+        shape.format = 0;
+        shape.depth = 0;
+        shape.animated = animated ? 1 : 0;
+        shape.length = image->bytes();
+        if (image->getKind() == Image::Kind::Surface) {
+          SDL_Surface* surface = image->getSurface();
+          if (surface->format->palette != NULL || SDL_MUSTLOCK(surface)) {
+            return image;
+          }
+          pixels = (const uint8_t*) surface->pixels;
+          shape.pitch = surface->pitch;
+          shape.format = surface->format->format;
+          shape.depth = surface->format->BitsPerPixel;
+        } else {
+          pixels = image->plane(0);
+        }
+        // one page shouldn't flush everything else
+        if (shape.length > this->header->arenaSize / 4) {
+          return image;
+        }
+
+        this->lock();
+        this->reap();
+        for (uint32_t i = 0; i < SLOTS; i++) {
+          uint32_t s = (key + i) % SLOTS;
+          if (this->slots[s].key == key && this->slots[s].state == Ready) {
+            this->unlock();
+            if (this->lease(s, key)) {
+              Image* shared = this->wrap(s);
+              if (shared != NULL) {
+                delete image;
+                return shared;
+              }
+            }
+            return image;
+          }
+        }
+        int s = this->claimSlot(key);
+        int64_t offset = s < 0 ? -1 : this->allocate(shape.length);
+        if (offset < 0) {
+          this->unlock();
+          return image;
+        }
+        Slot& slot = this->slots[s];
+        slot.offset = offset;
+        slot.length = shape.length;
+        slot.width = shape.width;
+        slot.height = shape.height;
+        slot.pitch = shape.pitch;
+        slot.kind = shape.kind;
+        slot.format = shape.format;
+        slot.depth = shape.depth;
+        slot.animated = shape.animated;
+        slot.owner = getpid();
+        slot.key = key;
+        slot.state = Filling;
+        this->unlock();
+
+        std::memcpy(this->base + this->header->arenaOffset + offset, pixels, shape.length);
+        {
+          std::lock_guard<std::mutex> guard(this->leaseLock);
+          if (this->leases[s]++ == 0) {
+            slot.holders.fetch_or(1ull << this->process);
+          }
+        }
+        slot.used = ++this->header->clock;
+        slot.state = Ready;
+        Image* shared = this->wrap(s);
+        if (shared == NULL) {
+          return image;
+        }
+        delete image;
+        return shared;
+      }
+  };
+
+}
@@ -0,0 +1,223 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <SDL.h>
+#include <SDL_image.h>
+#include <tinyformat.h>
+#include "Book.h"
+#include "Layout.h"
+#include "SdlEngine.h"
+#include "WorkQueue.h"
+
+namespace app {
+
+  struct ExportOptions {
+    std::string path;
+    std::string outputDir = ".";
+    // first and last page of the range; the first page picks the parity
+    int first = 0;
+    int last = -1;
+    bool leftToRight = true;
+    int width = 800;
+    int height = 600;
+    // png or jpg
+    std::string format = "png";
+    int quality = 90;
+    // 0: one per core
+    int jobs = 0;
+  };
+
+  /**
+   * Renders spreads to image files without a window.
+   *
+   * Every worker owns a book and a software renderer drawing into its own
+   * surface, and lays pages out with Layout::spread exactly as
+   * Application::redraw does, without the status bar. Spreads are handed
+   * out through a bounded queue so the number in flight stays fixed.
+   */
+  class SpreadExporter {
+    private:
+      ExportOptions options;
+      std::atomic<size_t> pagesRendered;
+      std::mutex errorLock;
+      std::exception_ptr error;
+
+      void renderSpread(Book* book, SDL_Renderer* renderer, SDL_Surface* canvas, int page) {
+        int lIndex = this->options.leftToRight ? page : page + 1;
+        int rIndex = this->options.leftToRight ? page + 1 : page;
+        SDL_Surface* left = (size_t) lIndex < book->size() ? book->decode(lIndex) : NULL;
+        SDL_Surface* right = NULL;
+        try {
+          right = (size_t) rIndex < book->size() ? book->decode(rIndex) : NULL;
+        } catch (...) {
+          SDL_FreeSurface(left);
+          throw;
+        }
+
+        // the window always has a full spread; stand in for a missing last
+        // page with an empty one the same size so the other stays in place
+        SDL_Rect srcl = { 0, 0, 0, 0 };
+        SDL_Rect srcr = { 0, 0, 0, 0 };
+        if (left != NULL) {
+          srcl = { 0, 0, left->w, left->h };
+        }
+        if (right != NULL) {
+          srcr = { 0, 0, right->w, right->h };
+        }
+        if (left == NULL) {
+          srcl = srcr;
+        }
+        if (right == NULL) {
+          srcr = srcl;
+        }
+
+        SDL_Rect dst = { 0, 0, canvas->w, canvas->h };
+        std::pair<SDL_Rect, SDL_Rect> sized = Layout::spread(srcl, srcr, dst);
+
+        SDL_Texture* texturel = left == NULL ? NULL : SDL_CreateTextureFromSurface(renderer, left);
+        SDL_Texture* texturer = right == NULL ? NULL : SDL_CreateTextureFromSurface(renderer, right);
+        bool failed = (left != NULL && texturel == NULL) || (right != NULL && texturer == NULL);
+        SDL_FreeSurface(left);
+        SDL_FreeSurface(right);
+        if (failed) {
+          SDL_DestroyTexture(texturel);
+          SDL_DestroyTexture(texturer);
+          throw SDLException(tfm::format(
+              "failed to create texture for spread %d, reason: %s",
+              page, SDL_GetError()));
+        }
+
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        for (auto side : { std::make_pair(texturel, sized.first), std::make_pair(texturer, sized.second) }) {
+          if (side.first == NULL) {
+            continue;
+          }
+          SDL_RenderCopy(renderer, side.first, NULL, &side.second);
+          SDL_DestroyTexture(side.first);
+          this->pagesRendered++;
+        }
+        SDL_RenderPresent(renderer);
+
+        std::string file = tfm::format(
+            "%s/spread-%04d.%s",
+            this->options.outputDir, page, this->options.format);
+        int result = this->options.format == "jpg"
+            ? IMG_SaveJPG(canvas, file.c_str(), this->options.quality)
+            : IMG_SavePNG(canvas, file.c_str());
+        if (result != 0) {
+          throw SDLException(tfm::format(
+              "failed to write %s, reason: %s",
+              file, IMG_GetError()));
+        }
+      }
+
+      void work(WorkQueue<int>* queue) {
+        Book* book = NULL;
+        SDL_Surface* canvas = NULL;
+        SDL_Renderer* renderer = NULL;
+        try {
+          book = new Book(this->options.path);
+          canvas = SDL_CreateRGBSurfaceWithFormat(
+              0, this->options.width, this->options.height, 32, SDL_PIXELFORMAT_ARGB8888);
+          if (canvas == NULL) {
+            throw SDLException(tfm::format("failed to create canvas, reason: %s", SDL_GetError()));
+          }
+          renderer = SDL_CreateSoftwareRenderer(canvas);
+          if (renderer == NULL) {
+            throw SDLException(tfm::format("failed to create renderer, reason: %s", SDL_GetError()));
+          }
+
+          while (true) {
+            neither::Maybe<int> page = queue->pop();
+            if (!page.hasValue) {
+              break;
+            }
+            this->renderSpread(book, renderer, canvas, page.unsafeGet());
+          }
+        } catch (...) {
+          {
+            std::lock_guard<std::mutex> guard(this->errorLock);
+            if (!this->error) {
+              this->error = std::current_exception();
+            }
+          }
+          queue->close();
+        }
+
+        if (renderer != NULL) {
+          SDL_DestroyRenderer(renderer);
+        }
+        if (canvas != NULL) {
+          SDL_FreeSurface(canvas);
+        }
+        delete book;
+      }
+
+    public:
+      SpreadExporter(ExportOptions options) :
+          options(options), pagesRendered(0) {
+      }
+
+      /**
+       * Render every spread in the range and report throughput.
+       * Rethrows the first error any worker hit.
+       */
+      void run(std::ostream& report) {
+        if (this->options.format != "png" && this->options.format != "jpg") {
+          throw Exception(tfm::format(
+              "unsupported image format %s, expected png or jpg",
+              this->options.format));
+        }
+        SdlEngine::initImage();
+        auto start = std::chrono::steady_clock::now();
+
+        size_t size;
+        {
+          Book book = Book(this->options.path);
+          size = book.size();
+        }
+        int last = this->options.last < 0
+            ? (int) size - 1
+            : std::min(this->options.last, (int) size - 1);
+
+        int jobs = this->options.jobs > 0
+            ? this->options.jobs
+            : std::max(1u, std::thread::hardware_concurrency());
+        WorkQueue<int> queue = WorkQueue<int>(jobs * 2);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+          workers.push_back(std::thread(&SpreadExporter::work, this, &queue));
+        }
+        for (int page = std::max(0, this->options.first); page <= last; page += 2) {
+          if (!queue.push(page)) {
+            break;
+          }
+        }
+        queue.close();
+        for (std::thread& worker : workers) {
+          worker.join();
+        }
+        IMG_Quit();
+
+        if (this->error) {
+          std::rethrow_exception(this->error);
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        report << tfm::format(
+            "rendered %d pages in %.2f s with %d workers: %.1f pages/s",
+            this->pagesRendered.load(), elapsed.count(), jobs,
+            this->pagesRendered.load() / elapsed.count()) << std::endl;
+      }
+  };
+
+}
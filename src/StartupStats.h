@@ -0,0 +1,53 @@
+#pragma once
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tinyformat.h>
+
+namespace app {
+
+  /**
+   * Records named milestones relative to process start so time to first
+   * pixel can be broken down into its stages.
+   * Milestones may be recorded from any thread.
+   */
+  class StartupStats {
+    private:
+      std::chrono::steady_clock::time_point start;
+      std::vector<std::pair<std::string, double>> marks;
+      std::mutex lock;
+
+    public:
+      StartupStats() {
+        this->start = std::chrono::steady_clock::now();
+      }
+
+      /**
+       * milliseconds since this object was created
+       */
+      double elapsed() {
+        std::chrono::duration<double, std::milli> delta =
+            std::chrono::steady_clock::now() - this->start;
+        return delta.count();
+      }
+
+      void mark(std::string name) {
+        double at = this->elapsed();
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->marks.push_back(std::make_pair(name, at));
+      }
+
+      void print(std::ostream& out) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        out << "startup:" << std::endl;
+        for (auto entry : this->marks) {
+          out << tfm::format("  %-24s %8.1f ms", entry.first, entry.second)
+              << std::endl;
+        }
+      }
+  };
+
+}
@@ -73,6 +73,7 @@ namespace app {
       std::vector<std::string> text;
       SDL_Renderer* renderer;
       TTF_Font* font;
+      bool ownsFont;
       SDL_Color color;
 
       // TODO: if we know the window height, we can make sure text wraps correctly
@@ -87,6 +88,7 @@ namespace app {
         this->renderer = renderer;
         this->color = color;
         this->font = TTF_OpenFont(fontPath.c_str(), point);
+        this->ownsFont = true;
         if (this->font == NULL) {
           throw TTFException(tfm::format(
               "Failed to open font file, reason: %s",
@@ -94,8 +96,23 @@ namespace app {
         }
       }
 
+      /**
+       * Render with a font someone else owns, like a FontCache
+       */
+      TextBox(
+          SDL_Renderer* renderer,
+          TTF_Font* font,
+          SDL_Color color = { 255, 255, 255, 0 }) {
+        this->renderer = renderer;
+        this->color = color;
+        this->font = font;
+        this->ownsFont = false;
+      }
+
       ~TextBox() {
-        TTF_CloseFont(this->font);
+        if (this->ownsFont) {
+          TTF_CloseFont(this->font);
+        }
       }
 
       void addLines(std::vector<std::string> lines) {
@@ -118,7 +135,24 @@ namespace app {
         }
       }
 
+      void clear() {
+        this->text.clear();
+      }
+
       RenderedText render() {
+        return RenderedText(this->renderLines());
+      }
+
+      /**
+       * render() for text that outlives the call, the caller owns the result
+       */
+      RenderedText* renderNew() {
+        return new RenderedText(this->renderLines());
+      }
+
+    private:
+
+      std::vector<std::tuple<SDL_Texture*, int, int>> renderLines() {
         std::vector<std::tuple<SDL_Texture*, int, int>> lines;
         for (std::string line : this->text) {
           SDL_Surface* textSurface = TTF_RenderText_Blended(this->font, line.c_str(), this->color);
@@ -128,8 +162,7 @@ namespace app {
           SDL_FreeSurface(textSurface);
           lines.push_back(std::tuple<SDL_Texture*, int, int> { texture, w, h });
         }
-
-        return RenderedText(lines);
+        return lines;
       }
   };
 }
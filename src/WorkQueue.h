@@ -0,0 +1,73 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <neither.h>
+
+namespace app {
+
+  /**
+   * Bounded blocking queue between a producer and a pool of workers.
+   * push blocks while the queue is full, which caps how much work is in
+   * flight; pop blocks until there is work or the queue is closed.
+   */
+  template<typename T>
+  class WorkQueue {
+    private:
+      std::deque<T> items;
+      size_t capacity;
+      bool closed = false;
+      std::mutex lock;
+      std::condition_variable notFull;
+      std::condition_variable notEmpty;
+
+    public:
+      WorkQueue(size_t capacity) {
+        this->capacity = capacity;
+      }
+
+      /**
+       * false if the queue was closed and item was dropped
+       */
+      bool push(T item) {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->notFull.wait(guard, [&]() {
+          return this->closed || this->items.size() < this->capacity;
+        });
+        if (this->closed) {
+          return false;
+        }
+        this->items.push_back(item);
+        this->notEmpty.notify_one();
+        return true;
+      }
+
+      /**
+       * empty once the queue is closed and drained
+       */
+      neither::Maybe<T> pop() {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->notEmpty.wait(guard, [&]() {
+          return this->closed || !this->items.empty();
+        });
+        if (this->items.empty()) {
+          return {};
+        }
+        T item = this->items.front();
+        this->items.pop_front();
+        this->notFull.notify_one();
+        return { item };
+      }
+
+      /**
+       * Wake everyone up. Queued items can still be popped, new pushes fail.
+       */
+      void close() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->closed = true;
+        this->notFull.notify_all();
+        this->notEmpty.notify_all();
+      }
+  };
+
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <chrono>
+#include <ostream>
+#include <thread>
+#include <vector>
+#include <SDL.h>
+#include <tinyformat.h>
+#include "Application.h"
+#include "InputLog.h"
+
+namespace app {
+
+  /**
+   * The open windows of one process, each reading its own book.
+   * Routes SDL events to the window they belong to, closes windows as they
+   * finish, and draws every window that changed once the pending events are
+   * handled.
+   */
+  class Workspace {
+    private:
+      std::vector<Application*> windows;
+      size_t added = 0;
+
+      /**
+       * the window an event belongs to, 0 for events that concern all of them
+       */
+      static Uint32 windowOf(SDL_Event& event) {
+        if (event.type == Application::grownEvent()) {
+          return event.user.windowID;
+        }
+        switch (event.type) {
+          case SDL_WINDOWEVENT:
+            return event.window.windowID;
+          case SDL_KEYDOWN:
+          case SDL_KEYUP:
+            return event.key.windowID;
+          case SDL_MOUSEBUTTONDOWN:
+          case SDL_MOUSEBUTTONUP:
+            return event.button.windowID;
+          default:
+            return 0;
+        }
+      }
+
+      void dispatch(SDL_Event& event) {
+        Uint32 id = windowOf(event);
+        for (Application* window : this->windows) {
+          if (id == 0 || window->getWindowId() == id) {
+            window->processEvent(event);
+          }
+        }
+      }
+
+      Application* numbered(size_t number) {
+        for (Application* window : this->windows) {
+          if (window->getNumber() == number) {
+            return window;
+          }
+        }
+        return NULL;
+      }
+
+      /**
+       * ms until the first animated page of any window is due, -1 for none
+       */
+      int nextFrameIn() {
+        int soonest = -1;
+        for (Application* window : this->windows) {
+          int due = window->nextFrameIn();
+          if (due >= 0 && (soonest < 0 || due < soonest)) {
+            soonest = due;
+          }
+        }
+        return soonest;
+      }
+
+      void redrawDirty() {
+        for (Application* window : this->windows) {
+          window->animate();
+        }
+        for (Application* window : this->windows) {
+          window->redrawIfDirty();
+        }
+      }
+
+      void closeFinished() {
+        std::vector<Application*> open;
+        for (Application* window : this->windows) {
+          if (window->isRunning()) {
+            open.push_back(window);
+          } else {
+            delete window;
+          }
+        }
+        this->windows = open;
+      }
+
+    public:
+      ~Workspace() {
+        for (Application* window : this->windows) {
+          delete window;
+        }
+      }
+
+      /**
+       * Takes ownership of the window
+       */
+      void add(Application* window) {
+        window->setNumber(this->added++);
+        this->windows.push_back(window);
+      }
+
+      /**
+       * Log the keys of every window to recorder
+       */
+      void record(InputRecorder* recorder) {
+        for (Application* window : this->windows) {
+          window->record(recorder);
+        }
+      }
+
+      bool isRunning() {
+        return !this->windows.empty();
+      }
+
+      /**
+       * Wait for input, or for an animated page's next frame, handle
+       * everything that has arrived, then draw at most one frame per window,
+       * and only for windows where something changed.
+       */
+      void processEvents() {
+        SDL_Event event;
+        int timeout = this->nextFrameIn();
+        if (timeout < 0) {
+          if (!SDL_WaitEvent(&event)) {
+            return;
+          }
+          this->dispatch(event);
+        } else if (SDL_WaitEventTimeout(&event, timeout)) {
+          this->dispatch(event);
+        }
+
+        // a resize drag or a fast typist sends bursts, they cost one frame
+        while (SDL_PollEvent(&event)) {
+          this->dispatch(event);
+        }
+
+        this->closeFinished();
+        this->redrawDirty();
+      }
+
+      /**
+       * Drive the windows from a recording instead of the user, writing how
+       * long each intent took from being handled to its frame being
+       * presented. Paced replays wait for each intent's recorded time, the
+       * rest go as fast as the frames are drawn. Events SDL sends on its own,
+       * like window resizes, are still handled between intents.
+       */
+      void replay(InputReplay& recording, bool paced, std::ostream& out) {
+        for (Application* window : this->windows) {
+          neither::Maybe<Opening> opening = recording.getOpening(window->getNumber());
+          if (opening.hasValue) {
+            window->restore(opening.unsafeGet().page, opening.unsafeGet().leftToRight);
+          }
+        }
+        this->redrawDirty();
+
+        out << "ms	window	key	page	latency_ms" << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        for (const Intent& intent : recording.getIntents()) {
+          if (!this->isRunning()) {
+            break;
+          }
+          if (paced) {
+            std::this_thread::sleep_until(start
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double, std::milli>(intent.ms)));
+          }
+          SDL_Event event;
+          while (SDL_PollEvent(&event)) {
+            this->dispatch(event);
+          }
+          Application* window = this->numbered(intent.window);
+          if (window == NULL) {
+            continue;
+          }
+
+          auto handled = std::chrono::steady_clock::now();
+          window->replay(intent.key, intent.page);
+          int page = window->getPage();
+          // may delete window
+          this->closeFinished();
+          this->redrawDirty();
+          double latency = std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - handled).count();
+          out << tfm::format("%.3f\t%d\t%s\t%d\t%.3f",
+              intent.ms, intent.window, keyName(intent.key), page, latency)
+              << std::endl;
+        }
+      }
+  };
+
+}
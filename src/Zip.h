@@ -0,0 +1,584 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <tinyformat.h>
+#include "Crc32.h"
+#include "Exception.h"
+
+namespace app {
+  namespace zip {
+
+    /**
+     * Just enough of the zip format to find entries from the central
+     * directory and unpack them, for backends that can't hand libzippp a
+     * local file, and to write archives laid out the way the reader wants.
+     */
+
+    const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+    const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+    const uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+    const uint32_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06064b50;
+    const uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+
+    const size_t LOCAL_HEADER_SIZE = 30;
+    const size_t CENTRAL_HEADER_SIZE = 46;
+    const size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+    const size_t ZIP64_LOCATOR_SIZE = 20;
+    const size_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE = 56;
+    // the end of central directory record ends with a comment of up to 64k
+    const size_t MAX_END_OF_CENTRAL_DIRECTORY_SIZE = END_OF_CENTRAL_DIRECTORY_SIZE + 0xFFFF;
+
+    const uint16_t METHOD_STORE = 0;
+    const uint16_t METHOD_DEFLATE = 8;
+
+    struct Entry {
+      std::string name;
+      uint16_t method;
+      uint32_t crc;
+      uint64_t compressedSize;
+      uint64_t size;
+      uint64_t localHeaderOffset;
+    };
+
+    struct CentralDirectory {
+      uint64_t offset;
+      uint64_t size;
+      uint64_t entries;
+    };
+
+    uint16_t readU16(const std::vector<char>& data, size_t at) {
+      if (at + 2 > data.size()) {
+        throw IOException("truncated zip record");
+      }
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data() + at);
+      return p[0] | (p[1] << 8);
+    }
+
+    uint32_t readU32(const std::vector<char>& data, size_t at) {
+      return readU16(data, at) | ((uint32_t) readU16(data, at + 2) << 16);
+    }
+
+    uint64_t readU64(const std::vector<char>& data, size_t at) {
+      return readU32(data, at) | ((uint64_t) readU32(data, at + 4) << 32);
+    }
+
+    CentralDirectory readZip64EndOfCentralDirectory(const std::vector<char>& record) {
+      if (readU32(record, 0) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+        throw IOException("bad zip64 end of central directory record");
+      }
+      CentralDirectory directory;
+      directory.entries = readU64(record, 32);
+      directory.size = readU64(record, 40);
+      directory.offset = readU64(record, 48);
+      return directory;
+    }
+
+    /**
+     * Find the central directory from the tail of an archive.
+     * tail holds the last bytes of the archive, which starts at tailOffset.
+     * If the zip64 record is not inside tail, zip64Offset is set to where it
+     * lives and the returned directory is empty; read it and call
+     * readZip64EndOfCentralDirectory.
+     */
+    CentralDirectory readEndOfCentralDirectory(
+        const std::vector<char>& tail,
+        uint64_t tailOffset,
+        uint64_t* zip64Offset) {
+      *zip64Offset = 0;
+      if (tail.size() < END_OF_CENTRAL_DIRECTORY_SIZE) {
+        throw IOException("archive too small to be a zip file");
+      }
+
+      size_t at = tail.size() - END_OF_CENTRAL_DIRECTORY_SIZE;
+      while (readU32(tail, at) != END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+        if (at == 0 || tail.size() - at > MAX_END_OF_CENTRAL_DIRECTORY_SIZE) {
+          throw IOException("no end of central directory record found");
+        }
+        at--;
+      }
+
+      CentralDirectory directory;
+      directory.entries = readU16(tail, at + 10);
+      directory.size = readU32(tail, at + 12);
+      directory.offset = readU32(tail, at + 16);
+
+      bool zip64 = directory.entries == 0xFFFF
+          || directory.size == 0xFFFFFFFF
+          || directory.offset == 0xFFFFFFFF;
+      if (!zip64) {
+        return directory;
+      }
+
+      if (at < ZIP64_LOCATOR_SIZE
+          || readU32(tail, at - ZIP64_LOCATOR_SIZE) != ZIP64_LOCATOR_SIGNATURE) {
+        throw IOException("zip64 archive without a zip64 locator");
+      }
+      uint64_t recordOffset = readU64(tail, at - ZIP64_LOCATOR_SIZE + 8);
+      if (recordOffset < tailOffset) {
+        *zip64Offset = recordOffset;
+        return { 0, 0, 0 };
+      }
+
+      if (recordOffset - tailOffset > tail.size() - ZIP64_LOCATOR_SIZE) {
+        throw IOException("zip64 end of central directory record past the end of the archive");
+      }
+      std::vector<char> record(
+          tail.begin() + (recordOffset - tailOffset),
+          tail.end());
+      return readZip64EndOfCentralDirectory(record);
+    }
+
+    /**
+     * Parse every entry from the raw central directory.
+     */
+    std::vector<Entry> readCentralDirectory(const std::vector<char>& data) {
+      std::vector<Entry> entries;
+      size_t at = 0;
+      while (at + CENTRAL_HEADER_SIZE <= data.size()
+          && readU32(data, at) == CENTRAL_HEADER_SIGNATURE) {
+        Entry entry;
+        entry.method = readU16(data, at + 10);
+        entry.crc = readU32(data, at + 16);
+        entry.compressedSize = readU32(data, at + 20);
+        entry.size = readU32(data, at + 24);
+        uint16_t nameLength = readU16(data, at + 28);
+        uint16_t extraLength = readU16(data, at + 30);
+        uint16_t commentLength = readU16(data, at + 32);
+        entry.localHeaderOffset = readU32(data, at + 42);
+
+        size_t nameAt = at + CENTRAL_HEADER_SIZE;
+        if (nameAt + nameLength + extraLength > data.size()) {
+          throw IOException("truncated central directory");
+        }
+        entry.name = std::string(data.data() + nameAt, nameLength);
+
+        // zip64 sizes live in an extra field, in this order, only for the
+        // fields that overflowed
+        size_t extraAt = nameAt + nameLength;
+        size_t extraEnd = extraAt + extraLength;
+        while (extraAt + 4 <= extraEnd) {
+          uint16_t id = readU16(data, extraAt);
+          uint16_t length = readU16(data, extraAt + 2);
+          size_t field = extraAt + 4;
+          if (id == 0x0001) {
+            if (entry.size == 0xFFFFFFFF) {
+              entry.size = readU64(data, field);
+              field += 8;
+            }
+            if (entry.compressedSize == 0xFFFFFFFF) {
+              entry.compressedSize = readU64(data, field);
+              field += 8;
+            }
+            if (entry.localHeaderOffset == 0xFFFFFFFF) {
+              entry.localHeaderOffset = readU64(data, field);
+            }
+          }
+          extraAt += 4 + length;
+        }
+
+        entries.push_back(entry);
+        at = extraEnd + commentLength;
+      }
+      return entries;
+    }
+
+    /**
+     * Where each entry's bytes end: at the next local header in the file,
+     * or at the central directory for the last one. Covers the local
+     * header, the data and any data descriptor.
+     */
+    std::vector<uint64_t> spanEnds(const std::vector<Entry>& entries, uint64_t directoryOffset) {
+      std::vector<size_t> byOffset;
+      for (size_t i = 0; i < entries.size(); i++) {
+        byOffset.push_back(i);
+      }
+      std::sort(byOffset.begin(), byOffset.end(), [&](size_t a, size_t b) {
+        return entries[a].localHeaderOffset < entries[b].localHeaderOffset;
+      });
+      std::vector<uint64_t> ends(entries.size());
+      for (size_t i = 0; i < byOffset.size(); i++) {
+        ends[byOffset[i]] = i + 1 < byOffset.size()
+            ? entries[byOffset[i + 1]].localHeaderOffset
+            : directoryOffset;
+      }
+      return ends;
+    }
+
+    /**
+     * Given an entry's local header at data[at], return where its compressed
+     * data starts relative to the header.
+     */
+    size_t localDataOffset(const std::vector<char>& data, size_t at = 0) {
+      if (readU32(data, at) != LOCAL_HEADER_SIGNATURE) {
+        throw IOException("bad local file header");
+      }
+      return LOCAL_HEADER_SIZE + readU16(data, at + 26) + readU16(data, at + 28);
+    }
+
+    /**
+     * Unpack an entry's compressed bytes
+     */
+    std::vector<char> extract(
+        const Entry& entry,
+        const char* compressed,
+        size_t compressedSize) {
+      if (entry.method == METHOD_STORE) {
+        return std::vector<char>(compressed, compressed + compressedSize);
+      }
+      if (entry.method != METHOD_DEFLATE) {
+        throw IOException(tfm::format(
+            "unsupported compression method %d for %s",
+            entry.method, entry.name));
+      }
+
+      std::vector<char> output(entry.size);
+      z_stream stream = {};
+      // negative window bits: raw deflate, zip has no zlib header
+      if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        throw IOException("failed to initialize inflate");
+      }
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed));
+      stream.avail_in = compressedSize;
+      stream.next_out = reinterpret_cast<Bytef*>(output.data());
+      stream.avail_out = output.size();
+      int result = inflate(&stream, Z_FINISH);
+      std::string reason = stream.msg == NULL ? "size mismatch" : stream.msg;
+      bool complete = result == Z_STREAM_END && stream.total_out == entry.size;
+      inflateEnd(&stream);
+      if (!complete) {
+        throw IOException(tfm::format(
+            "failed to inflate %s, reason: %s",
+            entry.name, reason));
+      }
+      return output;
+    }
+
+    /**
+     * Unpack an entry a piece at a time, reading its compressed bytes only
+     * as they are needed. read(from, count) returns count compressed bytes
+     * from offset from of the entry's data. consume is handed at most
+     * chunkSize bytes at a time and returns false to stop early. Throws
+     * IOException if the entry turns out not to inflate, as far as it was
+     * read.
+     */
+    void extractChunks(
+        const Entry& entry,
+        size_t chunkSize,
+        std::function<std::vector<char>(uint64_t, uint64_t)> read,
+        std::function<bool(const char*, size_t)> consume) {
+      if (entry.method == METHOD_STORE) {
+        for (uint64_t at = 0; at < entry.compressedSize; at += chunkSize) {
+          std::vector<char> chunk = read(at, std::min<uint64_t>(chunkSize, entry.compressedSize - at));
+          if (!consume(chunk.data(), chunk.size())) {
+            return;
+          }
+        }
+        return;
+      }
+      if (entry.method != METHOD_DEFLATE) {
+        throw IOException(tfm::format(
+            "unsupported compression method %d for %s",
+            entry.method, entry.name));
+      }
+
+      z_stream stream = {};
+      if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        throw IOException("failed to initialize inflate");
+      }
+      std::vector<char> input;
+      std::vector<char> output(chunkSize);
+      uint64_t consumed = 0;
+      int result = Z_OK;
+      try {
+        while (result == Z_OK) {
+          if (stream.avail_in == 0) {
+            if (consumed == entry.compressedSize) {
+              break;
+            }
+            input = read(consumed, std::min<uint64_t>(chunkSize, entry.compressedSize - consumed));
+            consumed += input.size();
+            stream.next_in = reinterpret_cast<Bytef*>(input.data());
+            stream.avail_in = input.size();
+          }
+          stream.next_out = reinterpret_cast<Bytef*>(output.data());
+          stream.avail_out = output.size();
+          result = inflate(&stream, Z_NO_FLUSH);
+          size_t produced = output.size() - stream.avail_out;
+          if ((result == Z_OK || result == Z_STREAM_END)
+              && produced > 0 && !consume(output.data(), produced)) {
+            inflateEnd(&stream);
+            return;
+          }
+        }
+      } catch (...) {
+        inflateEnd(&stream);
+        throw;
+      }
+      std::string reason = stream.msg == NULL ? "size mismatch" : stream.msg;
+      bool complete = result == Z_STREAM_END && stream.total_out == entry.size;
+      inflateEnd(&stream);
+      if (!complete) {
+        throw IOException(tfm::format(
+            "failed to inflate %s, reason: %s",
+            entry.name, reason));
+      }
+    }
+
+    /**
+     * The first length bytes of an entry's contents, or all of them if it
+     * is shorter, reading little more of its compressed bytes than that
+     * takes. read is as for extractChunks.
+     */
+    std::vector<char> extractPrefix(
+        const Entry& entry,
+        size_t length,
+        std::function<std::vector<char>(uint64_t, uint64_t)> read) {
+      std::vector<char> prefix;
+      if (length == 0) {
+        return prefix;
+      }
+      extractChunks(entry, 4096, read, [&](const char* data, size_t size) {
+        prefix.insert(prefix.end(), data, data + std::min(size, length - prefix.size()));
+        return prefix.size() < length;
+      });
+      return prefix;
+    }
+
+    /**
+     * Writes an archive front to back: each entry's local header and data
+     * as it is added, the central directory on finish. Switches to zip64
+     * records only for the entries, or the directory, that need them.
+     */
+    class Writer {
+      private:
+        std::ofstream out;
+        std::string path;
+        std::vector<Entry> entries;
+        uint64_t offset = 0;
+        uint16_t time;
+        uint16_t date;
+
+        static void putU16(std::vector<char>& data, uint16_t value) {
+          data.push_back(value & 0xff);
+          data.push_back(value >> 8);
+        }
+
+        static void putU32(std::vector<char>& data, uint32_t value) {
+          putU16(data, value & 0xffff);
+          putU16(data, value >> 16);
+        }
+
+        static void putU64(std::vector<char>& data, uint64_t value) {
+          putU32(data, value & 0xffffffff);
+          putU32(data, value >> 32);
+        }
+
+        static uint32_t clamp32(uint64_t value) {
+          return value >= 0xFFFFFFFF ? 0xFFFFFFFF : value;
+        }
+
+        /**
+         * bit 11 says the name is UTF-8, which only matters if it isn't ASCII
+         */
+        static uint16_t flagsFor(const std::string& name) {
+          for (unsigned char c : name) {
+            if (c >= 0x80) {
+              return 1 << 11;
+            }
+          }
+          return 0;
+        }
+
+        /**
+         * the zip64 extra field with the values that overflowed, in the
+         * order the format wants them
+         */
+        static std::vector<char> zip64Extra(const Entry& entry, bool withOffset) {
+          std::vector<char> values;
+          if (entry.size >= 0xFFFFFFFF) {
+            putU64(values, entry.size);
+          }
+          if (entry.compressedSize >= 0xFFFFFFFF) {
+            putU64(values, entry.compressedSize);
+          }
+          if (withOffset && entry.localHeaderOffset >= 0xFFFFFFFF) {
+            putU64(values, entry.localHeaderOffset);
+          }
+          std::vector<char> extra;
+          if (!values.empty()) {
+            putU16(extra, 0x0001);
+            putU16(extra, values.size());
+            extra.insert(extra.end(), values.begin(), values.end());
+          }
+          return extra;
+        }
+
+        void write(const std::vector<char>& data) {
+          this->write(data.data(), data.size());
+        }
+
+        void write(const char* data, size_t length) {
+          this->out.write(data, length);
+          if (!this->out) {
+            throw IOException(tfm::format("failed to write %s", this->path));
+          }
+          this->offset += length;
+        }
+
+        static std::vector<char> deflate(const char* data, size_t length) {
+          z_stream stream = {};
+          // negative window bits: raw deflate, zip has no zlib header
+          if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw IOException("failed to initialize deflate");
+          }
+          std::vector<char> output(deflateBound(&stream, length));
+          stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+          stream.avail_in = length;
+          stream.next_out = reinterpret_cast<Bytef*>(output.data());
+          stream.avail_out = output.size();
+          int result = ::deflate(&stream, Z_FINISH);
+          output.resize(stream.total_out);
+          deflateEnd(&stream);
+          if (result != Z_STREAM_END) {
+            throw IOException("failed to deflate");
+          }
+          return output;
+        }
+
+      public:
+        Writer(std::string path) :
+            out(path, std::ios::binary | std::ios::trunc), path(path) {
+          if (!this->out) {
+            throw IOException(tfm::format("failed to create %s", path));
+          }
+          std::time_t now = std::time(NULL);
+          std::tm local = *std::localtime(&now);
+          this->time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+          this->date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+        }
+
+        /**
+         * Append an entry, deflated if asked and if that makes it smaller,
+         * stored otherwise. Returns what the directory will say about it.
+         */
+        Entry add(const std::string& name, const char* data, size_t length, bool compress) {
+          Entry entry;
+          entry.name = name;
+          entry.crc = Crc32::compute(0, data, length);
+          entry.size = length;
+          entry.localHeaderOffset = this->offset;
+
+          std::vector<char> deflated;
+          if (compress) {
+            deflated = deflate(data, length);
+          }
+          bool stored = !compress || deflated.size() >= length;
+          entry.method = stored ? METHOD_STORE : METHOD_DEFLATE;
+          entry.compressedSize = stored ? length : deflated.size();
+
+          std::vector<char> extra = zip64Extra(entry, false);
+          std::vector<char> header;
+          putU32(header, LOCAL_HEADER_SIGNATURE);
+          putU16(header, extra.empty() ? 20 : 45);
+          putU16(header, flagsFor(name));
+          putU16(header, entry.method);
+          putU16(header, this->time);
+          putU16(header, this->date);
+          putU32(header, entry.crc);
+          putU32(header, clamp32(entry.compressedSize));
+          putU32(header, clamp32(entry.size));
+          putU16(header, name.size());
+          putU16(header, extra.size());
+          header.insert(header.end(), name.begin(), name.end());
+          header.insert(header.end(), extra.begin(), extra.end());
+          this->write(header);
+          if (stored) {
+            this->write(data, length);
+          } else {
+            this->write(deflated);
+          }
+          this->entries.push_back(entry);
+          return entry;
+        }
+
+        Entry add(const std::string& name, const std::vector<char>& data, bool compress) {
+          return this->add(name, data.data(), data.size(), compress);
+        }
+
+        /**
+         * Write the central directory and close the file
+         */
+        void finish() {
+          uint64_t directoryOffset = this->offset;
+          std::vector<char> directory;
+          for (const Entry& entry : this->entries) {
+            std::vector<char> extra = zip64Extra(entry, true);
+            putU32(directory, CENTRAL_HEADER_SIGNATURE);
+            // made by: unix, spec 4.5
+            putU16(directory, (3 << 8) | 45);
+            putU16(directory, extra.empty() ? 20 : 45);
+            putU16(directory, flagsFor(entry.name));
+            putU16(directory, entry.method);
+            putU16(directory, this->time);
+            putU16(directory, this->date);
+            putU32(directory, entry.crc);
+            putU32(directory, clamp32(entry.compressedSize));
+            putU32(directory, clamp32(entry.size));
+            putU16(directory, entry.name.size());
+            putU16(directory, extra.size());
+            // comment length, disk, internal attributes
+            putU16(directory, 0);
+            putU16(directory, 0);
+            putU16(directory, 0);
+            // external attributes: a regular file, rw-r--r--
+            putU32(directory, 0100644u << 16);
+            putU32(directory, clamp32(entry.localHeaderOffset));
+            directory.insert(directory.end(), entry.name.begin(), entry.name.end());
+            directory.insert(directory.end(), extra.begin(), extra.end());
+          }
+          this->write(directory);
+
+          uint64_t count = this->entries.size();
+          bool zip64 = count >= 0xFFFF || directory.size() >= 0xFFFFFFFF || directoryOffset >= 0xFFFFFFFF;
+          std::vector<char> end;
+          if (zip64) {
+            uint64_t recordOffset = this->offset;
+            putU32(end, ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE);
+            putU64(end, ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE - 12);
+            putU16(end, (3 << 8) | 45);
+            putU16(end, 45);
+            putU32(end, 0);
+            putU32(end, 0);
+            putU64(end, count);
+            putU64(end, count);
+            putU64(end, directory.size());
+            putU64(end, directoryOffset);
+            putU32(end, ZIP64_LOCATOR_SIGNATURE);
+            putU32(end, 0);
+            putU64(end, recordOffset);
+            putU32(end, 1);
+          }
+          putU32(end, END_OF_CENTRAL_DIRECTORY_SIGNATURE);
+          putU16(end, 0);
+          putU16(end, 0);
+          putU16(end, zip64 ? 0xFFFF : count);
+          putU16(end, zip64 ? 0xFFFF : count);
+          putU32(end, zip64 ? 0xFFFFFFFF : directory.size());
+          putU32(end, zip64 ? 0xFFFFFFFF : directoryOffset);
+          putU16(end, 0);
+          this->write(end);
+          this->out.close();
+          if (!this->out) {
+            throw IOException(tfm::format("failed to write %s", this->path));
+          }
+        }
+    };
+
+  }
+}
@@ -3,6 +3,9 @@
 #include <vector>
 #include <locale>
 #include <sstream>
+#include <cstdint>
+#include <filesystem>
+#include <SDL.h>
 #include <neither.h>
 
 namespace app {
@@ -83,6 +86,42 @@ namespace app {
     return stream.str();
   }
 
+  /**
+   * 64 bit FNV-1a, stable across builds so it can name files on disk
+   */
+  uint64_t fnv1a(const std::string& data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  /**
+   * Directory for persistent per-user state, created if missing.
+   * Empty if there is nowhere to write.
+   */
+  std::string prefPath(std::string subdirectory) {
+    char* base = SDL_GetPrefPath("laconic-code", "cbzreader");
+    if (base == NULL) {
+      return "";
+    }
+    std::string dir = std::string(base) + subdirectory;
+    SDL_free(base);
+
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    return error ? "" : dir;
+  }
+
+  /**
+   * True if the path names a remote resource rather than a local file
+   */
+  bool isUrl(const std::string& path) {
+    return path.rfind("http://", 0) == 0;
+  }
+
   void waitForAnyKey() {
     SDL_Event event;
 
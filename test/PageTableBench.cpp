@@ -0,0 +1,90 @@
+/**
+ * Times building and sorting the page table of 50,000 entries in random
+ * order, against sorting the names as a std::vector<std::string>, and
+ * checks every page can be found by name again. Two layouts: one
+ * directory of pages, and 50 volumes of 1000 pages each.
+ *
+ *     g++ -std=c++17 -O2 -I. test/PageTableBench.cpp -o PageTableBench
+ *
+ * Exits non zero if a lookup fails.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <tinyformat.h>
+#include <src/PageTable.h>
+
+namespace {
+
+  const int PAGES = 50000;
+
+  double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  std::vector<app::ArchiveEntry> entries(int volumes) {
+    std::vector<app::ArchiveEntry> entries;
+    for (int volume = 0; volume < volumes; volume++) {
+      for (int page = 0; page < PAGES / volumes; page++) {
+        std::string name = volumes == 1
+            ? tfm::format("Book/%d.png", page)
+            : tfm::format("Series Name/Volume %d/page%d.jpg", volume + 1, page);
+        entries.push_back(app::ArchiveEntry { name, entries.size(), 0, 100000, 120000 });
+      }
+    }
+    // what real archives carry besides pages
+    entries.push_back(app::ArchiveEntry { "ComicInfo.xml", entries.size(), 0, 0, 0 });
+    entries.push_back(app::ArchiveEntry { "__MACOSX/._page1.jpg", entries.size(), 0, 0, 0 });
+    entries.push_back(app::ArchiveEntry { "Series Name/", entries.size(), 0, 0, 0 });
+    std::shuffle(entries.begin(), entries.end(), std::mt19937(7));
+    return entries;
+  }
+
+  bool run(std::string layout, int volumes) {
+    std::vector<app::ArchiveEntry> shuffled = entries(volumes);
+
+    auto start = std::chrono::steady_clock::now();
+    app::PageTable table;
+    table.reserve(shuffled.size());
+    for (const app::ArchiveEntry& entry : shuffled) {
+      if (app::PageTable::classify(entry.name) == app::PageTable::Kind::Image) {
+        table.add(entry);
+      }
+    }
+    double built = since(start);
+    start = std::chrono::steady_clock::now();
+    table.sort();
+    double sorted = since(start);
+
+    std::vector<std::string> names;
+    for (const app::ArchiveEntry& entry : shuffled) {
+      names.push_back(entry.name);
+    }
+    start = std::chrono::steady_clock::now();
+    std::sort(names.begin(), names.end());
+    double strings = since(start);
+
+    std::cout << tfm::format(
+        "%s: %d pages, build %.1f ms, sort %.1f ms, %d KiB; std::sort of strings %.1f ms",
+        layout, table.size(), built, sorted, table.bytes() / 1024, strings) << std::endl;
+
+    for (size_t page = 0; page < table.size(); page++) {
+      neither::Maybe<size_t> found = table.find(table.getName(page));
+      if (!found.hasValue || found.unsafeGet() != page) {
+        std::cout << tfm::format("FAIL: %s is not found as page %d", table.getName(page), page) << std::endl;
+        return false;
+      }
+    }
+    return table.size() == PAGES;
+  }
+
+}
+
+int main() {
+  bool ok = run("one directory", 1);
+  ok = run("50 volumes", 50) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/**
+ * Reads an archive over HTTP the way the reader does, against
+ * test/range_server.py, and checks the block cache gives up the blocks of
+ * a read that failed half way. test/remote_archive_test.sh builds and runs
+ * it.
+ *
+ *     RemoteArchiveTest <url of an archive> <cache dir>
+ *
+ * Exits non zero on the first failed check.
+ */
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include <tinyformat.h>
+#include <src/BlockCache.h>
+#include <src/HttpRangeSource.h>
+#include <src/RangeSource.h>
+#include <src/RemoteArchive.h>
+
+namespace {
+
+  int failures = 0;
+
+  void check(bool ok, std::string what) {
+    std::cout << (ok ? "ok:   " : "FAIL: ") << what << std::endl;
+    if (!ok) {
+      failures++;
+    }
+  }
+
+  /**
+   * bytes in memory, failing the read it is told to
+   */
+  class FlakySource: public app::RangeSource {
+    private:
+      std::vector<char> data;
+
+    public:
+      // the read that throws, counting from 1, 0 for none
+      int failAt = 0;
+      int reads = 0;
+
+      FlakySource(size_t size) {
+        for (size_t i = 0; i < size; i++) {
+          this->data.push_back((char) (i * 31));
+        }
+      }
+
+      uint64_t size() {
+        return this->data.size();
+      }
+
+      std::vector<char> read(uint64_t offset, uint64_t length) {
+        if (++this->reads == this->failAt) {
+          throw app::IOException("injected failure");
+        }
+        return std::vector<char>(this->data.begin() + offset, this->data.begin() + offset + length);
+      }
+  };
+
+  /**
+   * Every entry comes back whole, and the first page takes no more than
+   * two round trips after the ones to open the archive. The start of an
+   * entry, stored or deflated, costs one.
+   */
+  void remote(std::string url, std::string cacheDir) {
+    std::filesystem::remove_all(cacheDir);
+    app::RemoteArchive archive(new app::HttpRangeSource(url), new app::HttpRangeSource(url), cacheDir);
+    size_t opened = archive.requests();
+    std::vector<std::string> names = archive.getNames();
+    check(names.size() >= 4, tfm::format("opened %s in %d requests, %d entries", url, opened, names.size()));
+
+    std::vector<std::vector<char>> prefixes;
+    for (size_t i = names.size() - 2; i < names.size(); i++) {
+      prefixes.push_back(archive.readPrefix(names[i], 12));
+    }
+    size_t sniffed = archive.requests() - opened;
+    check(sniffed <= 2, tfm::format("the starts of two entries in %d round trips", sniffed));
+    opened = archive.requests();
+    archive.setReadingOrder(names);
+    archive.read(names[0]);
+    size_t first = archive.requests() - opened;
+    check(first <= 2, tfm::format("first entry in %d round trips", first));
+
+    bool intact = true;
+    for (const std::string& name : names) {
+      std::vector<char> data = archive.read(name);
+      uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size());
+      intact = intact && crc == archive.getCrc(name);
+    }
+    check(intact, "every entry matches its crc");
+    bool prefixed = true;
+    for (size_t i = 0; i < prefixes.size(); i++) {
+      std::vector<char> data = archive.read(names[names.size() - 2 + i]);
+      prefixed = prefixed && prefixes[i] == std::vector<char>(data.begin(), data.begin() + 12);
+    }
+    check(prefixed, "and starts the way readPrefix said");
+  }
+
+  /**
+   * A read whose blocks are fetched in several runs, the first of which
+   * fails, must not leave the others claimed: reading them again would
+   * wait forever.
+   */
+  void failedRun(std::string cacheDir) {
+    std::filesystem::remove_all(cacheDir);
+    const uint64_t block = 4096;
+    FlakySource source(64 * 1024);
+    app::BlockCache cache(&source, &source, cacheDir, block);
+    uint64_t tailOffset;
+    cache.readTail(block, &tailOffset);
+    // block 1 present splits a read of blocks 0 to 2 into two runs
+    cache.read(block, block);
+    source.failAt = source.reads + 1;
+    bool threw = false;
+    try {
+      cache.read(0, 3 * block);
+    } catch (app::IOException& e) {
+      threw = true;
+    }
+    check(threw, "a read with a failing run throws");
+
+    auto again = std::async(std::launch::async, [&]() {
+      return cache.read(0, 3 * block);
+    });
+    bool finished = again.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    check(finished, "the blocks of the failed read can be read again");
+    if (!finished) {
+      // the thread is stuck on the cache, nothing left to clean up after
+      std::cout.flush();
+      std::_Exit(1);
+    }
+    std::vector<char> data = again.get();
+    check(data == source.read(0, 3 * block), "and come back right");
+    std::filesystem::remove_all(cacheDir);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "usage: RemoteArchiveTest <url of an archive> <cache dir>" << std::endl;
+    return 2;
+  }
+  failedRun(std::string(argv[2]) + "/flaky");
+  try {
+    remote(argv[1], std::string(argv[2]) + "/remote");
+  } catch (...) {
+    check(false, tfm::format("reading %s threw", argv[1]));
+  }
+  return failures == 0 ? 0 : 1;
+}
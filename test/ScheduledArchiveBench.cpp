@@ -0,0 +1,86 @@
+/**
+ * Reads every page of a local archive from a cold page cache, once page by
+ * page the way LocalArchive did and once with the reader's read-ahead
+ * hints through ScheduledArchive, and prints how long each took.
+ * test/scheduled_archive_bench.sh builds it and makes an archive for it.
+ *
+ *     ScheduledArchiveBench <archive> [rounds] [decode ms per page]
+ *
+ * The page cache is dropped through /proc/sys/vm/drop_caches before every
+ * run, so it has to run as root. The decode time is spent spinning after
+ * each page, standing in for the decoder the reads overlap with.
+ */
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <tinyformat.h>
+#include <src/Metrics.h>
+#include <src/ScheduledArchive.h>
+
+namespace {
+
+  // pages the reader hints about at a time, and how often it does
+  const size_t HINT_PAGES = 16;
+  const size_t HINT_EVERY = 8;
+
+  void dropCaches() {
+    sync();
+    std::ofstream out("/proc/sys/vm/drop_caches");
+    out << "3" << std::endl;
+    if (!out) {
+      std::cerr << "failed to drop the page cache, run as root" << std::endl;
+      std::exit(2);
+    }
+  }
+
+  void decode(double ms) {
+    auto until = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(ms);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+  }
+
+  /**
+   * ms to read every page from a cold cache, hinting ahead if scheduled
+   */
+  double run(std::string path, bool scheduled, double decodeMs, size_t* requests) {
+    dropCaches();
+    size_t before = app::Metrics::global().ioRequests;
+    auto start = std::chrono::steady_clock::now();
+    app::ScheduledArchive archive(path);
+    std::vector<std::string> names = archive.getNames();
+    for (size_t i = 0; i < names.size(); i++) {
+      if (scheduled && i % HINT_EVERY == 0) {
+        archive.willRead(std::vector<std::string>(
+            names.begin() + i, names.begin() + std::min(names.size(), i + HINT_PAGES)));
+      }
+      archive.read(names[i]);
+      decode(decodeMs);
+    }
+    *requests = app::Metrics::global().ioRequests - before;
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 4) {
+    std::cerr << "usage: ScheduledArchiveBench <archive> [rounds] [decode ms per page]" << std::endl;
+    return 2;
+  }
+  int rounds = argc > 2 ? std::atoi(argv[2]) : 3;
+  double decodeMs = argc > 3 ? std::atof(argv[3]) : 0;
+  for (int round = 0; round < rounds; round++) {
+    size_t directRequests;
+    size_t scheduledRequests;
+    double direct = run(argv[1], false, decodeMs, &directRequests);
+    double scheduled = run(argv[1], true, decodeMs, &scheduledRequests);
+    std::cout << tfm::format(
+        "direct %.0f ms in %d reads, scheduled %.0f ms in %d reads",
+        direct, directRequests, scheduled, scheduledRequests) << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""
+A stand-in for the HTTP file server the library is read from: serves a
+directory with single-range GET requests, and can add latency to each
+request to make round trips show.
+
+    test/range_server.py --root DIR --port 8000 --latency 50
+
+Each request is logged to stderr with the range asked for, so tests can
+count round trips.
+"""
+
+import argparse
+import http.server
+import os
+import re
+import sys
+import time
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    root = "."
+    latency = 0.0
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_GET(self):
+        time.sleep(self.latency)
+        path = os.path.join(self.root, self.path.lstrip("/").split("?")[0])
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return
+        total = os.path.getsize(path)
+        start, end = 0, total - 1
+        status = 200
+        header = self.headers.get("Range")
+        if header is not None:
+            match = re.fullmatch(r"bytes=(\d*)-(\d*)", header.strip())
+            if match is None:
+                self.send_error(416)
+                return
+            first, last = match.groups()
+            if first == "":
+                start = max(0, total - int(last))
+            else:
+                start = int(first)
+                if last != "":
+                    end = min(int(last), total - 1)
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % total)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+        print("%s %s" % (self.path, header or "-"), file=sys.stderr, flush=True)
+        self.send_response(status)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, total))
+        self.end_headers()
+        with open(path, "rb") as data:
+            data.seek(start)
+            self.wfile.write(data.read(end - start + 1))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--root", default=".", help="directory to serve")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--latency", type=float, default=0, help="ms to wait before answering each request")
+    options = parser.parse_args()
+    Handler.root = options.root
+    Handler.latency = options.latency / 1000
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", options.port), Handler)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Build test/RemoteArchiveTest.cpp, serve a generated archive through
+# test/range_server.py with LATENCY ms per request, and run the test
+# against it. Run from the repository root. CXXFLAGS can point at the
+# tinyformat headers.
+set -e
+LATENCY=${LATENCY:-50}
+PORT=${PORT:-8765}
+work=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$work"' EXIT
+
+${CXX:-g++} -std=c++17 -O1 -I. $CXXFLAGS test/RemoteArchiveTest.cpp -o "$work/RemoteArchiveTest" -lz -lpthread
+
+python3 - "$work/book.cbz" <<'PY'
+import random, sys, zipfile
+random.seed(1)
+with zipfile.ZipFile(sys.argv[1], "w") as archive:
+    for page in range(40):
+        data = bytes(random.randrange(256) for _ in range(random.randrange(50000, 400000)))
+        method = zipfile.ZIP_STORED if page % 2 else zipfile.ZIP_DEFLATED
+        archive.writestr("page%02d.jpg" % page, data, compress_type=method)
+PY
+
+python3 test/range_server.py --root "$work" --port "$PORT" --latency "$LATENCY" 2> "$work/requests.log" &
+server=$!
+sleep 1
+"$work/RemoteArchiveTest" "http://127.0.0.1:$PORT/book.cbz" "$work/cache"
+echo "$(wc -l < "$work/requests.log") requests served"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Build test/ScheduledArchiveBench.cpp, generate a stored archive of PAGES
+# incompressible pages, and time reading it from a cold page cache with
+# and without read-ahead hints, ROUNDS times, spending DECODE_MS per page.
+# Drops the page cache, so run as root. Run from the repository root.
+# CXXFLAGS can point at the tinyformat headers, or add -DCBZ_IO_URING
+# (with LDFLAGS=-luring) to measure the io_uring backend.
+set -e
+PAGES=${PAGES:-300}
+ROUNDS=${ROUNDS:-3}
+DECODE_MS=${DECODE_MS:-0}
+work=$(mktemp -d "${TMPDIR:-/var/tmp}/cbzbench.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+
+${CXX:-g++} -std=c++17 -O2 -I. $CXXFLAGS test/ScheduledArchiveBench.cpp -o "$work/ScheduledArchiveBench" -lz -lpthread $LDFLAGS
+
+python3 - "$work/book.cbz" "$PAGES" <<'PY'
+import os, random, sys, zipfile
+random.seed(1)
+with zipfile.ZipFile(sys.argv[1], "w", zipfile.ZIP_STORED) as archive:
+    for page in range(int(sys.argv[2])):
+        archive.writestr("page%03d.jpg" % page, os.urandom(random.randrange(200000, 600000)))
+PY
+
+echo "$(du -h "$work/book.cbz" | cut -f1) in $PAGES pages, $DECODE_MS ms of decode per page"
+"$work/ScheduledArchiveBench" "$work/book.cbz" "$ROUNDS" "$DECODE_MS"